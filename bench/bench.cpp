@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "measure.h"
+#include "midi_gen.h"
+#include "oscillators.h"
+#include "output_stage.h"
+#include "player.h"
+#include "regress.h"
+#include "resampler.h"
+#include "wavetables.h"
+
+#define BENCH_STRESS_PATH "midi_bench_stress.mid"
+#define BENCH_KERNEL_SAMPLES 4096
+#define BENCH_RENDER_FRAMES 4096
+#define BENCH_RESAMPLE_FRAMES 4096
+
+struct BenchOptions
+{
+    std::vector<std::string> files;
+    const char *gen_path = nullptr;     // Only generate a file when set
+    GenConfig gen;
+    uint32_t sample_rate = PLAYER_SAMPLE_RATE;
+    uint32_t device_rate = 48000;       // Resampler target
+    bool wavetables = false;
+    bool apu = false;                   // Render with the 2A03 core
+    bool preload = false;               // Render from an EventStore
+    double min_time = 0.5;              // Seconds spent on each measurement
+    RegressConfig regress;              // Regression gate when dir is set
+};
+
+static void print_usage()
+{
+    fprintf(stderr,
+        "usage: midi_bench [options] [file.mid ...]\n"
+        "Benchmarks parsing, the synth kernels and rendering. Without files, uses\n"
+        "assets/faxanadu.mid and a generated stress file.\n"
+        "  -g <path>   Write a synthetic file with the options below instead\n"
+        "  -T <count>  Generated note tracks (default 16)\n"
+        "  -n <count>  Generated notes per track (default 1000)\n"
+        "  -d <rate>   Generated notes per second in each track (default 4)\n"
+        "  -l <sec>    Generated average note length (default 0.25)\n"
+        "  -e <seed>   Generator seed (default 1)\n"
+        "  -k          Black MIDI preset, 64 tracks of 20000 short notes at 40/s\n"
+        "  -u          Generate without running status\n"
+        "  -r <rate>   Synthesis sample rate (default 44100)\n"
+        "  -D <rate>   Rate the resampler converts to (default 48000)\n"
+        "  -b          Band-limited pulse and triangle voices\n"
+        "  -A          Render with the cycle-accurate 2A03 core\n"
+        "  -E          Render from a packed event store built up front\n"
+        "  -x <sec>    Minimum time spent on each measurement (default 0.5)\n"
+        "  -G <dir>    Regression gate: check outputs and timings against the goldens in dir,\n"
+        "              exits with 4 on any regression\n"
+        "  -W          With -G, record new goldens and timing baselines instead\n"
+        "  -y <rms>    With -G, envelope difference accepted when an output changed (default 0)\n"
+        "  -P <pct>    With -G, slowdown over the baselines that fails (default 25, -1 skips).\n"
+        "              The baselines are per machine, checking without them fails.\n");
+}
+
+static bool parse_args(int argc, char **argv, BenchOptions *pOptions)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (arg[0] != '-')
+        {
+            pOptions->files.push_back(arg);
+            continue;
+        }
+        if (strcmp(arg, "-k") == 0)
+        {
+            gen_black_midi(&pOptions->gen);
+            continue;
+        }
+        if (strcmp(arg, "-b") == 0)
+        {
+            pOptions->wavetables = true;
+            continue;
+        }
+        if (strcmp(arg, "-A") == 0)
+        {
+            pOptions->apu = true;
+            continue;
+        }
+        if (strcmp(arg, "-E") == 0)
+        {
+            pOptions->preload = true;
+            continue;
+        }
+        if (strcmp(arg, "-u") == 0)
+        {
+            pOptions->gen.running_status = false;
+            continue;
+        }
+        if (strcmp(arg, "-W") == 0)
+        {
+            pOptions->regress.write = true;
+            continue;
+        }
+        if (!val || arg[2] != '\0') return false;
+        ++i;
+        switch (arg[1])
+        {
+            case 'g': pOptions->gen_path = val; break;
+            case 'T':
+                pOptions->gen.track_count = atoi(val);
+                if (pOptions->gen.track_count <= 0 || pOptions->gen.track_count > 65534) return false;
+                break;
+            case 'n':
+                pOptions->gen.notes_per_track = (uint32_t)atoi(val);
+                if (pOptions->gen.notes_per_track == 0) return false;
+                break;
+            case 'd':
+                pOptions->gen.notes_per_second = atof(val);
+                if (pOptions->gen.notes_per_second <= 0.0) return false;
+                break;
+            case 'l':
+                pOptions->gen.note_length = atof(val);
+                if (pOptions->gen.note_length <= 0.0) return false;
+                break;
+            case 'e': pOptions->gen.seed = (uint32_t)strtoul(val, nullptr, 10); break;
+            case 'r':
+                pOptions->sample_rate = (uint32_t)atoi(val);
+                if (pOptions->sample_rate == 0) return false;
+                break;
+            case 'D':
+                pOptions->device_rate = (uint32_t)atoi(val);
+                if (pOptions->device_rate == 0) return false;
+                break;
+            case 'x':
+                pOptions->min_time = atof(val);
+                if (pOptions->min_time <= 0.0) return false;
+                break;
+            case 'G': pOptions->regress.dir = val; break;
+            case 'y':
+                pOptions->regress.tolerance = atof(val);
+                if (pOptions->regress.tolerance < 0.0) return false;
+                break;
+            case 'P': pOptions->regress.slowdown = atof(val); break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool bench_parse(const char *path, const BenchOptions& options)
+{
+    MidiFile file;
+    if (!midi_open(&file, path))
+    {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return false;
+    }
+    size_t size = file.size;
+    midi_close(&file);
+
+    // Opening only indexes the chunks, so decode every event too
+    uint64_t eventCount = 0;
+    double seconds = measure(options.min_time, [&]
+    {
+        MidiFile file;
+        midi_open(&file, path);
+        EventStream stream;
+        stream_init(&stream, &file, (int)file.tracks.size());
+        eventCount = 0;
+        while (stream_peek(&stream))
+        {
+            stream_pop(&stream);
+            ++eventCount;
+        }
+        midi_close(&file);
+    });
+
+    printf("  parse    %8.1f MB/s  %8.2f M events/s  (%zu bytes, %llu events)\n",
+           size / seconds / 1e6, eventCount / seconds / 1e6, size, (unsigned long long)eventCount);
+
+    EventStore store;
+    seconds = measure(options.min_time, [&]
+    {
+        MidiFile file;
+        midi_open(&file, path);
+        store_build(&store, &file);
+        midi_close(&file);
+    });
+    double events = (double)std::max<uint64_t>(store.event_count, 1);
+    printf("  store    %8.1f MB/s  %8.2f bytes/event, %i as Event records\n",
+           size / seconds / 1e6, store_memory_used(&store) / events, (int)sizeof(Event));
+    return true;
+}
+
+static void bench_kernel(const char *name, const BenchOptions& options, void (*pKernel)(OscVoice*, float*, int),
+                         const OscVoice& voice)
+{
+    std::vector<float> mix(BENCH_KERNEL_SAMPLES, 0.0f);
+    OscVoice state = voice;
+    const int repeat = 64;
+    double seconds = measure(options.min_time, [&]
+    {
+        for (int i = 0; i < repeat; ++i)
+        {
+            pKernel(&state, mix.data(), BENCH_KERNEL_SAMPLES);
+        }
+    });
+    printf("  %-12s %7.3f ns/sample\n", name, seconds * 1e9 / (repeat * BENCH_KERNEL_SAMPLES));
+}
+
+static const Wavetable *s_pTable = nullptr;
+
+static void wavetable_kernel(OscVoice *pVoice, float *pMix, int count)
+{
+    wt_render(s_pTable, pVoice, pMix, count);
+}
+
+// Stereo, per output frame
+static void bench_resampler(const BenchOptions& options, int isa)
+{
+    printf("Resampler %u to %u Hz, %s:\n", options.sample_rate, options.device_rate, osc_isa_name(isa));
+    std::vector<float> input(BENCH_RESAMPLE_FRAMES * 2);
+    for (size_t i = 0; i < input.size(); ++i)
+    {
+        input[i] = (float)((i * 7919) % 2001) / 1000.0f - 1.0f;
+    }
+    std::vector<float> output(((size_t)BENCH_RESAMPLE_FRAMES * options.device_rate / options.sample_rate + 64) * 2);
+
+    for (int quality = 0; quality < RESAMPLE_QUALITY_COUNT; ++quality)
+    {
+        Resampler resampler;
+        resampler_init(&resampler, options.sample_rate, options.device_rate, 2, quality, isa);
+        uint64_t frameCount = 0;
+        double seconds = measure(options.min_time, [&]
+        {
+            frameCount = 0;
+            for (int i = 0; i < 16; ++i)
+            {
+                resampler_write(&resampler, input.data(), BENCH_RESAMPLE_FRAMES);
+                frameCount += resampler_read(&resampler, output.data(), (uint32_t)(output.size() / 2));
+            }
+        });
+        printf("  %-12s %7.3f ns/frame, %i taps\n", resample_quality_name(quality),
+               seconds * 1e9 / std::max<uint64_t>(frameCount, 1), resampler.taps);
+    }
+}
+
+static void bench_output(const BenchOptions& options, int isa)
+{
+    printf("Output stage, %s:\n", osc_isa_name(isa));
+    std::vector<float> input(BENCH_RESAMPLE_FRAMES * 2);
+    for (size_t i = 0; i < input.size(); ++i)
+    {
+        input[i] = (float)((i * 7919) % 2001) / 1000.0f - 1.0f;
+    }
+    std::vector<uint8_t> output(input.size() * sizeof(float));
+
+    static const struct { const char *name; int bus_count; int sample_type; bool dither; } CASES[] =
+    {
+        { "mono f32", 1, SAMPLE_F32, false },
+        { "s16", 2, SAMPLE_S16, false },
+        { "s16 dither", 2, SAMPLE_S16, true },
+        { "s24 dither", 2, SAMPLE_S24, true },
+    };
+    for (const auto& test : CASES)
+    {
+        OutputDither dither;
+        dither.enabled = test.dither;
+        double seconds = measure(options.min_time, [&]
+        {
+            for (int i = 0; i < 16; ++i)
+            {
+                output_convert(input.data(), test.bus_count, BENCH_RESAMPLE_FRAMES, 2, test.sample_type, &dither,
+                               isa, output.data());
+            }
+        });
+        printf("  %-12s %7.3f ns/frame\n", test.name, seconds * 1e9 / (16.0 * BENCH_RESAMPLE_FRAMES));
+    }
+}
+
+static void bench_kernels(const BenchOptions& options)
+{
+    OscVoice tone;
+    tone.step = osc_step(440.0f, options.sample_rate);
+    tone.vol = osc_vol(0.5f);
+
+    OscVoice noise;
+    noise.vol = osc_vol(0.5f);
+    osc_noise_note(&noise, 60, options.sample_rate);
+
+    for (int isa = OSC_ISA_SCALAR; isa <= OSC_ISA_AVX2; ++isa)
+    {
+        if (osc_pick_isa(isa) != isa) continue;
+        OscKernels kernels = osc_kernels(isa);
+        printf("Kernels, %s:\n", osc_isa_name(isa));
+        bench_kernel("pulse", options, kernels.pulse, tone);
+        bench_kernel("triangle", options, kernels.triangle, tone);
+        bench_kernel("noise", options, osc_noise, noise);
+        bench_resampler(options, isa);
+        bench_output(options, isa);
+    }
+
+    printf("Kernels, wavetables:\n");
+    WavetableCache cache;
+    wt_init(&cache, options.sample_rate, WT_DEFAULT_BUDGET, NOTE_FREQS, NOTE_COUNT);
+    const char *names[WT_SHAPE_COUNT] = { "pulse12", "pulse25", "pulse50", "pulse75", "triangle" };
+    for (int shape = 0; shape < WT_SHAPE_COUNT; ++shape)
+    {
+        s_pTable = wt_get(&cache, shape, 57);
+        if (s_pTable) bench_kernel(names[shape], options, wavetable_kernel, tone);
+    }
+}
+
+static bool bench_render(const char *path, const BenchOptions& options)
+{
+    PlayerConfig config;
+    config.sample_rate = options.sample_rate;
+    config.apu = options.apu;
+    config.preload = options.preload;
+    std::copy(DEFAULT_ROUTES, DEFAULT_ROUTES + VOICE_CHANNELS, config.routes);
+    WavetableCache wavetables;
+    if (options.wavetables)
+    {
+        wt_init(&wavetables, options.sample_rate, WT_DEFAULT_BUDGET, NOTE_FREQS, NOTE_COUNT);
+        wt_build_all(&wavetables);
+        config.pWavetables = &wavetables;
+    }
+
+    std::vector<float> buffer(BENCH_RENDER_FRAMES * 2);
+    uint64_t frameCount = 0;
+    double renderTime = 0.0;
+    double seconds = measure(options.min_time, [&]
+    {
+        Player player;
+        player_open(&player, path, config);
+        frameCount = 0;
+        double start = now_seconds();
+        while (!player.song_ended)
+        {
+            frameCount += player_render(&player, BENCH_RENDER_FRAMES, 2, buffer.data());
+        }
+        renderTime = now_seconds() - start;
+        player_close(&player);
+    });
+
+    double audioSeconds = (double)frameCount / options.sample_rate;
+    printf("  render   %8.2f ns/frame  %8.1fx realtime  (%.1fs of audio)\n",
+           renderTime * 1e9 / std::max<uint64_t>(frameCount, 1), audioSeconds / renderTime, audioSeconds);
+    printf("  end-to-end %6.1fx realtime, open and render\n", audioSeconds / seconds);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    if (!parse_args(argc, argv, &options))
+    {
+        print_usage();
+        return 1;
+    }
+
+    if (options.gen_path)
+    {
+        double start = now_seconds();
+        uint64_t noteCount = gen_write(options.gen_path, options.gen);
+        if (noteCount == 0)
+        {
+            fprintf(stderr, "Failed to write %s\n", options.gen_path);
+            return 2;
+        }
+        printf("Wrote %llu notes to %s in %.2fs\n", (unsigned long long)noteCount, options.gen_path,
+               now_seconds() - start);
+        return 0;
+    }
+
+    if (options.regress.dir)
+    {
+        options.regress.min_time = options.min_time;
+        return regress_run(options.regress) == 0 ? 0 : 4;
+    }
+
+    bool generated = options.files.empty();
+    if (generated)
+    {
+        options.files.push_back("assets/faxanadu.mid");
+        if (!gen_write(BENCH_STRESS_PATH, options.gen))
+        {
+            fprintf(stderr, "Failed to write %s\n", BENCH_STRESS_PATH);
+            return 2;
+        }
+        options.files.push_back(BENCH_STRESS_PATH);
+    }
+
+    bench_kernels(options);
+
+    int failures = 0;
+    for (const std::string& file : options.files)
+    {
+        printf("%s:\n", file.c_str());
+        if (!bench_parse(file.c_str(), options) || !bench_render(file.c_str(), options)) ++failures;
+    }
+
+    if (generated) remove(BENCH_STRESS_PATH);
+    return failures == 0 ? 0 : 3;
+}
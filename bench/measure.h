@@ -0,0 +1,26 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+
+inline double now_seconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Runs func until minTime went by, returns the fastest run in seconds
+template<typename Func>
+double measure(double minTime, Func func)
+{
+    double best = 1e30;
+    double start = now_seconds();
+    double end = start;
+    do
+    {
+        double runStart = now_seconds();
+        func();
+        end = now_seconds();
+        best = std::min(best, end - runStart);
+    } while (end - start < minTime);
+    return best;
+}
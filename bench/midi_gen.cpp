@@ -0,0 +1,176 @@
+#include "midi_gen.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#define GEN_DIVISION 480
+#define GEN_TEMPO 500000    // 120 bpm, so 960 ticks per second
+
+struct GenNote
+{
+    uint32_t tick;
+    uint8_t status;
+    uint8_t note;
+    uint8_t vel;
+};
+
+// xorshift32, same sequence everywhere
+static uint32_t next_random(uint32_t *pState)
+{
+    uint32_t x = *pState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *pState = x;
+    return x;
+}
+
+static double next_unit(uint32_t *pState)
+{
+    return (next_random(pState) >> 8) / 16777216.0;
+}
+
+static void put_u16(std::vector<uint8_t>& out, uint32_t value)
+{
+    out.push_back((uint8_t)(value >> 8));
+    out.push_back((uint8_t)value);
+}
+
+static void put_u32(std::vector<uint8_t>& out, uint32_t value)
+{
+    put_u16(out, value >> 16);
+    put_u16(out, value & 0xFFFF);
+}
+
+static void put_vlq(std::vector<uint8_t>& out, uint32_t value)
+{
+    uint8_t bytes[5];
+    int count = 0;
+    do
+    {
+        bytes[count++] = value & 0x7F;
+        value >>= 7;
+    } while (value);
+    while (count > 1) out.push_back(bytes[--count] | 0x80);
+    out.push_back(bytes[0]);
+}
+
+static void put_meta(std::vector<uint8_t>& out, uint8_t type, const void *pData, uint32_t len)
+{
+    put_vlq(out, 0);
+    out.push_back(0xFF);
+    out.push_back(type);
+    put_vlq(out, len);
+    out.insert(out.end(), (const uint8_t*)pData, (const uint8_t*)pData + len);
+}
+
+static void put_track(FILE *pFile, std::vector<uint8_t>& track)
+{
+    // End of track
+    track.push_back(0);
+    track.push_back(0xFF);
+    track.push_back(0x2F);
+    track.push_back(0);
+
+    std::vector<uint8_t> header;
+    header.insert(header.end(), { 'M', 'T', 'r', 'k' });
+    put_u32(header, (uint32_t)track.size());
+    fwrite(header.data(), 1, header.size(), pFile);
+    fwrite(track.data(), 1, track.size(), pFile);
+}
+
+void gen_black_midi(GenConfig *pConfig)
+{
+    pConfig->track_count = 64;
+    pConfig->notes_per_track = 20000;
+    pConfig->notes_per_second = 40.0;
+    pConfig->note_length = 0.05;
+}
+
+uint64_t gen_write(const char *path, const GenConfig& config)
+{
+    FILE *pFile = fopen(path, "wb");
+    if (!pFile) return 0;
+
+    std::vector<uint8_t> header;
+    header.insert(header.end(), { 'M', 'T', 'h', 'd' });
+    put_u32(header, 6);
+    put_u16(header, 1);
+    put_u16(header, (uint32_t)config.track_count + 1);
+    put_u16(header, GEN_DIVISION);
+    fwrite(header.data(), 1, header.size(), pFile);
+
+    std::vector<uint8_t> track;
+    const char *name = "midi_gen";
+    uint8_t tempo[3] = { (uint8_t)(GEN_TEMPO >> 16), (uint8_t)(GEN_TEMPO >> 8), (uint8_t)GEN_TEMPO };
+    put_meta(track, 0x03, name, (uint32_t)strlen(name));
+    put_meta(track, 0x51, tempo, 3);
+    const uint8_t gmReset[] = { 0x05, 0x7E, 0x7F, 0x09, 0x01, 0xF7 };
+    put_vlq(track, 0);
+    track.push_back(0xF0);
+    track.insert(track.end(), gmReset, gmReset + sizeof(gmReset));
+    put_track(pFile, track);
+
+    double ticksPerSecond = GEN_DIVISION * 1000000.0 / GEN_TEMPO;
+    uint32_t state = config.seed ? config.seed : 1;
+    uint64_t noteCount = 0;
+    std::vector<GenNote> notes;
+    for (int t = 0; t < config.track_count; ++t)
+    {
+        uint8_t channel = (uint8_t)(t % 16);
+        notes.clear();
+
+        double time = 0.0;
+        int pitch = 48 + (int)(next_random(&state) % 24);
+        for (uint32_t i = 0; i < config.notes_per_track; ++i)
+        {
+            // A third of the notes start a chord with the previous one
+            if (i == 0 || next_random(&state) % 3 != 0)
+            {
+                time += 2.0 * next_unit(&state) / config.notes_per_second;
+            }
+            pitch = std::min(108, std::max(24, pitch + (int)(next_random(&state) % 13) - 6));
+
+            uint32_t start = (uint32_t)(time * ticksPerSecond);
+            uint32_t length = std::max<uint32_t>(1, (uint32_t)(2.0 * next_unit(&state) * config.note_length * ticksPerSecond));
+            uint8_t vel = (uint8_t)(32 + next_random(&state) % 96);
+            notes.push_back({ start, (uint8_t)(0x90 | channel), (uint8_t)pitch, vel });
+            notes.push_back({ start + length, (uint8_t)(0x80 | channel), (uint8_t)pitch, 0 });
+        }
+        noteCount += config.notes_per_track;
+
+        // Note offs first when they share a tick with note ons
+        std::stable_sort(notes.begin(), notes.end(), [](const GenNote& a, const GenNote& b)
+        {
+            return a.tick != b.tick ? a.tick < b.tick : a.status < b.status;
+        });
+
+        track.clear();
+        char trackName[32];
+        snprintf(trackName, sizeof(trackName), "Track %i", t + 1);
+        put_meta(track, 0x03, trackName, (uint32_t)strlen(trackName));
+        put_vlq(track, 0);
+        track.push_back(0xB0 | channel);
+        track.push_back(7);
+        track.push_back(100);
+
+        uint32_t tick = 0;
+        uint8_t status = 0xB0 | channel;
+        for (const GenNote& note : notes)
+        {
+            put_vlq(track, note.tick - tick);
+            if (note.status != status || !config.running_status) track.push_back(note.status);
+            status = note.status;
+            track.push_back(note.note);
+            track.push_back(note.vel);
+            tick = note.tick;
+        }
+        put_track(pFile, track);
+    }
+
+    bool ok = ferror(pFile) == 0;
+    fclose(pFile);
+    return ok ? noteCount : 0;
+}
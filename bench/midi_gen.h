@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+// Synthetic format 1 file: a tempo track, then track_count note tracks on
+// channels 1-16 in turn. Notes start at random intervals averaging
+// notes_per_second, with a random walk on the pitch and some chords. The
+// tempo track also has a GM reset SysEx.
+struct GenConfig
+{
+    int track_count = 16;
+    uint32_t notes_per_track = 1000;
+    double notes_per_second = 4.0;  // Per track
+    double note_length = 0.25;      // Seconds, on average
+    uint32_t seed = 1;
+    bool running_status = true;     // Like most writers, and smaller files
+};
+
+// Black MIDI preset, 64 tracks of dense short notes for about 1.3M notes
+void gen_black_midi(GenConfig *pConfig);
+
+// Returns the number of notes written, 0 if path can't be written
+uint64_t gen_write(const char *path, const GenConfig& config);
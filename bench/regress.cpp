@@ -0,0 +1,477 @@
+#include "regress.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "measure.h"
+#include "midi_gen.h"
+#include "oscillators.h"
+#include "output_stage.h"
+#include "player.h"
+#include "resampler.h"
+#include "wavetables.h"
+
+#define REGRESS_RENDER_FRAMES 4096
+#define REGRESS_ENVELOPE_FRAMES 4096    // Output frames per RMS value
+#define REGRESS_TIMINGS_FILE "timings.txt"
+#define REGRESS_CHANGE_SECONDS 16       // Synthesized before a rate change
+#define REGRESS_SEEK_SECONDS 24         // Then before seeking back, into the dropped snapshots
+#define REGRESS_SEEK_TO_SECONDS 8
+#define REGRESS_SONG_PATH "../../assets/faxanadu.mid"  // From the golden dir, bench/golden in the tree
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+struct RegressSong
+{
+    const char *name;
+    std::string path;
+    bool generated;
+};
+
+struct RegressCase
+{
+    const char *name;
+    int song;               // Into the songs
+    bool wavetables;
+    bool apu;
+    uint32_t out_rate;      // Resampled to with the high quality filter, 0 keeps the synthesis rate
+    int sample_type;        // SAMPLE_*, integers are dithered
+    uint32_t change_rate;   // Synthesis rate switched to mid song, 0 keeps it
+    double change_speed;
+};
+
+static const RegressCase CASES[] =
+{
+    { "faxanadu", 0, false, false, 0, SAMPLE_F32, 0, 1.0 },
+    { "faxanadu_wavetables", 0, true, false, 0, SAMPLE_F32, 0, 1.0 },
+    { "faxanadu_apu", 0, false, true, 0, SAMPLE_F32, 0, 1.0 },
+    { "faxanadu_48k_s16", 0, false, false, 48000, SAMPLE_S16, 0, 1.0 },
+    { "faxanadu_change_rate", 0, false, false, 0, SAMPLE_F32, 48000, 1.25 },
+    { "gen_default", 1, false, false, 0, SAMPLE_F32, 0, 1.0 },
+    { "gen_dense", 2, true, false, 0, SAMPLE_F32, 0, 1.0 },
+};
+
+struct RegressOutput
+{
+    uint64_t frames = 0;            // Output frames
+    uint64_t hash = FNV_OFFSET;     // FNV-1a of the output bytes
+    std::vector<float> envelope;    // RMS of every REGRESS_ENVELOPE_FRAMES
+};
+
+// Stereo output as it's written out, hashed and summed up on the way
+struct Capture
+{
+    RegressOutput output;
+    int sample_type = SAMPLE_F32;
+    int isa = OSC_ISA_SCALAR;
+    OutputDither dither;
+    double squares = 0.0;
+    uint32_t fill = 0;              // Frames in squares
+    std::vector<uint8_t> bytes;
+};
+
+struct Timing
+{
+    std::string kind;               // "parse" or "render"
+    std::string name;
+    double ns;
+};
+
+static void capture_frames(Capture *pCapture, const float *pFrames, uint32_t frameCount)
+{
+    RegressOutput& output = pCapture->output;
+    for (uint32_t i = 0; i < frameCount; ++i)
+    {
+        double left = pFrames[i * 2];
+        double right = pFrames[i * 2 + 1];
+        pCapture->squares += left * left + right * right;
+        if (++pCapture->fill < REGRESS_ENVELOPE_FRAMES) continue;
+        output.envelope.push_back((float)std::sqrt(pCapture->squares / (2.0 * pCapture->fill)));
+        pCapture->squares = 0.0;
+        pCapture->fill = 0;
+    }
+
+    size_t size = (size_t)frameCount * 2 * output_sample_size(pCapture->sample_type);
+    pCapture->bytes.resize(size);
+    output_convert(pFrames, 2, (int)frameCount, 2, pCapture->sample_type, &pCapture->dither, pCapture->isa,
+                   pCapture->bytes.data());
+    for (size_t i = 0; i < size; ++i)
+    {
+        output.hash = (output.hash ^ pCapture->bytes[i]) * FNV_PRIME;
+    }
+    output.frames += frameCount;
+}
+
+static void capture_end(Capture *pCapture)
+{
+    if (pCapture->fill == 0) return;
+    pCapture->output.envelope.push_back((float)std::sqrt(pCapture->squares / (2.0 * pCapture->fill)));
+    pCapture->squares = 0.0;
+    pCapture->fill = 0;
+}
+
+// Returns the number of synthesized frames, 0 if the song can't be opened or
+// the rate change replayed events
+static uint64_t render_case(const RegressCase& test, const char *path, WavetableCache *pWavetables, int isa,
+                            RegressOutput *pOutput)
+{
+    PlayerConfig config;
+    std::copy(DEFAULT_ROUTES, DEFAULT_ROUTES + VOICE_CHANNELS, config.routes);
+    config.pWavetables = test.wavetables ? pWavetables : nullptr;
+    config.apu = test.apu;
+    config.isa = isa;
+    Player player;
+    if (!player_open(&player, path, config))
+    {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return 0;
+    }
+
+    Capture capture;
+    capture.sample_type = test.sample_type;
+    capture.isa = isa;
+    capture.dither.enabled = test.sample_type != SAMPLE_F32;
+    Resampler resampler;
+    if (test.out_rate) resampler_init(&resampler, PLAYER_SAMPLE_RATE, test.out_rate, 2, RESAMPLE_HIGH, isa);
+
+    std::vector<float> frames(REGRESS_RENDER_FRAMES * 2);
+    std::vector<float> resampled(REGRESS_RENDER_FRAMES * 2);
+    uint64_t synthesized = 0;
+    bool changed = false;
+    bool seeked = false;
+    while (!player.song_ended)
+    {
+        if (test.change_rate && !changed && synthesized >= (uint64_t)PLAYER_SAMPLE_RATE * REGRESS_CHANGE_SECONDS)
+        {
+            // Only the timeline changes, nothing gets dispatched again
+            uint64_t eventCount = player.event_count;
+            player_change_rate(&player, test.change_rate, test.change_speed);
+            changed = true;
+            if (player.event_count != eventCount)
+            {
+                printf("  %-20s FAIL, the rate change dispatched %llu events\n", test.name,
+                       (unsigned long long)(player.event_count - eventCount));
+                player_close(&player);
+                return 0;
+            }
+        }
+        if (changed && !seeked && synthesized >= (uint64_t)PLAYER_SAMPLE_RATE * REGRESS_SEEK_SECONDS)
+        {
+            player_seek(&player, test.change_rate * REGRESS_SEEK_TO_SECONDS);
+            seeked = true;
+        }
+
+        int frameCount = player_render(&player, REGRESS_RENDER_FRAMES, 2, frames.data());
+        synthesized += frameCount;
+        if (!test.out_rate)
+        {
+            capture_frames(&capture, frames.data(), (uint32_t)frameCount);
+            continue;
+        }
+
+        resampler_write(&resampler, frames.data(), (uint32_t)frameCount);
+        if (player.song_ended) resampler_end(&resampler);
+        uint32_t read;
+        while ((read = resampler_read(&resampler, resampled.data(), REGRESS_RENDER_FRAMES)) > 0)
+        {
+            capture_frames(&capture, resampled.data(), read);
+        }
+    }
+    capture_end(&capture);
+    player_close(&player);
+
+    *pOutput = capture.output;
+    return std::max<uint64_t>(synthesized, 1);
+}
+
+static std::string golden_path(const RegressConfig& config, const char *name)
+{
+    return std::string(config.dir) + "/" + name + ".golden";
+}
+
+static bool write_golden(const std::string& path, const RegressOutput& output)
+{
+    FILE *pFile = fopen(path.c_str(), "w");
+    if (!pFile) return false;
+    fprintf(pFile, "frames %llu\nhash %016llx\n", (unsigned long long)output.frames,
+            (unsigned long long)output.hash);
+    for (float rms : output.envelope)
+    {
+        fprintf(pFile, "%.9g\n", rms);
+    }
+    return fclose(pFile) == 0;
+}
+
+static bool read_golden(const std::string& path, RegressOutput *pOutput)
+{
+    FILE *pFile = fopen(path.c_str(), "r");
+    if (!pFile) return false;
+    unsigned long long frames = 0;
+    unsigned long long hash = 0;
+    bool ok = fscanf(pFile, " frames %llu hash %llx", &frames, &hash) == 2;
+    float rms;
+    while (ok && fscanf(pFile, "%f", &rms) == 1)
+    {
+        pOutput->envelope.push_back(rms);
+    }
+    fclose(pFile);
+    pOutput->frames = frames;
+    pOutput->hash = hash;
+    return ok;
+}
+
+// Largest difference between two envelopes and the index it's at, the
+// shorter one is padded with silence
+static double envelope_diff(const std::vector<float>& a, const std::vector<float>& b, size_t *pWhere)
+{
+    double largest = 0.0;
+    *pWhere = 0;
+    for (size_t i = 0; i < std::max(a.size(), b.size()); ++i)
+    {
+        double diff = std::fabs((double)(i < a.size() ? a[i] : 0.0f) - (double)(i < b.size() ? b[i] : 0.0f));
+        if (diff <= largest) continue;
+        largest = diff;
+        *pWhere = i;
+    }
+    return largest;
+}
+
+static bool check_output(const RegressConfig& config, const RegressCase& test, int isa, const RegressOutput& output,
+                         const RegressOutput& golden)
+{
+    const char *isaName = osc_isa_name(isa);
+    if (output.hash == golden.hash && output.frames == golden.frames)
+    {
+        printf("  %-20s %-6s ok, %llu frames, hash %016llx\n", test.name, isaName,
+               (unsigned long long)output.frames, (unsigned long long)output.hash);
+        return true;
+    }
+
+    size_t where;
+    double diff = envelope_diff(output.envelope, golden.envelope, &where);
+    uint32_t rate = test.out_rate ? test.out_rate : PLAYER_SAMPLE_RATE;
+    bool accepted = output.frames == golden.frames && diff <= config.tolerance && config.tolerance > 0.0;
+    printf("  %-20s %-6s %s, hash %016llx, golden %016llx, %llu frames, golden %llu\n", test.name, isaName,
+           accepted ? "ok within tolerance" : "FAIL", (unsigned long long)output.hash,
+           (unsigned long long)golden.hash, (unsigned long long)output.frames, (unsigned long long)golden.frames);
+    printf("  %-20s %-6s envelope off by up to %.6f RMS at %.2fs, tolerance %.6f\n", "", "", diff,
+           (double)where * REGRESS_ENVELOPE_FRAMES / rate, config.tolerance);
+    return accepted;
+}
+
+static int check_outputs(const RegressConfig& config, const std::vector<RegressSong>& songs,
+                         WavetableCache *pWavetables)
+{
+    printf("Outputs, goldens in %s:\n", config.dir);
+    int failures = 0;
+    int best = osc_pick_isa();
+    for (const RegressCase& test : CASES)
+    {
+        std::string path = golden_path(config, test.name);
+        RegressOutput golden;
+        if (!config.write && !read_golden(path, &golden))
+        {
+            printf("  %-20s FAIL, no golden at %s, record them with -W\n", test.name, path.c_str());
+            ++failures;
+            continue;
+        }
+
+        // The reference kernels first, every other set has to match them
+        for (int isa = best; isa >= OSC_ISA_SCALAR; --isa)
+        {
+            if (osc_pick_isa(isa) != isa) continue;
+            RegressOutput output;
+            if (!render_case(test, songs[test.song].path.c_str(), pWavetables, isa, &output))
+            {
+                ++failures;
+                break;
+            }
+            if (config.write && isa == best)
+            {
+                if (!write_golden(path, output))
+                {
+                    printf("  %-20s FAIL, can't write %s\n", test.name, path.c_str());
+                    ++failures;
+                    break;
+                }
+                golden = output;
+            }
+            if (!check_output(config, test, isa, output, golden)) ++failures;
+        }
+    }
+    return failures;
+}
+
+static bool read_timings(const std::string& path, std::vector<Timing> *pTimings)
+{
+    FILE *pFile = fopen(path.c_str(), "r");
+    if (!pFile) return false;
+    char line[256];
+    while (fgets(line, sizeof(line), pFile))
+    {
+        char kind[64];
+        char name[64];
+        double ns;
+        if (line[0] == '#' || sscanf(line, "%63s %63s %lf", kind, name, &ns) != 3) continue;
+        pTimings->push_back({ kind, name, ns });
+    }
+    fclose(pFile);
+    return true;
+}
+
+static bool write_timings(const std::string& path, const std::vector<Timing>& timings)
+{
+    FILE *pFile = fopen(path.c_str(), "w");
+    if (!pFile) return false;
+    fprintf(pFile, "# Fastest times in ns per event or frame, only meaningful on the machine that recorded them\n");
+    for (const Timing& timing : timings)
+    {
+        fprintf(pFile, "%s %s %.3f\n", timing.kind.c_str(), timing.name.c_str(), timing.ns);
+    }
+    return fclose(pFile) == 0;
+}
+
+static bool check_timing(const RegressConfig& config, const std::vector<Timing>& baselines, const Timing& timing,
+                         const char *unit)
+{
+    const Timing *pBaseline = nullptr;
+    for (const Timing& baseline : baselines)
+    {
+        if (baseline.kind == timing.kind && baseline.name == timing.name) pBaseline = &baseline;
+    }
+    if (!pBaseline)
+    {
+        printf("  %-20s %-6s %8.2f %s, %s\n", timing.name.c_str(), timing.kind.c_str(), timing.ns, unit,
+               config.write ? "recorded" : "no baseline FAIL");
+        return config.write;
+    }
+
+    double change = (timing.ns / pBaseline->ns - 1.0) * 100.0;
+    bool ok = change <= config.slowdown;
+    printf("  %-20s %-6s %8.2f %s, baseline %.2f (%+.1f%%, limit +%.0f%%)%s\n", timing.name.c_str(),
+           timing.kind.c_str(), timing.ns, unit, pBaseline->ns, change, config.slowdown, ok ? "" : " FAIL");
+    return ok;
+}
+
+static int check_timings(const RegressConfig& config, const std::vector<RegressSong>& songs,
+                         WavetableCache *pWavetables)
+{
+    std::string path = std::string(config.dir) + "/" + REGRESS_TIMINGS_FILE;
+    std::vector<Timing> baselines;
+    if (!config.write && !read_timings(path, &baselines))
+    {
+        printf("FAIL, no timing baselines at %s, record them with -W or skip the timings with -P -1\n",
+               path.c_str());
+        return 1;
+    }
+    printf("Timings, %s kernels:\n", osc_isa_name(osc_pick_isa()));
+
+    int failures = 0;
+    std::vector<Timing> timings;
+    for (const RegressSong& song : songs)
+    {
+        // Decoding every event, like playback does
+        uint64_t eventCount = 0;
+        double seconds = measure(config.min_time, [&]
+        {
+            MidiFile file;
+            if (!midi_open(&file, song.path.c_str())) return;
+            EventStream stream;
+            stream_init(&stream, &file, (int)file.tracks.size());
+            eventCount = 0;
+            while (stream_peek(&stream))
+            {
+                stream_pop(&stream);
+                ++eventCount;
+            }
+            midi_close(&file);
+        });
+        timings.push_back({ "parse", song.name, seconds * 1e9 / (double)std::max<uint64_t>(eventCount, 1) });
+        if (!check_timing(config, baselines, timings.back(), "ns/event")) ++failures;
+    }
+
+    for (const RegressCase& test : CASES)
+    {
+        uint64_t frameCount = 0;
+        double seconds = measure(config.min_time, [&]
+        {
+            RegressOutput output;
+            frameCount = render_case(test, songs[test.song].path.c_str(), pWavetables, osc_pick_isa(), &output);
+        });
+        timings.push_back({ "render", test.name, seconds * 1e9 / (double)std::max<uint64_t>(frameCount, 1) });
+        if (!check_timing(config, baselines, timings.back(), "ns/frame")) ++failures;
+    }
+
+    if (config.write && !write_timings(path, timings))
+    {
+        printf("Can't write %s\n", path.c_str());
+        ++failures;
+    }
+    return failures;
+}
+
+// Where the generated songs are written, they're removed once checked
+static std::string temp_dir()
+{
+    for (const char *name : { "TMPDIR", "TEMP", "TMP" })
+    {
+        const char *dir = getenv(name);
+        if (dir && dir[0]) return dir;
+    }
+#if defined(WIN32)
+    return ".";
+#else
+    return "/tmp";
+#endif
+}
+
+int regress_run(const RegressConfig& config)
+{
+    // Fixed seeds, so the files only change with the generator
+    GenConfig moderate;
+    GenConfig dense;
+    dense.track_count = 32;
+    dense.notes_per_track = 1500;
+    dense.notes_per_second = 15.0;
+    dense.note_length = 0.08;
+    dense.seed = 7;
+    dense.running_status = false;
+
+    // Unique names, runs from several builds can share the temp directory
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "/midi_bench_regress_%016llx",
+             (unsigned long long)std::chrono::steady_clock::now().time_since_epoch().count());
+    std::string genPrefix = temp_dir() + prefix;
+    std::vector<RegressSong> songs =
+    {
+        { "faxanadu", std::string(config.dir) + "/" + REGRESS_SONG_PATH, false },
+        { "gen_default", genPrefix + "_default.mid", true },
+        { "gen_dense", genPrefix + "_dense.mid", true },
+    };
+    bool ok = gen_write(songs[1].path.c_str(), moderate) && gen_write(songs[2].path.c_str(), dense);
+    if (!ok) fprintf(stderr, "Failed to write the generated songs\n");
+
+    WavetableCache wavetables;
+    wt_init(&wavetables, PLAYER_SAMPLE_RATE, WT_DEFAULT_BUDGET, NOTE_FREQS, NOTE_COUNT);
+    wt_build_all(&wavetables);
+
+    int failures = ok ? 0 : 1;
+    if (ok) failures += check_outputs(config, songs, &wavetables);
+    if (ok && (config.write || config.slowdown >= 0.0)) failures += check_timings(config, songs, &wavetables);
+
+    for (const RegressSong& song : songs)
+    {
+        if (song.generated) remove(song.path.c_str());
+    }
+    if (failures) printf("%i regression checks failed\n", failures);
+    else if (config.write) printf("Recorded the goldens and baselines in %s\n", config.dir);
+    else printf("No regressions\n");
+    return failures;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+// Golden output and performance gate. Renders the bundled song, found
+// relative to dir, and a few generated ones with fixed seeds, through every
+// kernel set this CPU has, then checks each output hash against the goldens
+// in dir. When a hash changed, the RMS envelopes are compared instead and up
+// to tolerance of difference passes. Parse and render timings fail when
+// they're more than slowdown percent above the baselines, which are per
+// machine: without them the timings fail too, unless slowdown is negative.
+struct RegressConfig
+{
+    const char *dir = nullptr;
+    bool write = false;             // Record new goldens and baselines instead of checking
+    double tolerance = 0.0;         // RMS, 0 only accepts identical outputs
+    double slowdown = 25.0;         // Percent, negative skips the timings
+    double min_time = 0.5;          // Seconds spent on each measurement
+};
+
+// Returns the number of failed checks
+int regress_run(const RegressConfig& config);
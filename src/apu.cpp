@@ -0,0 +1,316 @@
+#include "apu.h"
+
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+
+#include "voice_pool.h"
+
+// Band-limited step: windowed sinc cut a bit below Nyquist
+#define BLEP_CUTOFF 0.45
+#define BLEP_SUBSTEPS 64
+
+const uint16_t APU_NOISE_PERIODS[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+
+struct BlepTable
+{
+    int16_t taps[APU_BLEP_PHASES][APU_BLEP_TAPS];     // Half the cache of int32_t
+};
+
+static const double PI = 3.14159265358979323846;
+
+// Step response derivative over [x0, x1], the step is centered on x = 0
+static double blep_area(double x0, double x1)
+{
+    double area = 0.0;
+    double dx = (x1 - x0) / BLEP_SUBSTEPS;
+    for (int i = 0; i < BLEP_SUBSTEPS; ++i)
+    {
+        double x = x0 + (i + 0.5) * dx;
+        if (std::fabs(x) >= APU_BLEP_TAPS / 2) continue;
+        double y = 2.0 * BLEP_CUTOFF * x;
+        double sinc = y == 0.0 ? 1.0 : std::sin(PI * y) / (PI * y);
+        double window = 0.42 + 0.5 * std::cos(2.0 * PI * x / APU_BLEP_TAPS) +
+                        0.08 * std::cos(4.0 * PI * x / APU_BLEP_TAPS);
+        area += 2.0 * BLEP_CUTOFF * sinc * window * dx;
+    }
+    return area;
+}
+
+// A step at fraction phase / APU_BLEP_PHASES of slot 0 is centered between
+// taps APU_BLEP_TAPS / 2 - 1 and APU_BLEP_TAPS / 2. Each phase is rounded so
+// its taps add up to exactly APU_BLEP_ONE.
+static BlepTable build_blep()
+{
+    BlepTable table;
+    for (int phase = 0; phase < APU_BLEP_PHASES; ++phase)
+    {
+        double center = APU_BLEP_TAPS / 2 - 1 + (double)phase / APU_BLEP_PHASES;
+        int32_t sum = 0;
+        int peak = 0;
+        for (int k = 0; k < APU_BLEP_TAPS; ++k)
+        {
+            double tap = blep_area(k - 1 - center, k - center) * APU_BLEP_ONE;
+            table.taps[phase][k] = (int16_t)std::lround(tap);
+            sum += table.taps[phase][k];
+            if (std::abs(table.taps[phase][k]) > std::abs(table.taps[phase][peak])) peak = k;
+        }
+        table.taps[phase][peak] += APU_BLEP_ONE - sum;
+    }
+    return table;
+}
+
+static const BlepTable& blep_table()
+{
+    static const BlepTable table = build_blep();
+    return table;
+}
+
+// Adds a step of delta at time units into the span starting at slot offset
+static void add_step(ApuPass *pPass, int offset, uint64_t time, int32_t delta)
+{
+    int slot = offset + (int)(time / APU_CPU_CLOCK);
+    int phase = (int)((time % APU_CPU_CLOCK) * APU_BLEP_PHASES / APU_CPU_CLOCK);
+    const int16_t *pTaps = blep_table().taps[phase];
+    if (pPass->pMix && slot + APU_BLEP_TAPS <= pPass->split)
+    {
+        int32_t *pMix = pPass->pMix + slot;
+        for (int k = 0; k < APU_BLEP_TAPS; ++k) pMix[k] += delta * pTaps[k];
+        return;
+    }
+
+    // Near the split, or skipping
+    int k = 0;
+    if (pPass->pMix)
+    {
+        int32_t *pMix = pPass->pMix + slot;
+        int mixed = std::min(APU_BLEP_TAPS, pPass->split - slot);
+        for (; k < mixed; ++k) pMix[k] += delta * pTaps[k];
+    }
+    else
+    {
+        k = std::max(0, pPass->split - slot);
+    }
+    for (; k < APU_BLEP_TAPS; ++k)
+    {
+        pPass->tail[slot + k - pPass->split] += delta * pTaps[k];
+    }
+}
+
+void apu_note(ApuVoice *pVoice, int type, int note_id, float freq, uint32_t duty, uint32_t sample_rate)
+{
+    uint32_t cycles;
+    if (type == VOICE_NOISE)
+    {
+        int setting = note_id & 31;
+        cycles = APU_NOISE_PERIODS[15 - (setting & 15)];
+        pVoice->noise_short = setting >= 16;
+    }
+    else
+    {
+        // Pulse timers tick every other cycle through 8 steps, the triangle
+        // every cycle through 32, so both step every 2 * (timer + 1) cycles
+        // for the pulse and timer + 1 for the triangle.
+        double steps = type == VOICE_TRIANGLE ? 32.0 : 16.0;
+        long timer = std::lround(APU_CPU_CLOCK / (steps * freq)) - 1;
+        while (timer > 2047) timer = (timer + 1) / 2 - 1;
+        timer = std::max<long>(timer, type == VOICE_TRIANGLE ? 2 : 8);
+        cycles = (uint32_t)(timer + 1) * (type == VOICE_TRIANGLE ? 1 : 2);
+        pVoice->duty_steps = (uint8_t)std::min<uint32_t>(7, std::max<uint32_t>(1, (duty + (1u << 28)) >> 29));
+    }
+
+    uint64_t reload = (uint64_t)cycles * sample_rate;
+    pVoice->reload = (uint32_t)std::min<uint64_t>(reload, UINT32_MAX);
+    pVoice->countdown = std::min(pVoice->countdown, pVoice->reload);
+}
+
+void apu_channel_reset(ApuChannel *pChannel)
+{
+    memset(pChannel, 0, sizeof(ApuChannel));
+}
+
+void apu_pass_begin(const ApuChannel *pChannel, ApuPass *pPass, int32_t *pMix, int split, int32_t *pAcc)
+{
+    pPass->pMix = pMix;
+    pPass->split = split;
+    memset(pPass->tail, 0, sizeof(pPass->tail));
+
+    int32_t pending = 0;
+    for (int k = 0; k < APU_BLEP_TAPS; ++k)
+    {
+        pending += pChannel->pending[k];
+        if (k >= split) pPass->tail[k - split] = pChannel->pending[k];
+        else if (pMix) pMix[k] += pChannel->pending[k];
+    }
+    if (pAcc) *pAcc += pChannel->level * APU_BLEP_ONE - pending;
+}
+
+void apu_pass_end(ApuChannel *pChannel, const ApuPass *pPass)
+{
+    memcpy(pChannel->pending, pPass->tail, sizeof(pPass->tail));
+}
+
+void apu_flush(ApuChannel *pChannel, ApuPass *pPass, int offset)
+{
+    if (pChannel->flush == 0) return;
+    add_step(pPass, offset, 0, -pChannel->flush);
+    pChannel->level -= pChannel->flush;
+    pChannel->flush = 0;
+}
+
+static int32_t volume_level(int32_t vol)
+{
+    return vol <= 0 ? 0 : std::min<int32_t>(15, vol >> 20);
+}
+
+static int32_t amplitude(const ApuVoice *pVoice, int type, int32_t volume)
+{
+    switch (type)
+    {
+        case VOICE_PULSE:
+            return pVoice->sequence < pVoice->duty_steps ? 15 * volume : -15 * volume;
+        case VOICE_TRIANGLE:
+        {
+            // 15 down to 0 then back up
+            int32_t wave = pVoice->sequence < 16 ? 15 - pVoice->sequence : pVoice->sequence - 16;
+            return (2 * wave - 15) * volume;
+        }
+        default:
+            // Muted while bit 0 is set
+            return (pVoice->lfsr & 1) ? 0 : 15 * volume;
+    }
+}
+
+// Sequencer steps until the output may change, at most 15
+static uint32_t steps_to_change(const ApuVoice *pVoice, int type)
+{
+    switch (type)
+    {
+        case VOICE_PULSE:
+            return pVoice->sequence < pVoice->duty_steps ? pVoice->duty_steps - pVoice->sequence
+                                                         : 8 - pVoice->sequence;
+        case VOICE_TRIANGLE:
+            // The wave holds on 0 and 15 for two steps
+            return (pVoice->sequence & 15) == 15 ? 2 : 1;
+        default:
+        {
+            // The next 14 outputs are the bits the register already holds
+            uint32_t changes = (pVoice->lfsr ^ (pVoice->lfsr >> 1)) & 0x3FFF;
+            uint32_t steps = 1;
+            if (!changes) return 15;
+            while (!(changes & 1))
+            {
+                changes >>= 1;
+                ++steps;
+            }
+            return steps;
+        }
+    }
+}
+
+static void clock_sequencer(ApuVoice *pVoice, int type, uint64_t steps)
+{
+    switch (type)
+    {
+        case VOICE_PULSE: pVoice->sequence = (uint8_t)((pVoice->sequence + steps) & 7); break;
+        case VOICE_TRIANGLE: pVoice->sequence = (uint8_t)((pVoice->sequence + steps) & 31); break;
+        default:
+        {
+            uint32_t loop = pVoice->noise_short ? APU_NOISE_SHORT_LOOP : APU_NOISE_LONG_LOOP;
+            if (steps >= loop) steps %= loop;
+            pVoice->lfsr = (uint16_t)osc_lfsr_clock(pVoice->lfsr, pVoice->noise_short, (uint32_t)steps);
+            break;
+        }
+    }
+}
+
+void apu_run(ApuVoice *pVoice, OscVoice *pOsc, int type, ApuChannel *pChannel, ApuPass *pPass,
+             int offset, int count)
+{
+    const uint64_t end = (uint64_t)count * APU_CPU_CLOCK;
+    const uint64_t reload = std::max<uint32_t>(pVoice->reload, 1);
+    const int32_t vol = pOsc->vol;
+    const int32_t sustain = pOsc->sustain;
+
+    // Sample i plays at vol - i * sustain like in the kernels, the 4-bit
+    // volume drops on the first sample below its current step
+    int32_t volume = volume_level(vol);
+    auto next_volume = [&](int64_t sample)
+    {
+        if (volume == 0 || sustain <= 0) return end;
+        int64_t drop = ((int64_t)vol - ((int64_t)volume << 20)) / sustain + 1;
+        return drop < count ? (uint64_t)std::max(drop, sample) * APU_CPU_CLOCK : end;
+    };
+    uint64_t volumeTime = next_volume(0);
+
+    // Only the timer events that change the output are visited, the ones in
+    // between are counted
+    uint64_t timer = pVoice->countdown;
+    uint64_t time = 0;
+    for (;;)
+    {
+        int32_t amp = amplitude(pVoice, type, volume);
+        if (amp != pVoice->level)
+        {
+            add_step(pPass, offset, time, amp - pVoice->level);
+            pChannel->level += amp - pVoice->level;
+            pVoice->level = amp;
+        }
+
+        if (volume > 0)
+        {
+            uint64_t steps = steps_to_change(pVoice, type);
+            uint64_t change = timer + (steps - 1) * reload;
+            if (change < volumeTime)
+            {
+                clock_sequencer(pVoice, type, steps);
+                timer = change + reload;
+                time = change;
+                continue;
+            }
+        }
+
+        // Nothing heard changes until the volume does or the span ends
+        if (timer < volumeTime)
+        {
+            uint64_t steps = (volumeTime - 1 - timer) / reload + 1;
+            clock_sequencer(pVoice, type, steps);
+            timer += steps * reload;
+        }
+        if (volumeTime >= end) break;
+
+        time = volumeTime;
+        if (timer == time)
+        {
+            clock_sequencer(pVoice, type, 1);
+            timer += reload;
+        }
+        int64_t sample = (int64_t)(time / APU_CPU_CLOCK);
+        volume = volume_level((int32_t)std::max<int64_t>(0, (int64_t)vol - sample * sustain));
+        volumeTime = next_volume(sample + 1);
+    }
+
+    pVoice->countdown = (uint32_t)(timer - end);
+    int64_t endVol = (int64_t)vol - (int64_t)(count - 1) * sustain;
+    pOsc->vol = (int32_t)std::max<int64_t>(0, endVol);
+}
+
+void apu_release(ApuVoice *pVoice, ApuChannel *pChannel)
+{
+    pChannel->flush += pVoice->level;
+    pVoice->level = 0;
+}
+
+void apu_integrate(const int32_t *pDeltas, int count, int32_t *pAcc, float *pOut)
+{
+    const float scale = 1.0f / ((float)APU_LEVEL_MAX * APU_BLEP_ONE);
+    int32_t acc = *pAcc;
+    for (int i = 0; i < count; ++i)
+    {
+        acc += pDeltas[i];
+        pOut[i] += (float)acc * scale;
+    }
+    *pAcc = acc;
+}
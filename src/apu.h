@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "oscillators.h"
+
+// NTSC 2A03 CPU clock, the timers count these cycles
+#define APU_CPU_CLOCK 1789773
+
+// Band-limited steps are this many output samples long, and centered, so
+// the APU core plays APU_BLEP_TAPS / 2 samples late
+#define APU_BLEP_TAPS 16
+#define APU_BLEP_PHASES 64
+
+// Sum of the taps of one step, integrated steps are amplitudes in this unit
+#define APU_BLEP_ONE (1 << 14)
+
+// Amplitudes are 4-bit wave times 4-bit volume, this much is 1.0 in the mix
+#define APU_LEVEL_MAX (15 * 15)
+
+// NTSC noise timer periods, in CPU cycles
+extern const uint16_t APU_NOISE_PERIODS[16];
+
+// Length of the noise sequences, used to wrap long skips. Every long mode
+// state but zero is on the one 32767 steps loop, short mode loops are 31 or
+// 93 steps.
+#define APU_NOISE_LONG_LOOP 32767
+#define APU_NOISE_SHORT_LOOP 93
+
+// Timers of one voice of the APU core. Time is counted in units of
+// 1 / (APU_CPU_CLOCK * sample_rate) seconds, so a CPU cycle is sample_rate
+// units, a sample is APU_CPU_CLOCK units and both convert exactly.
+struct ApuVoice
+{
+    uint32_t reload = 0;        // Timer period, in units
+    uint32_t countdown = 0;     // Units until the next step, from the start of the next span
+    uint8_t sequence = 0;       // Sequencer position, 8 steps for pulses, 32 for the triangle
+    uint8_t duty_steps = 4;     // Pulse steps spent high
+    uint16_t lfsr = 1;          // Noise shift register
+    bool noise_short = false;
+    int32_t level = 0;          // Amplitude last sent to the channel
+};
+
+// Sum of the voices of one MIDI channel, as band-limited steps waiting to be
+// integrated. Only the taps past the current position are kept between
+// passes, everything older is already part of level.
+struct ApuChannel
+{
+    int32_t pending[APU_BLEP_TAPS];     // Taps due on the next samples
+    int32_t level;                      // Sum of every amplitude change so far
+    int32_t flush;                      // Released voices, applied on the next span
+};
+
+// Where the steps of one channel go while a pass runs over a few spans:
+// slots before split are added to pMix, or dropped when it's null, the next
+// APU_BLEP_TAPS become the new pending taps.
+struct ApuPass
+{
+    int32_t *pMix;
+    int split;
+    int32_t tail[APU_BLEP_TAPS];
+};
+
+// Hardware timer period for a note, transposed up by octaves when it doesn't
+// fit the 11-bit register. type is VOICE_*, duty only matters for pulses.
+void apu_note(ApuVoice *pVoice, int type, int note_id, float freq, uint32_t duty, uint32_t sample_rate);
+
+void apu_channel_reset(ApuChannel *pChannel);
+
+// Adds the pending taps of the channel to the pass. With pAcc, also adds the
+// integrated value at slot 0.
+void apu_pass_begin(const ApuChannel *pChannel, ApuPass *pPass, int32_t *pMix, int split, int32_t *pAcc);
+void apu_pass_end(ApuChannel *pChannel, const ApuPass *pPass);
+
+// Steps the flushed amplitude back at slot offset of the pass
+void apu_flush(ApuChannel *pChannel, ApuPass *pPass, int offset);
+
+// Runs the voice over count samples starting at slot offset of the pass.
+// Volume and decay come from pOsc like for the kernels, quantized to 4 bits,
+// and pOsc->vol ends where osc_skip() would leave it. Cost is per amplitude
+// change, not per sample.
+void apu_run(ApuVoice *pVoice, OscVoice *pOsc, int type, ApuChannel *pChannel, ApuPass *pPass,
+             int offset, int count);
+
+// The voice stops, its amplitude goes back to 0 on the next span
+void apu_release(ApuVoice *pVoice, ApuChannel *pChannel);
+
+// Adds the integrated steps to count samples of pOut. *pAcc carries over.
+void apu_integrate(const int32_t *pDeltas, int count, int32_t *pAcc, float *pOut);
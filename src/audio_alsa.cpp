@@ -0,0 +1,158 @@
+#include "audio_backend.h"
+
+#if defined(AUDIO_HAS_ALSA)
+#include <stdio.h>
+#include <vector>
+#include <alsa/asoundlib.h>
+
+struct AlsaDevice
+{
+    snd_pcm_t *pPcm = nullptr;
+    std::vector<uint8_t> samples;
+};
+
+static bool alsa_fail(const char *what, int err)
+{
+    fprintf(stderr, "ALSA %s failed: %s\n", what, snd_strerror(err));
+    return false;
+}
+
+static snd_pcm_format_t alsa_format(int sampleType)
+{
+    switch (sampleType)
+    {
+        case SAMPLE_S16: return SND_PCM_FORMAT_S16_LE;
+        case SAMPLE_S24: return SND_PCM_FORMAT_S24_3LE;
+        default: return SND_PCM_FORMAT_FLOAT_LE;
+    }
+}
+
+// The requested sample type if the device takes it, else the first one it
+// takes of float, 24 and 16 bits
+static int alsa_pick_sample_type(snd_pcm_t *pPcm, snd_pcm_hw_params_t *pParams, int requested)
+{
+    static const int FALLBACKS[] = { SAMPLE_F32, SAMPLE_S24, SAMPLE_S16 };
+    if (snd_pcm_hw_params_test_format(pPcm, pParams, alsa_format(requested)) == 0) return requested;
+    for (int sampleType : FALLBACKS)
+    {
+        if (snd_pcm_hw_params_test_format(pPcm, pParams, alsa_format(sampleType)) == 0) return sampleType;
+    }
+    return requested;
+}
+
+static bool alsa_open(AudioDevice *pDevice)
+{
+    AlsaDevice *pAlsa = new AlsaDevice;
+    pDevice->pImpl = pAlsa;
+    AudioConfig *pConfig = &pDevice->config;
+
+    int err = snd_pcm_open(&pAlsa->pPcm, "default", SND_PCM_STREAM_PLAYBACK, 0);
+    if (err < 0) return alsa_fail("open", err);
+
+    snd_pcm_hw_params_t *pParams;
+    snd_pcm_hw_params_alloca(&pParams);
+    snd_pcm_hw_params_any(pAlsa->pPcm, pParams);
+    pConfig->sample_type = alsa_pick_sample_type(pAlsa->pPcm, pParams, pConfig->sample_type);
+
+    unsigned int channels = (unsigned int)pConfig->channel_count;
+    unsigned int rate = pConfig->sample_rate;
+    snd_pcm_uframes_t period = pConfig->period_frames > 0 ? pConfig->period_frames : 256;
+    unsigned int periods = pConfig->buffer_count > 0 ? (unsigned int)pConfig->buffer_count : 4;
+
+    if ((err = snd_pcm_hw_params_set_access(pAlsa->pPcm, pParams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0 ||
+        (err = snd_pcm_hw_params_set_format(pAlsa->pPcm, pParams, alsa_format(pConfig->sample_type))) < 0 ||
+        (err = snd_pcm_hw_params_set_channels_near(pAlsa->pPcm, pParams, &channels)) < 0 ||
+        (err = snd_pcm_hw_params_set_rate_near(pAlsa->pPcm, pParams, &rate, nullptr)) < 0 ||
+        (err = snd_pcm_hw_params_set_period_size_near(pAlsa->pPcm, pParams, &period, nullptr)) < 0 ||
+        (err = snd_pcm_hw_params_set_periods_near(pAlsa->pPcm, pParams, &periods, nullptr)) < 0 ||
+        (err = snd_pcm_hw_params(pAlsa->pPcm, pParams)) < 0)
+    {
+        return alsa_fail("hardware setup", err);
+    }
+
+    // What the device settled for
+    snd_pcm_hw_params_get_period_size(pParams, &period, nullptr);
+    snd_pcm_hw_params_get_periods(pParams, &periods, nullptr);
+    pConfig->channel_count = (int)channels;
+    pConfig->sample_rate = rate;
+    pConfig->period_frames = (uint32_t)period;
+    pConfig->buffer_count = (int)periods;
+
+    // Only start playing once the whole buffer is queued
+    snd_pcm_sw_params_t *pSwParams;
+    snd_pcm_sw_params_alloca(&pSwParams);
+    snd_pcm_sw_params_current(pAlsa->pPcm, pSwParams);
+    snd_pcm_sw_params_set_start_threshold(pAlsa->pPcm, pSwParams, period * periods);
+    snd_pcm_sw_params_set_avail_min(pAlsa->pPcm, pSwParams, period);
+    if ((err = snd_pcm_sw_params(pAlsa->pPcm, pSwParams)) < 0) return alsa_fail("software setup", err);
+
+    pAlsa->samples.resize((size_t)period * channels * output_sample_size(pConfig->sample_type));
+    return true;
+}
+
+static bool alsa_start(AudioDevice *pDevice)
+{
+    AlsaDevice *pAlsa = (AlsaDevice*)pDevice->pImpl;
+    int err = snd_pcm_prepare(pAlsa->pPcm);
+    if (err < 0) return alsa_fail("prepare", err);
+    return true;
+}
+
+static bool alsa_update(AudioDevice *pDevice)
+{
+    AlsaDevice *pAlsa = (AlsaDevice*)pDevice->pImpl;
+    uint32_t period = pDevice->config.period_frames;
+
+    // Wakes up once a period is free, an xrun means the device ran dry
+    int err = snd_pcm_wait(pAlsa->pPcm, 2000);
+    if (err == 0) return false;
+    if (err < 0)
+    {
+        pDevice->stats.deadline_misses++;
+        if ((err = snd_pcm_recover(pAlsa->pPcm, err, 1)) < 0) return alsa_fail("recover", err);
+    }
+
+    // The period freed up when avail reached it, the device played the rest
+    // since. Until the buffer is first full the device isn't playing yet.
+    auto due = AudioClock::now();
+    snd_pcm_sframes_t avail = snd_pcm_avail(pAlsa->pPcm);
+    if (avail > (snd_pcm_sframes_t)period && snd_pcm_state(pAlsa->pPcm) == SND_PCM_STATE_RUNNING)
+    {
+        std::chrono::duration<double> late((double)(avail - period) / pDevice->config.sample_rate);
+        due -= std::chrono::duration_cast<AudioClock::duration>(late);
+    }
+
+    audio_pull(pDevice, pAlsa->samples.data(), period, due);
+
+    const uint8_t *pData = pAlsa->samples.data();
+    size_t frameSize = (size_t)pDevice->config.channel_count * output_sample_size(pDevice->config.sample_type);
+    snd_pcm_uframes_t remaining = period;
+    while (remaining > 0)
+    {
+        snd_pcm_sframes_t written = snd_pcm_writei(pAlsa->pPcm, pData, remaining);
+        if (written < 0)
+        {
+            if (written == -EPIPE) pDevice->stats.deadline_misses++;
+            if ((err = snd_pcm_recover(pAlsa->pPcm, (int)written, 1)) < 0) return alsa_fail("write", err);
+            continue;
+        }
+        pData += written * frameSize;
+        remaining -= written;
+    }
+    return true;
+}
+
+static void alsa_close(AudioDevice *pDevice)
+{
+    AlsaDevice *pAlsa = (AlsaDevice*)pDevice->pImpl;
+    if (!pAlsa) return;
+    if (pAlsa->pPcm)
+    {
+        snd_pcm_drain(pAlsa->pPcm);
+        snd_pcm_close(pAlsa->pPcm);
+    }
+    delete pAlsa;
+}
+
+const AudioBackend AUDIO_ALSA = { "alsa", true, alsa_open, alsa_start, alsa_update, alsa_close };
+#endif
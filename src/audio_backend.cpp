@@ -0,0 +1,142 @@
+#include "audio_backend.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+
+#include "oscillators.h"
+
+static const char *SAMPLE_TYPE_NAMES[] = { "s16", "f32", "s24" };
+
+static const AudioBackend *BACKENDS[] =
+{
+#if defined(WIN32)
+    &AUDIO_WASAPI,
+#endif
+#if defined(AUDIO_HAS_ALSA)
+    &AUDIO_ALSA,
+#endif
+    &AUDIO_NULL,
+};
+
+int audio_backends(const AudioBackend **ppBackends, int maxCount)
+{
+    int count = std::min(maxCount, (int)(sizeof(BACKENDS) / sizeof(BACKENDS[0])));
+    std::copy(BACKENDS, BACKENDS + count, ppBackends);
+    return count;
+}
+
+bool audio_open(AudioDevice *pDevice, const char *backend, const AudioConfig& config,
+                AudioCallback callback, void *pContext)
+{
+    pDevice->pBackend = nullptr;
+    for (const AudioBackend *pBackend : BACKENDS)
+    {
+        if (backend ? strcmp(backend, pBackend->name) == 0 : pBackend->native)
+        {
+            pDevice->pBackend = pBackend;
+            break;
+        }
+    }
+    if (!pDevice->pBackend) return false;
+
+    pDevice->config = config;
+    pDevice->config.isa = osc_pick_isa(config.isa);
+    pDevice->callback = callback;
+    pDevice->pContext = pContext;
+    pDevice->pImpl = nullptr;
+    pDevice->stats = AudioStats();
+    pDevice->dither = OutputDither();
+    pDevice->last_frames = 0;
+    pDevice->buffer_frames = 0;
+    if (!pDevice->pBackend->open(pDevice))
+    {
+        audio_close(pDevice);
+        return false;
+    }
+
+    // Sized for a whole buffer up front, nothing allocates once playing
+    const AudioConfig& actual = pDevice->config;
+    if (pDevice->buffer_frames == 0)
+    {
+        pDevice->buffer_frames = actual.period_frames * (uint32_t)std::max(actual.buffer_count, 1);
+    }
+    pDevice->dither.enabled = actual.dither;
+    pDevice->scratch.clear();
+    if (actual.sample_type != SAMPLE_F32)
+    {
+        pDevice->scratch.resize((size_t)pDevice->buffer_frames * actual.channel_count);
+    }
+    return true;
+}
+
+bool audio_start(AudioDevice *pDevice)
+{
+    return pDevice->pBackend->start(pDevice);
+}
+
+bool audio_update(AudioDevice *pDevice)
+{
+    return pDevice->pBackend->update(pDevice);
+}
+
+void audio_close(AudioDevice *pDevice)
+{
+    if (pDevice->pBackend) pDevice->pBackend->close(pDevice);
+    pDevice->pBackend = nullptr;
+    pDevice->pImpl = nullptr;
+}
+
+void audio_pull(AudioDevice *pDevice, void *pOut, uint32_t frameCount, AudioClock::time_point due)
+{
+    AudioStats *pStats = &pDevice->stats;
+    auto start = AudioClock::now();
+
+    double latency = std::max(0.0, std::chrono::duration<double>(start - due).count());
+    pStats->latency_total += latency;
+    pStats->latency_max = std::max(pStats->latency_max, latency);
+
+    // The previous pull should have lasted exactly its frame count
+    if (pDevice->last_frames > 0)
+    {
+        double interval = std::chrono::duration<double>(start - pDevice->last_pull).count();
+        double jitter = std::fabs(interval - (double)pDevice->last_frames / pDevice->config.sample_rate);
+        pStats->jitter_total += jitter;
+        pStats->jitter_max = std::max(pStats->jitter_max, jitter);
+    }
+    pDevice->last_pull = start;
+    pDevice->last_frames = frameCount;
+
+    const AudioConfig& config = pDevice->config;
+    if (config.sample_type == SAMPLE_F32)
+    {
+        pDevice->callback(pDevice->pContext, (float*)pOut, frameCount);
+    }
+    else
+    {
+        size_t sampleCount = (size_t)frameCount * config.channel_count;
+        if (pDevice->scratch.size() < sampleCount) pDevice->scratch.resize(sampleCount);
+        pDevice->callback(pDevice->pContext, pDevice->scratch.data(), frameCount);
+        output_convert(pDevice->scratch.data(), config.channel_count, (int)frameCount, config.channel_count,
+                       config.sample_type, &pDevice->dither, config.isa, pOut);
+    }
+
+    double elapsed = std::chrono::duration<double>(AudioClock::now() - start).count();
+    pStats->callback_max = std::max(pStats->callback_max, elapsed);
+    pStats->periods++;
+    pStats->frames += frameCount;
+}
+
+void audio_print_stats(const AudioDevice *pDevice)
+{
+    const AudioStats& stats = pDevice->stats;
+    double periods = (double)std::max<uint64_t>(stats.periods, 1);
+    fprintf(stderr, "%s device: %u Hz %s%s, %u frames x %i periods, %llu pulls, %u deadline misses\n",
+            pDevice->pBackend->name, pDevice->config.sample_rate, SAMPLE_TYPE_NAMES[pDevice->config.sample_type],
+            pDevice->dither.enabled ? " dithered" : "", pDevice->config.period_frames,
+            pDevice->config.buffer_count, (unsigned long long)stats.periods, stats.deadline_misses);
+    fprintf(stderr, "Latency %.3fms avg, %.3fms max, jitter %.3fms avg, %.3fms max, callback %.3fms max\n",
+            stats.latency_total * 1000.0 / periods, stats.latency_max * 1000.0,
+            stats.jitter_total * 1000.0 / periods, stats.jitter_max * 1000.0, stats.callback_max * 1000.0);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+
+#include "output_stage.h"
+
+// Fills frameCount interleaved float frames, called from audio_update()
+typedef void (*AudioCallback)(void *pContext, float *pOut, uint32_t frameCount);
+
+typedef std::chrono::steady_clock AudioClock;
+
+struct AudioConfig
+{
+    uint32_t sample_rate = 44100;   // Requested, devices may pick another one
+    int channel_count = 2;
+    int sample_type = SAMPLE_F32;   // SAMPLE_*, requested, devices may pick another one
+    bool dither = false;            // TPDF dither when the device takes integers
+    int isa = -1;                   // OSC_ISA_* of the conversion kernels, -1 for the best one
+    uint32_t period_frames = 0;     // Frames per pull, 0 for the backend default
+    int buffer_count = 0;           // Periods queued in the device, 0 for the backend default
+};
+
+// Scheduling measurements, in seconds
+struct AudioStats
+{
+    uint64_t periods = 0;
+    uint64_t frames = 0;
+    uint32_t deadline_misses = 0;   // Times the device ran out of audio
+    double latency_total = 0.0;     // Pull start past the time the period was due
+    double latency_max = 0.0;
+    double jitter_total = 0.0;      // Pull interval deviation from the period length
+    double jitter_max = 0.0;
+    double callback_max = 0.0;      // Longest time spent in the callback
+};
+
+struct AudioDevice;
+
+struct AudioBackend
+{
+    const char *name;
+    bool native;    // Plays to real hardware, picked by default
+
+    // Negotiates the format and fills the actual config, without pulling yet
+    bool (*open)(AudioDevice *pDevice);
+    bool (*start)(AudioDevice *pDevice);
+
+    // Waits until the device has room, then pulls through audio_pull()
+    bool (*update)(AudioDevice *pDevice);
+    void (*close)(AudioDevice *pDevice);
+};
+
+struct AudioDevice
+{
+    const AudioBackend *pBackend = nullptr;
+    AudioConfig config;             // Actual format once opened
+    AudioCallback callback = nullptr;
+    void *pContext = nullptr;
+    void *pImpl = nullptr;          // Backend state
+    AudioStats stats;
+    uint32_t buffer_frames = 0;     // Most frames one pull takes, 0 for period_frames * buffer_count
+    std::vector<float> scratch;     // Callback output, for devices not taking floats
+    OutputDither dither;
+    AudioClock::time_point last_pull;
+    uint32_t last_frames = 0;
+};
+
+extern const AudioBackend AUDIO_WASAPI;
+extern const AudioBackend AUDIO_ALSA;
+extern const AudioBackend AUDIO_NULL;
+
+// Lists the compiled backends, returns their count
+int audio_backends(const AudioBackend **ppBackends, int maxCount);
+
+// nullptr picks the first native backend. Returns false if it's not compiled
+// in or the device can't be opened, the actual format is in pDevice->config.
+bool audio_open(AudioDevice *pDevice, const char *backend, const AudioConfig& config,
+                AudioCallback callback, void *pContext);
+bool audio_start(AudioDevice *pDevice);
+
+// Blocks for about one period, returns false on device errors
+bool audio_update(AudioDevice *pDevice);
+void audio_close(AudioDevice *pDevice);
+
+// For backends, runs the callback, converts to the device's sample type and
+// records the timings. due is when the device needed those frames.
+void audio_pull(AudioDevice *pDevice, void *pOut, uint32_t frameCount, AudioClock::time_point due);
+
+void audio_print_stats(const AudioDevice *pDevice);
@@ -0,0 +1,89 @@
+#include "audio_backend.h"
+
+#include <thread>
+#include <vector>
+
+// No hardware, a virtual device playing in real time: it starts once its
+// buffer is full, then consumes sample_rate frames per second off a steady
+// clock. Audio is thrown away, only the timings matter.
+struct NullDevice
+{
+    std::vector<uint8_t> samples;
+    AudioClock::time_point origin;  // When the device plays frame 0, once the buffer is full
+    int64_t written = 0;            // Frames, always whole periods
+};
+
+static AudioClock::time_point frame_time(const AudioDevice *pDevice, const NullDevice *pNull, int64_t frame)
+{
+    std::chrono::duration<double> offset((double)frame / pDevice->config.sample_rate);
+    return pNull->origin + std::chrono::duration_cast<AudioClock::duration>(offset);
+}
+
+static bool null_open(AudioDevice *pDevice)
+{
+    AudioConfig *pConfig = &pDevice->config;
+    if (pConfig->sample_rate == 0 || pConfig->channel_count <= 0) return false;
+    if (pConfig->period_frames == 0) pConfig->period_frames = pConfig->sample_rate / 100;
+    if (pConfig->buffer_count <= 0) pConfig->buffer_count = 2;
+
+    NullDevice *pNull = new NullDevice;
+    pNull->samples.resize((size_t)pConfig->period_frames * pConfig->channel_count *
+                          output_sample_size(pConfig->sample_type));
+    pDevice->pImpl = pNull;
+    return true;
+}
+
+static bool null_start(AudioDevice *pDevice)
+{
+    NullDevice *pNull = (NullDevice*)pDevice->pImpl;
+    pNull->written = 0;
+    return true;
+}
+
+static bool null_update(AudioDevice *pDevice)
+{
+    NullDevice *pNull = (NullDevice*)pDevice->pImpl;
+    int64_t period = pDevice->config.period_frames;
+    int64_t bufferFrames = period * pDevice->config.buffer_count;
+
+    // The first update fills the whole buffer right away, then it starts
+    // playing. Those pulls aren't paced, so there's no jitter to measure.
+    if (pNull->written == 0)
+    {
+        for (int i = 0; i < pDevice->config.buffer_count; ++i)
+        {
+            pDevice->last_frames = 0;
+            audio_pull(pDevice, pNull->samples.data(), (uint32_t)period, AudioClock::now());
+        }
+        pDevice->last_frames = 0;
+        pNull->origin = AudioClock::now();
+        pNull->written = bufferFrames;
+        return true;
+    }
+
+    // A period frees up once the device played far enough
+    auto ready = frame_time(pDevice, pNull, pNull->written + period - bufferFrames);
+    std::this_thread::sleep_until(ready);
+
+    audio_pull(pDevice, pNull->samples.data(), (uint32_t)period, ready);
+
+    // Too late if the device already needed the first frame, it played
+    // silence meanwhile and continues at the next period it hasn't started
+    auto now = AudioClock::now();
+    if (now > frame_time(pDevice, pNull, pNull->written))
+    {
+        pDevice->stats.deadline_misses++;
+        int64_t played = (int64_t)(std::chrono::duration<double>(now - pNull->origin).count() *
+                                   pDevice->config.sample_rate);
+        pNull->written = (played + period - 1) / period * period;
+    }
+    pNull->written += period;
+    return true;
+}
+
+static void null_close(AudioDevice *pDevice)
+{
+    delete (NullDevice*)pDevice->pImpl;
+}
+
+const AudioBackend AUDIO_NULL = { "null", false, null_open, null_start, null_update, null_close };
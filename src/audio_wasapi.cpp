@@ -0,0 +1,196 @@
+#include "audio_backend.h"
+
+#if defined(WIN32)
+#include <cassert>
+#include <Audioclient.h>
+#include <Mmdeviceapi.h>
+#include <mmreg.h>
+#include <ksmedia.h>
+
+const CLSID CLSID_MMDeviceEnumerator = __uuidof(MMDeviceEnumerator);
+const IID IID_IMMDeviceEnumerator = __uuidof(IMMDeviceEnumerator);
+const IID IID_IAudioClient = __uuidof(IAudioClient);
+const IID IID_IAudioRenderClient = __uuidof(IAudioRenderClient);
+
+struct WasapiDevice
+{
+    UINT32 bufferFrameCount = 0;
+    WAVEFORMATEX* pWaveFormat = nullptr;
+    IMMDeviceEnumerator* pEnumerator = nullptr;
+    IMMDevice* pDevice = nullptr;
+    IAudioClient* pAudioClient = nullptr;
+    HANDLE pEventHandler = nullptr;
+    IAudioRenderClient* pRenderClient = nullptr;
+};
+
+// Mix formats are usually extensible, the sample format is the subformat then
+static bool wasapi_is_format(const WAVEFORMATEX *pFormat, WORD tag, const GUID& subFormat)
+{
+    if (pFormat->wFormatTag == tag) return true;
+    return pFormat->wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+           ((const WAVEFORMATEXTENSIBLE*)pFormat)->SubFormat == subFormat;
+}
+
+static bool wasapi_open(AudioDevice *pDevice)
+{
+    WasapiDevice *pWasapi = new WasapiDevice;
+    pDevice->pImpl = pWasapi;
+    HRESULT hr;
+
+    hr = CoInitialize(0);
+    assert(hr == S_OK);
+    if (hr != S_OK) return false;
+
+    hr = CoCreateInstance(CLSID_MMDeviceEnumerator, NULL, CLSCTX_ALL, IID_IMMDeviceEnumerator, (void**)&pWasapi->pEnumerator);
+    assert(hr == S_OK);
+    if (hr != S_OK) return false;
+
+    hr = pWasapi->pEnumerator->GetDefaultAudioEndpoint(eRender, eConsole, &pWasapi->pDevice);
+    assert(hr == S_OK);
+    if (hr != S_OK) return false;
+
+    hr = pWasapi->pDevice->Activate(IID_IAudioClient, CLSCTX_ALL, NULL, (void**)&pWasapi->pAudioClient);
+    assert(hr == S_OK);
+    if (hr != S_OK) return false;
+
+    // Shared mode, the device format is the mixer's, float on most systems
+    hr = pWasapi->pAudioClient->GetMixFormat(&pWasapi->pWaveFormat);
+    assert(hr == S_OK);
+    if (hr != S_OK) return false;
+
+    AudioConfig *pConfig = &pDevice->config;
+    pConfig->sample_rate = (uint32_t)pWasapi->pWaveFormat->nSamplesPerSec;
+    pConfig->channel_count = (int)pWasapi->pWaveFormat->nChannels;
+    const WAVEFORMATEX *pFormat = pWasapi->pWaveFormat;
+    if (wasapi_is_format(pFormat, WAVE_FORMAT_IEEE_FLOAT, KSDATAFORMAT_SUBTYPE_IEEE_FLOAT))
+    {
+        if (pFormat->wBitsPerSample != 32) return false;
+        pConfig->sample_type = SAMPLE_F32;
+    }
+    else if (wasapi_is_format(pFormat, WAVE_FORMAT_PCM, KSDATAFORMAT_SUBTYPE_PCM))
+    {
+        switch (pFormat->wBitsPerSample)
+        {
+            case 24: pConfig->sample_type = SAMPLE_S24; break;
+            case 16: pConfig->sample_type = SAMPLE_S16; break;
+            default: return false;   // 32-bit integers aren't an output format
+        }
+    }
+    else
+    {
+        return false;
+    }
+    if (pConfig->buffer_count <= 0) pConfig->buffer_count = 2;
+
+    // 5ms by default, in 100ns units
+    REFERENCE_TIME duration = 50000;
+    if (pConfig->period_frames > 0)
+    {
+        duration = (REFERENCE_TIME)pConfig->period_frames * pConfig->buffer_count * 10000000 / pConfig->sample_rate;
+    }
+
+    hr = pWasapi->pAudioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, AUDCLNT_STREAMFLAGS_EVENTCALLBACK, duration, 0,
+                                           pWasapi->pWaveFormat, NULL);
+    assert(hr == S_OK);
+    if (hr != S_OK) return false;
+
+    pWasapi->pEventHandler = CreateEvent(nullptr, false, false, nullptr);
+    assert(pWasapi->pEventHandler);
+    if (pWasapi->pEventHandler == nullptr) return false;
+
+    hr = pWasapi->pAudioClient->SetEventHandle(pWasapi->pEventHandler);
+    assert(hr == S_OK);
+    if (hr != S_OK) return false;
+
+    // The device may round the buffer up, and updates fill all of it that's free
+    hr = pWasapi->pAudioClient->GetBufferSize(&pWasapi->bufferFrameCount);
+    assert(hr == S_OK);
+    if (hr != S_OK) return false;
+    pConfig->period_frames = pWasapi->bufferFrameCount / pConfig->buffer_count;
+    pDevice->buffer_frames = pWasapi->bufferFrameCount;
+
+    hr = pWasapi->pAudioClient->GetService(IID_IAudioRenderClient, (void**)&pWasapi->pRenderClient);
+    assert(hr == S_OK);
+    if (hr != S_OK) return false;
+    return true;
+}
+
+static bool wasapi_start(AudioDevice *pDevice)
+{
+    WasapiDevice *pWasapi = (WasapiDevice*)pDevice->pImpl;
+    HRESULT hr = pWasapi->pAudioClient->Start();  // Start playing.
+    assert(hr == S_OK);
+    return hr == S_OK;
+}
+
+static bool wasapi_update(AudioDevice *pDevice)
+{
+    WasapiDevice *pWasapi = (WasapiDevice*)pDevice->pImpl;
+    HRESULT hr;
+    UINT32 numFramesAvailable;
+    UINT32 numFramesPadding;
+    BYTE *pData;
+    DWORD retval;
+
+    retval = WaitForSingleObject(pWasapi->pEventHandler, 2000);
+    if (retval != WAIT_OBJECT_0)
+    {
+        // Event handle timed out after a 2-second wait.
+        pWasapi->pAudioClient->Stop();
+        return false;
+    }
+    auto due = AudioClock::now();
+
+    // See how much buffer space is available.
+    hr = pWasapi->pAudioClient->GetCurrentPadding(&numFramesPadding);
+    assert(hr == S_OK);
+    if (hr != S_OK)
+    {
+        return false;
+    }
+
+    // Nothing left queued, the device played silence
+    if (numFramesPadding == 0 && pDevice->stats.periods > 0)
+    {
+        pDevice->stats.deadline_misses++;
+    }
+
+    numFramesAvailable = pWasapi->bufferFrameCount - numFramesPadding;
+    if (numFramesAvailable > 0)
+    {
+        // Grab all the available space in the shared buffer.
+        hr = pWasapi->pRenderClient->GetBuffer(numFramesAvailable, &pData);
+        assert(hr == S_OK);
+        if (hr != S_OK)
+        {
+            return false;
+        }
+
+        audio_pull(pDevice, pData, numFramesAvailable, due);
+
+        hr = pWasapi->pRenderClient->ReleaseBuffer(numFramesAvailable, 0);
+        assert(hr == S_OK);
+        if (hr != S_OK)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void wasapi_close(AudioDevice *pDevice)
+{
+    WasapiDevice *pWasapi = (WasapiDevice*)pDevice->pImpl;
+    if (!pWasapi) return;
+    if (pWasapi->pAudioClient) pWasapi->pAudioClient->Stop();
+    CoTaskMemFree(pWasapi->pWaveFormat);
+    if (pWasapi->pEnumerator) pWasapi->pEnumerator->Release();
+    if (pWasapi->pDevice) pWasapi->pDevice->Release();
+    if (pWasapi->pAudioClient) pWasapi->pAudioClient->Release();
+    if (pWasapi->pRenderClient) pWasapi->pRenderClient->Release();
+    if (pWasapi->pEventHandler) CloseHandle(pWasapi->pEventHandler);
+    delete pWasapi;
+}
+
+const AudioBackend AUDIO_WASAPI = { "wasapi", true, wasapi_open, wasapi_start, wasapi_update, wasapi_close };
+#endif
@@ -0,0 +1,447 @@
+#include "batch.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "pcm_writer.h"
+#include "worker_pool.h"
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+// Frames planned and mixed at once inside a segment
+#define BATCH_PLAN_FRAMES (32 * STEM_BLOCK_FRAMES)
+
+// A rendered segment waiting for the ones before it to be written
+struct Segment
+{
+    std::vector<float> frames;
+    bool ready = false;
+    bool last = false;  // The song ends in it
+};
+
+struct Song
+{
+    std::string midi_path;
+    std::string out_path;
+    uint64_t size = 0;
+
+    std::mutex mutex;
+    PcmWriter writer;
+    bool opened = false;
+    bool done = false;
+    std::vector<Segment> segments;
+    int next_write = 0;
+    uint64_t frames = 0;
+    double render_time = 0.0;   // Summed over the segments
+};
+
+struct Task
+{
+    int song;
+    int segment;
+};
+
+// Workers take their own tasks from the back and steal from the front of the
+// others' queues.
+struct TaskQueue
+{
+    std::mutex mutex;
+    std::deque<Task> tasks;
+};
+
+struct Batch
+{
+    const BatchConfig *pConfig = nullptr;
+    std::vector<std::unique_ptr<Song>> songs;
+    std::vector<std::unique_ptr<TaskQueue>> queues;
+    std::atomic<int> pending;   // Tasks queued or running
+    std::atomic<int> finished;
+    std::atomic<int> failed;
+    std::atomic<int> steals;
+    std::atomic<uint64_t> total_frames;
+};
+
+static bool has_midi_extension(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    if (!ext) return false;
+
+    char lower[8] = {};
+    for (int i = 0; i < 7 && ext[i]; ++i)
+    {
+        lower[i] = (char)tolower((unsigned char)ext[i]);
+    }
+    return strcmp(lower, ".mid") == 0 || strcmp(lower, ".midi") == 0;
+}
+
+static bool is_directory(const char *path)
+{
+#if defined(WIN32)
+    DWORD attributes = GetFileAttributesA(path);
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    struct stat info;
+    return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+}
+
+static bool list_directory(const char *path, std::vector<std::string> *pFiles)
+{
+    std::string dir = path;
+    if (!dir.empty() && dir.back() != '/' && dir.back() != '\\') dir += '/';
+
+#if defined(WIN32)
+    WIN32_FIND_DATAA data;
+    HANDLE hFind = FindFirstFileA((dir + "*").c_str(), &data);
+    if (hFind == INVALID_HANDLE_VALUE) return false;
+    do
+    {
+        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && has_midi_extension(data.cFileName))
+        {
+            pFiles->push_back(dir + data.cFileName);
+        }
+    } while (FindNextFileA(hFind, &data));
+    FindClose(hFind);
+#else
+    DIR *pDir = opendir(path);
+    if (!pDir) return false;
+    while (struct dirent *pEntry = readdir(pDir))
+    {
+        std::string file = dir + pEntry->d_name;
+        if (has_midi_extension(pEntry->d_name) && !is_directory(file.c_str()))
+        {
+            pFiles->push_back(file);
+        }
+    }
+    closedir(pDir);
+#endif
+
+    std::sort(pFiles->begin(), pFiles->end());
+    return true;
+}
+
+static bool read_manifest(const char *path, std::vector<std::string> *pFiles)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) return false;
+
+    char line[4096];
+    while (fgets(line, sizeof(line), file))
+    {
+        char *pComment = strchr(line, '#');
+        if (pComment) *pComment = '\0';
+
+        char *pStart = line;
+        while (*pStart && isspace((unsigned char)*pStart)) ++pStart;
+        char *pEnd = pStart + strlen(pStart);
+        while (pEnd > pStart && isspace((unsigned char)pEnd[-1])) --pEnd;
+        *pEnd = '\0';
+
+        if (*pStart) pFiles->push_back(pStart);
+    }
+    fclose(file);
+    return true;
+}
+
+bool batch_collect(const char *path, std::vector<std::string> *pFiles)
+{
+    if (is_directory(path)) return list_directory(path, pFiles);
+    return read_manifest(path, pFiles);
+}
+
+static uint64_t file_size(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) return 0;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size > 0 ? (uint64_t)size : 0;
+}
+
+// Output named after the input, made unique within the batch
+static std::string output_path(const BatchConfig& config, const std::string& midi_path, std::set<std::string> *pUsed)
+{
+    size_t slash = midi_path.find_last_of("/\\");
+    std::string name = midi_path.substr(slash == std::string::npos ? 0 : slash + 1);
+    size_t dot = name.find_last_of('.');
+    if (dot != std::string::npos && dot > 0) name.resize(dot);
+
+    std::string unique = name;
+    for (int i = 2; pUsed->count(unique); ++i)
+    {
+        unique = name + "_" + std::to_string(i);
+    }
+    pUsed->insert(unique);
+
+    std::string dir = config.out_dir;
+    if (!dir.empty() && dir.back() != '/' && dir.back() != '\\') dir += '/';
+    return dir + unique + (config.container == PCM_CONTAINER_WAV ? ".wav" : ".raw");
+}
+
+static void push_task(Batch *pBatch, int queue, Task task)
+{
+    ++pBatch->pending;
+    TaskQueue& q = *pBatch->queues[queue];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    q.tasks.push_back(task);
+}
+
+static bool pop_task(Batch *pBatch, int worker, Task *pTask)
+{
+    {
+        TaskQueue& q = *pBatch->queues[worker];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (!q.tasks.empty())
+        {
+            *pTask = q.tasks.back();
+            q.tasks.pop_back();
+            return true;
+        }
+    }
+
+    int count = (int)pBatch->queues.size();
+    for (int i = 1; i < count; ++i)
+    {
+        TaskQueue& q = *pBatch->queues[(worker + i) % count];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (!q.tasks.empty())
+        {
+            *pTask = q.tasks.front();
+            q.tasks.pop_front();
+            ++pBatch->steals;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void finish_song(Batch *pBatch, Song *pSong, bool ok)
+{
+    pSong->done = true;
+    ok = pSong->opened ? pcm_close(&pSong->writer) && ok : ok;
+
+    int index = ++pBatch->finished;
+    int total = (int)pBatch->songs.size();
+    if (!ok)
+    {
+        ++pBatch->failed;
+        fprintf(stderr, "[%i/%i] %s: failed\n", index, total, pSong->midi_path.c_str());
+        return;
+    }
+
+    double duration = (double)pSong->frames / (double)pBatch->pConfig->player.sample_rate;
+    pBatch->total_frames += pSong->frames;
+    fprintf(stderr, "[%i/%i] %s: %.2fs of audio in %.3fs (%.1fx realtime), %i segments -> %s\n",
+            index, total, pSong->midi_path.c_str(), duration, pSong->render_time,
+            pSong->render_time > 0.0 ? duration / pSong->render_time : 0.0,
+            (int)pSong->segments.size(), pSong->out_path.c_str());
+}
+
+// Hands a rendered segment over, then writes every segment that's next in
+// line. Segments past the end of the song are dropped.
+static void deliver_segment(Batch *pBatch, Song *pSong, int segment, std::vector<float>& frames, bool last,
+                            double render_time)
+{
+    const BatchConfig& config = *pBatch->pConfig;
+    std::lock_guard<std::mutex> lock(pSong->mutex);
+    if (pSong->done) return;
+
+    if ((int)pSong->segments.size() <= segment) pSong->segments.resize(segment + 1);
+    pSong->segments[segment].frames.swap(frames);
+    pSong->segments[segment].ready = true;
+    pSong->segments[segment].last = last;
+    pSong->render_time += render_time;
+
+    while (pSong->next_write < (int)pSong->segments.size() && pSong->segments[pSong->next_write].ready)
+    {
+        Segment& next = pSong->segments[pSong->next_write++];
+        if (!pSong->opened)
+        {
+            if (!pcm_open(&pSong->writer, pSong->out_path.c_str(), config.container, config.sample_type,
+                          config.sample_rate, config.channel_count, 0) ||
+                !pcm_resample_from(&pSong->writer, config.player.sample_rate, config.resample_quality,
+                                   osc_pick_isa(config.player.isa)))
+            {
+                finish_song(pBatch, pSong, false);
+                return;
+            }
+            pcm_set_dither(&pSong->writer, config.dither);
+            pSong->opened = true;
+        }
+
+        int frameCount = (int)(next.frames.size() / config.channel_count);
+        if (!pcm_write(&pSong->writer, next.frames.data(), frameCount))
+        {
+            finish_song(pBatch, pSong, false);
+            return;
+        }
+        pSong->frames += (uint64_t)frameCount;
+        std::vector<float>().swap(next.frames);
+
+        if (next.last)
+        {
+            pSong->segments.resize(pSong->next_write);
+            finish_song(pBatch, pSong, true);
+            return;
+        }
+    }
+}
+
+// Renders one segment of a song. The next segment is queued before rendering
+// starts, so another worker can steal it while this one is busy.
+static void run_segment(Batch *pBatch, int worker, Task task, StemBatch *pStems, WorkerPool *pInline)
+{
+    const BatchConfig& config = *pBatch->pConfig;
+    Song *pSong = pBatch->songs[task.song].get();
+    {
+        std::lock_guard<std::mutex> lock(pSong->mutex);
+        if (pSong->done) return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Player player;
+    if (!player_open(&player, pSong->midi_path.c_str(), config.player))
+    {
+        std::lock_guard<std::mutex> lock(pSong->mutex);
+        if (!pSong->done) finish_song(pBatch, pSong, false);
+        return;
+    }
+
+    uint64_t segmentFrames = std::max<uint64_t>(STEM_BLOCK_FRAMES,
+                                                (uint64_t)(config.segment_length * config.player.sample_rate));
+    uint64_t first = (uint64_t)task.segment * segmentFrames;
+    std::vector<float> frames;
+    if (first < UINT32_MAX)
+    {
+        player_seek(&player, (uint32_t)first);
+    }
+
+    bool reached = player.playback_samples == first && !player.song_ended;
+    if (reached)
+    {
+        Task next = { task.song, task.segment + 1 };
+        push_task(pBatch, worker, next);
+
+        stems_reset(pStems);
+        frames.reserve((size_t)segmentFrames * config.channel_count);
+        uint64_t rendered = 0;
+        while (rendered < segmentFrames && !player.song_ended)
+        {
+            int frameCount = (int)std::min<uint64_t>(BATCH_PLAN_FRAMES, segmentFrames - rendered);
+            frameCount = player_plan_stems(&player, pStems, frameCount);
+            stems_render(pStems, pInline, config.channel_count);
+            frames.insert(frames.end(), pStems->output.begin(), pStems->output.end());
+            rendered += (uint64_t)frameCount;
+        }
+    }
+    bool last = player.song_ended || !reached;
+    TrackError error = player_track_error(&player);
+    if (reached && player.song_ended && error.reason)
+    {
+        // Only the segment playing the end reports it, every other one may have stopped before
+        fprintf(stderr, "%s: track %i: %s at byte %u, skipped the rest\n", pSong->midi_path.c_str(), error.track,
+                error.reason, error.pos);
+    }
+    player_close(&player);
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    deliver_segment(pBatch, pSong, task.segment, frames, last, elapsed);
+}
+
+static void worker_main(Batch *pBatch, int worker)
+{
+    StemBatch stems;
+    WorkerPool inline_pool;
+    workers_start(&inline_pool, 1);
+
+    while (pBatch->pending > 0)
+    {
+        Task task;
+        if (!pop_task(pBatch, worker, &task))
+        {
+            // Only the last segments are left, and they queue their successor
+            // right after their seek
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            continue;
+        }
+        run_segment(pBatch, worker, task, &stems, &inline_pool);
+        --pBatch->pending;
+    }
+
+    workers_stop(&inline_pool);
+}
+
+int batch_render(const std::vector<std::string>& files, const BatchConfig& config)
+{
+    int threadCount = config.thread_count > 0 ? config.thread_count
+                                              : std::max(1, (int)std::thread::hardware_concurrency());
+
+    Batch batch;
+    batch.pConfig = &config;
+    batch.pending = 0;
+    batch.finished = 0;
+    batch.failed = 0;
+    batch.steals = 0;
+    batch.total_frames = 0;
+    for (int i = 0; i < threadCount; ++i)
+    {
+        batch.queues.emplace_back(new TaskQueue());
+    }
+
+    std::set<std::string> used;
+    for (auto& path : files)
+    {
+        Song *pSong = new Song();
+        pSong->midi_path = path;
+        pSong->out_path = output_path(config, path, &used);
+        pSong->size = file_size(path.c_str());
+        batch.songs.emplace_back(pSong);
+    }
+
+    // Biggest songs first. Workers take from the back of their queue, so deal
+    // the songs smallest first.
+    std::vector<int> order(files.size());
+    for (int i = 0; i < (int)order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(),
+                     [&](int a, int b) { return batch.songs[a]->size < batch.songs[b]->size; });
+    for (int i = 0; i < (int)order.size(); ++i)
+    {
+        Task task = { order[i], 0 };
+        push_task(&batch, i % threadCount, task);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 1; i < threadCount; ++i)
+    {
+        threads.emplace_back(worker_main, &batch, i);
+    }
+    worker_main(&batch, 0);
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double duration = (double)batch.total_frames / (double)config.player.sample_rate;
+    fprintf(stderr, "Batch: %i songs, %i failed, %.2fs of audio in %.3fs on %i threads (%.1fx realtime, %.1f songs/s), "
+            "%i tasks stolen\n", (int)files.size(), (int)batch.failed, duration, elapsed, threadCount,
+            elapsed > 0.0 ? duration / elapsed : 0.0, elapsed > 0.0 ? (double)files.size() / elapsed : 0.0,
+            (int)batch.steals);
+    return batch.failed;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "player.h"
+#include "resampler.h"
+
+struct BatchConfig
+{
+    PlayerConfig player;            // Players share pWavetables, build it with wt_build_all() first
+    int container = 0;              // PCM_CONTAINER_*
+    int sample_type = 0;            // SAMPLE_*
+    bool dither = false;            // TPDF dither for the integer sample types
+    int channel_count = 2;
+    uint32_t sample_rate = PLAYER_SAMPLE_RATE;  // Of the outputs, resampled from the player's
+    int resample_quality = RESAMPLE_MEDIUM;
+    int thread_count = 0;           // 0 uses every core
+    double segment_length = 60.0;   // Seconds, longer songs are split
+    const char *out_dir = ".";
+};
+
+// Lists the .mid files of a directory, or the paths of a manifest (one per
+// line, # starts a comment). Returns false if path can't be read.
+bool batch_collect(const char *path, std::vector<std::string> *pFiles);
+
+// Renders every file into out_dir, one output per song named after the
+// input. Returns the number of songs that failed.
+int batch_render(const std::vector<std::string>& files, const BatchConfig& config);
@@ -0,0 +1,383 @@
+#include "event_store.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+// Entry that only carries time, for gaps longer than a delta can hold
+#define STORE_GAP 7
+
+// "MXEC" read on a little endian machine, so caches from the other byte
+// order don't match either
+#define STORE_MAGIC 0x4345584D
+
+// Start of the blob
+struct StoreHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_hash;
+    uint64_t source_size;
+    uint64_t event_count;
+    uint32_t entry_count;
+    uint32_t tempo_count;
+    uint32_t names_size;
+    uint32_t track_count;
+    uint16_t format;
+    uint16_t division;
+    uint32_t reserved;
+};
+
+// Byte offsets of the arrays in the blob
+struct StoreLayout
+{
+    size_t delta;
+    size_t kind;
+    size_t note;
+    size_t vel;
+    size_t tempo_entries;
+    size_t tempo_values;
+    size_t names;
+    size_t size;
+};
+
+static size_t align8(size_t offset)
+{
+    return (offset + 7) & ~(size_t)7;
+}
+
+static StoreLayout store_layout(size_t entries, size_t tempos, size_t namesSize)
+{
+    StoreLayout layout;
+    layout.tempo_entries = align8(sizeof(StoreHeader));
+    layout.tempo_values = align8(layout.tempo_entries + tempos * sizeof(uint32_t));
+    layout.delta = align8(layout.tempo_values + tempos * sizeof(uint32_t));
+    layout.kind = align8(layout.delta + entries * sizeof(uint16_t));
+    layout.note = align8(layout.kind + entries);
+    layout.vel = align8(layout.note + entries);
+    layout.names = align8(layout.vel + entries);
+    layout.size = layout.names + namesSize;
+    return layout;
+}
+
+// Points the arrays into a blob whose header was already checked
+static void store_attach(EventStore *pStore, const uint8_t *pBlob)
+{
+    const StoreHeader *pHeader = (const StoreHeader*)pBlob;
+    StoreLayout layout = store_layout(pHeader->entry_count, pHeader->tempo_count, pHeader->names_size);
+    pStore->pDelta = (const uint16_t*)(pBlob + layout.delta);
+    pStore->pKind = pBlob + layout.kind;
+    pStore->pNote = pBlob + layout.note;
+    pStore->pVel = pBlob + layout.vel;
+    pStore->pTempoEntries = (const uint32_t*)(pBlob + layout.tempo_entries);
+    pStore->pTempoValues = (const uint32_t*)(pBlob + layout.tempo_values);
+    pStore->pNames = (const char*)(pBlob + layout.names);
+    pStore->entry_count = pHeader->entry_count;
+    pStore->tempo_count = pHeader->tempo_count;
+    pStore->names_size = pHeader->names_size;
+    pStore->track_count = (int)pHeader->track_count;
+    pStore->event_count = pHeader->event_count;
+}
+
+// Runs the whole file through a stream. Without a blob, only counts what the
+// arrays will need.
+static void store_fill(uint8_t *pBlob, const StoreLayout& layout, const MidiFile *pFile, size_t *pEntries,
+                       size_t *pTempos, TrackError *pError)
+{
+    uint16_t *pDelta = pBlob ? (uint16_t*)(pBlob + layout.delta) : nullptr;
+    uint8_t *pKind = pBlob ? pBlob + layout.kind : nullptr;
+    uint8_t *pNote = pBlob ? pBlob + layout.note : nullptr;
+    uint8_t *pVel = pBlob ? pBlob + layout.vel : nullptr;
+    uint32_t *pTempoEntries = pBlob ? (uint32_t*)(pBlob + layout.tempo_entries) : nullptr;
+    uint32_t *pTempoValues = pBlob ? (uint32_t*)(pBlob + layout.tempo_values) : nullptr;
+
+    EventStream stream;
+    stream_init(&stream, pFile, (int)pFile->tracks.size());
+
+    size_t entry = 0;
+    size_t tempo = 0;
+    uint32_t tick = 0;
+    while (const Event *pEvent = stream_peek(&stream))
+    {
+        uint32_t delta = pEvent->time - tick;
+        tick = pEvent->time;
+        for (; delta > 0xFFFF; delta -= 0xFFFF, ++entry)
+        {
+            if (!pBlob) continue;
+            pDelta[entry] = 0xFFFF;
+            pKind[entry] = STORE_GAP;
+            pNote[entry] = 0;
+            pVel[entry] = 0;
+        }
+
+        if (pBlob)
+        {
+            pDelta[entry] = (uint16_t)delta;
+            pKind[entry] = (uint8_t)(pEvent->type | (pEvent->channel << 3));
+            pNote[entry] = (uint8_t)pEvent->note;
+            pVel[entry] = (uint8_t)(pEvent->vel * 127.0f + 0.5f);
+            if (pEvent->type == EVENT_TEMPO)
+            {
+                pNote[entry] = 0;
+                pTempoEntries[tempo] = (uint32_t)entry;
+                pTempoValues[tempo] = (uint32_t)pEvent->note;
+            }
+        }
+        if (pEvent->type == EVENT_TEMPO) ++tempo;
+        ++entry;
+        stream_pop(&stream);
+    }
+
+    *pEntries = entry;
+    *pTempos = tempo;
+    *pError = stream.error;
+}
+
+bool store_build(EventStore *pStore, const MidiFile *pFile)
+{
+    store_clear(pStore);
+
+    size_t entries = 0;
+    size_t tempos = 0;
+    StoreLayout layout = {};
+    store_fill(nullptr, layout, pFile, &entries, &tempos, &pStore->error);
+    if (entries > 0xFFFFFFFF) return false;
+
+    std::string names;
+    for (int i = 0; i < (int)pFile->tracks.size(); ++i)
+    {
+        char name[256];
+        if (midi_track_name(pFile, i, name, sizeof(name))) names += name;
+        names += '\0';
+    }
+
+    layout = store_layout(entries, tempos, names.size());
+    pStore->storage.assign(layout.size, 0);
+    uint8_t *pBlob = pStore->storage.data();
+    store_fill(pBlob, layout, pFile, &entries, &tempos, &pStore->error);
+    memcpy(pBlob + layout.names, names.data(), names.size());
+
+    StoreHeader *pHeader = (StoreHeader*)pBlob;
+    pHeader->magic = STORE_MAGIC;
+    pHeader->version = STORE_CACHE_VERSION;
+    pHeader->source_size = pFile->size;
+    pHeader->entry_count = (uint32_t)entries;
+    pHeader->tempo_count = (uint32_t)tempos;
+    pHeader->names_size = (uint32_t)names.size();
+    pHeader->track_count = (uint32_t)pFile->tracks.size();
+    pHeader->format = pFile->format;
+    pHeader->division = pFile->division;
+
+    const uint8_t *pKind = pBlob + layout.kind;
+    pHeader->event_count = entries - std::count(pKind, pKind + entries, (uint8_t)STORE_GAP);
+
+    store_attach(pStore, pBlob);
+    return true;
+}
+
+static uint64_t rotate_left(uint64_t x, int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+// Four independent lanes over 8 byte words, hashing runs at memory speed so
+// it costs next to nothing next to decoding
+static uint64_t hash_source(const uint8_t *pData, size_t size)
+{
+    const uint64_t prime1 = 0x9E3779B97F4A7C15ull;
+    const uint64_t prime2 = 0xBF58476D1CE4E5B9ull;
+    uint64_t lanes[4] = { size, prime1, prime2, prime1 ^ prime2 };
+
+    size_t pos = 0;
+    for (; size - pos >= 32; pos += 32)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            uint64_t word;
+            memcpy(&word, pData + pos + i * 8, 8);
+            lanes[i] = rotate_left(lanes[i] ^ (word * prime1), 31) * prime2;
+        }
+    }
+    for (; pos < size; ++pos)
+    {
+        lanes[pos & 3] = rotate_left(lanes[pos & 3] ^ (pData[pos] * prime1), 31) * prime2;
+    }
+
+    uint64_t hash = 0;
+    for (uint64_t lane : lanes)
+    {
+        hash = (hash ^ lane) * prime1;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+static std::string cache_path(const char *cacheDir, uint64_t hash)
+{
+    std::string path = cacheDir;
+    if (!path.empty() && path.back() != '/' && path.back() != '\\') path += '/';
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx" STORE_CACHE_EXTENSION, (unsigned long long)hash);
+    return path + name;
+}
+
+// Only takes a cache file that fully matches the source and this build
+static bool load_cache(EventStore *pStore, const MidiFile *pFile, const std::string& path, uint64_t hash)
+{
+    MappedFile mapping;
+    if (!map_open(&mapping, path.c_str())) return false;
+
+    const StoreHeader *pHeader = (const StoreHeader*)mapping.pData;
+    bool valid = mapping.size >= sizeof(StoreHeader) &&
+                 pHeader->magic == STORE_MAGIC &&
+                 pHeader->version == STORE_CACHE_VERSION &&
+                 pHeader->source_hash == hash &&
+                 pHeader->source_size == pFile->size &&
+                 pHeader->track_count == pFile->tracks.size() &&
+                 pHeader->event_count <= pHeader->entry_count &&
+                 store_layout(pHeader->entry_count, pHeader->tempo_count, pHeader->names_size).size == mapping.size &&
+                 (pHeader->names_size == 0 || mapping.pData[mapping.size - 1] == '\0');
+    if (!valid)
+    {
+        map_close(&mapping);
+        return false;
+    }
+
+    store_attach(pStore, mapping.pData);
+    pStore->mapping = mapping;
+    pStore->cached = true;
+    return true;
+}
+
+// Written aside then renamed over, so readers never map a partial file
+static bool save_cache(const EventStore *pStore, const std::string& path)
+{
+    char suffix[40];
+    uint64_t unique = (uint64_t)(uintptr_t)pStore ^
+                      (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+    snprintf(suffix, sizeof(suffix), ".%016llx.tmp", (unsigned long long)unique);
+    std::string tempPath = path + suffix;
+
+    FILE *pOut = fopen(tempPath.c_str(), "wb");
+    if (!pOut) return false;
+    bool ok = fwrite(pStore->storage.data(), 1, pStore->storage.size(), pOut) == pStore->storage.size();
+    ok = fclose(pOut) == 0 && ok;
+#if defined(WIN32)
+    if (ok) remove(path.c_str());
+#endif
+    ok = ok && rename(tempPath.c_str(), path.c_str()) == 0;
+    if (!ok) remove(tempPath.c_str());
+    return ok;
+}
+
+bool store_open(EventStore *pStore, const MidiFile *pFile, const char *cacheDir)
+{
+    if (!cacheDir) return store_build(pStore, pFile);
+
+    store_clear(pStore);
+    uint64_t hash = hash_source(pFile->pData, pFile->size);
+    std::string path = cache_path(cacheDir, hash);
+    if (load_cache(pStore, pFile, path, hash)) return true;
+
+    if (!store_build(pStore, pFile)) return false;
+    ((StoreHeader*)pStore->storage.data())->source_hash = hash;
+    pStore->cache_failed = !save_cache(pStore, path);
+    return true;
+}
+
+void store_clear(EventStore *pStore)
+{
+    map_close(&pStore->mapping);
+    std::vector<uint8_t>().swap(pStore->storage);
+    pStore->pDelta = nullptr;
+    pStore->pKind = nullptr;
+    pStore->pNote = nullptr;
+    pStore->pVel = nullptr;
+    pStore->pTempoEntries = nullptr;
+    pStore->pTempoValues = nullptr;
+    pStore->pNames = nullptr;
+    pStore->entry_count = 0;
+    pStore->tempo_count = 0;
+    pStore->names_size = 0;
+    pStore->track_count = 0;
+    pStore->event_count = 0;
+    pStore->cached = false;
+    pStore->cache_failed = false;
+    pStore->error = TrackError();
+}
+
+size_t store_memory_used(const EventStore *pStore)
+{
+    return (size_t)pStore->entry_count * (sizeof(uint16_t) + 3 * sizeof(uint8_t)) +
+           (size_t)pStore->tempo_count * 2 * sizeof(uint32_t);
+}
+
+bool store_track_name(const EventStore *pStore, int track, char *out, size_t outSize)
+{
+    if (track < 0 || track >= pStore->track_count || outSize == 0) return false;
+
+    const char *pName = pStore->pNames;
+    const char *pEnd = pStore->pNames + pStore->names_size;
+    for (int i = 0; i < track && pName < pEnd; ++i) pName += strlen(pName) + 1;
+    if (pName >= pEnd || *pName == '\0') return false;
+
+    size_t size = std::min(strlen(pName), outSize - 1);
+    memcpy(out, pName, size);
+    out[size] = '\0';
+    return true;
+}
+
+bool store_next(const EventStore *pStore, TrackCursor *pCursor)
+{
+    Event& e = pCursor->event;
+    while (pCursor->pos < pCursor->len)
+    {
+        uint32_t entry = pCursor->pos++;
+        pCursor->tick += pStore->pDelta[entry];
+        uint8_t kind = pStore->pKind[entry];
+        if (kind == STORE_GAP) continue;
+
+        e.time = pCursor->tick;
+        e.track = 0;
+        e.type = kind & 7;
+        e.channel = (kind >> 3) & 15;
+        e.note = pStore->pNote[entry];
+        e.vel = (float)pStore->pVel[entry] / 127.0f;
+        if (e.type == EVENT_TEMPO)
+        {
+            // A damaged cache may have fewer tempo values than tempo entries
+            const uint32_t *pEnd = pStore->pTempoEntries + pStore->tempo_count;
+            const uint32_t *pIt = std::lower_bound(pStore->pTempoEntries, pEnd, entry);
+            if (pIt == pEnd || *pIt != entry) continue;
+            e.note = (int)pStore->pTempoValues[pIt - pStore->pTempoEntries];
+        }
+        return true;
+    }
+
+    pCursor->ended = true;
+    return false;
+}
+
+void stream_init_store(EventStream *pStream, const MidiFile *pFile, const EventStore *pStore)
+{
+    pStream->pFile = pFile;
+    pStream->pStore = pStore;
+    pStream->cursors.resize(1);
+    pStream->total_len = pStore->entry_count;
+    pStream->error = TrackError();
+
+    TrackCursor& cursor = pStream->cursors[0];
+    cursor.pData = nullptr;
+    cursor.len = pStore->entry_count;
+    cursor.pos = 0;
+    cursor.tick = 0;
+    cursor.track = 0;
+    cursor.ended = false;
+    cursor.error = nullptr;
+    cursor.error_pos = 0;
+
+    pStream->heap.clear();
+    if (store_next(pStore, &cursor)) pStream->heap.push_back(0);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "mapped_file.h"
+#include "midi_file.h"
+
+// Bump whenever the decoder or the layout below changes what ends up in a
+// store, so older cache files get rebuilt
+#define STORE_CACHE_VERSION 2
+#define STORE_CACHE_EXTENSION ".mxc"
+
+// A whole song decoded up front, merged in playback order and packed as
+// structure of arrays: 5 bytes per event instead of a sizeof(Event) record.
+// Gaps longer than a uint16_t delta are split with filler entries, and tempo
+// values live on the side since they need 24 bits.
+//
+// The arrays sit in one blob laid out exactly like a cache file, a header
+// then each array 8 byte aligned then the track names, so a cached store is
+// used straight from the mapped file.
+struct EventStore
+{
+    const uint16_t *pDelta = nullptr;   // Ticks since the previous entry
+    const uint8_t *pKind = nullptr;     // EVENT_* in the low 3 bits, channel above
+    const uint8_t *pNote = nullptr;
+    const uint8_t *pVel = nullptr;      // 0-127
+    const uint32_t *pTempoEntries = nullptr;    // Entry index of each tempo change
+    const uint32_t *pTempoValues = nullptr;     // Microseconds per quarter note
+    const char *pNames = nullptr;       // One NUL terminated name per track, empty when missing
+    uint32_t entry_count = 0;
+    uint32_t tempo_count = 0;
+    uint32_t names_size = 0;
+    int track_count = 0;
+    uint64_t event_count = 0;       // Without the fillers
+    bool cached = false;            // Came from a cache file
+    bool cache_failed = false;      // Built, but the cache file couldn't be written
+    TrackError error;               // Met while building, cached stores don't keep it
+
+    std::vector<uint8_t> storage;   // The blob of a built store
+    MappedFile mapping;             // The blob of a cached one
+
+    EventStore() = default;
+    EventStore(const EventStore&) = delete;             // The pointers go into the blob
+    EventStore& operator=(const EventStore&) = delete;
+};
+
+// Decodes the file twice, first counting the entries so the blob is
+// allocated once at its final size.
+bool store_build(EventStore *pStore, const MidiFile *pFile);
+
+// Like store_build(), but with a cache directory first looks for a cache
+// file of this exact source, named after its hash. On a miss the built
+// store is written there for next time, failing that sets cache_failed.
+bool store_open(EventStore *pStore, const MidiFile *pFile, const char *cacheDir);
+
+void store_clear(EventStore *pStore);
+
+size_t store_memory_used(const EventStore *pStore);
+
+// Same as midi_track_name(), from the names kept in the store
+bool store_track_name(const EventStore *pStore, int track, char *out, size_t outSize);
+
+// Plays the store through pStream instead of decoding the tracks, with a
+// single cursor whose pos is the next entry.
+void stream_init_store(EventStream *pStream, const MidiFile *pFile, const EventStore *pStore);
+
+// Decodes the entry at pCursor->pos into pCursor->event, for stream_pop()
+bool store_next(const EventStore *pStore, TrackCursor *pCursor);
@@ -0,0 +1,263 @@
+#include "live_input.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+// How often the reader thread checks for quit while nothing comes in
+#define LIVE_POLL_MS 50
+
+#define LIVE_SOCKET_PREFIX "unix:"
+
+// Data bytes of the channel messages by status high nibble, from 0x8 to 0xE
+static const uint8_t DATA_BYTES[7] = { 2, 2, 2, 2, 1, 1, 2 };
+
+static void push(LiveInput *pInput, const LiveEvent& event)
+{
+    uint32_t write = pInput->write_pos.load(std::memory_order_relaxed);
+    if (write - pInput->read_pos.load(std::memory_order_acquire) >= LIVE_QUEUE_SIZE)
+    {
+        pInput->dropped.store(pInput->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+    pInput->events[write & (LIVE_QUEUE_SIZE - 1)] = event;
+    pInput->write_pos.store(write + 1, std::memory_order_release);
+}
+
+// Same events as the file decoder, except the volume controller keeps its value
+static void emit(LiveInput *pInput, uint8_t status, LiveClock::time_point arrival)
+{
+    LiveEvent live;
+    live.arrival = arrival;
+    Event& e = live.event;
+    e.time = 0;
+    e.track = 0;
+    e.channel = status & 0xF;
+    e.note = pInput->data[0];
+    e.vel = (float)pInput->data[1] / 127.0f;
+    switch (status >> 4)
+    {
+        case 0x8: e.type = EVENT_NOTE_OFF; break;
+        case 0x9: e.type = EVENT_NOTE_ON; break;
+        case 0xB:
+            if (pInput->data[0] != 7) return;
+            e.type = EVENT_VOLUME;
+            break;
+        default: return;
+    }
+    push(pInput, live);
+}
+
+static void parse(LiveInput *pInput, const uint8_t *pBytes, size_t count, LiveClock::time_point arrival)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint8_t byte = pBytes[i];
+
+        // Real-time messages can come anywhere, even between data bytes
+        if (byte >= 0xF8) continue;
+
+        // System messages cancel running status, their data bytes are
+        // skipped until the next channel status
+        if (byte & 0x80)
+        {
+            pInput->running_status = byte < 0xF0 ? byte : 0;
+            pInput->data_count = 0;
+            continue;
+        }
+        uint8_t status = pInput->running_status;
+        if (!status) continue;
+
+        pInput->data[pInput->data_count++] = byte;
+        if (pInput->data_count < DATA_BYTES[(status >> 4) - 0x8]) continue;
+        if (pInput->data_count < 2) pInput->data[1] = 0;
+        pInput->data_count = 0;
+        emit(pInput, status, arrival);
+    }
+}
+
+#if defined(WIN32)
+
+static void read_loop(LiveInput *pInput)
+{
+    HANDLE hPipe = (HANDLE)pInput->handle;
+    uint8_t buffer[256];
+    bool connected = ConnectNamedPipe(hPipe, nullptr) || GetLastError() == ERROR_PIPE_CONNECTED;
+    while (connected && !pInput->quit)
+    {
+        DWORD size = 0;
+        if (!ReadFile(hPipe, buffer, sizeof(buffer), &size, nullptr)) break;
+        parse(pInput, buffer, size, LiveClock::now());
+    }
+    pInput->ended.store(true, std::memory_order_release);
+}
+
+static bool open_endpoint(LiveInput *pInput, const char *path)
+{
+    HANDLE hPipe = CreateNamedPipeA(path, PIPE_ACCESS_INBOUND, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1,
+                                    0, 4096, 0, nullptr);
+    if (hPipe == INVALID_HANDLE_VALUE) return false;
+    pInput->handle = (intptr_t)hPipe;
+    return true;
+}
+
+static void close_endpoint(LiveInput *pInput)
+{
+    // The reader may be blocked on the pipe, cancel until it noticed
+    while (pInput->thread.joinable() && !pInput->ended)
+    {
+        CancelSynchronousIo((HANDLE)pInput->thread.native_handle());
+        Sleep(1);
+    }
+    if (pInput->thread.joinable()) pInput->thread.join();
+    if (pInput->handle != -1) CloseHandle((HANDLE)pInput->handle);
+}
+
+#else
+
+static bool wait_readable(intptr_t fd)
+{
+    pollfd request = { (int)fd, POLLIN, 0 };
+    return poll(&request, 1, LIVE_POLL_MS) > 0;
+}
+
+static void read_loop(LiveInput *pInput)
+{
+    uint8_t buffer[256];
+    while (!pInput->quit)
+    {
+        // Unix socket, waiting for the writer to connect
+        if (pInput->handle < 0)
+        {
+            if (!wait_readable(pInput->listener)) continue;
+            pInput->handle = accept((int)pInput->listener, nullptr, nullptr);
+            continue;
+        }
+
+        if (!wait_readable(pInput->handle)) continue;
+        ssize_t size = read((int)pInput->handle, buffer, sizeof(buffer));
+        LiveClock::time_point arrival = LiveClock::now();
+        if (size < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+
+        // The writer went away
+        if (size <= 0) break;
+        parse(pInput, buffer, (size_t)size, arrival);
+    }
+    pInput->ended.store(true, std::memory_order_release);
+}
+
+static bool open_socket(LiveInput *pInput, const char *path)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) return false;
+    strcpy(address.sun_path, path);
+
+    // A socket left over by a previous run, anything else is left alone
+    struct stat info;
+    if (lstat(path, &info) == 0)
+    {
+        if (!S_ISSOCK(info.st_mode)) return false;
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    if (bind(fd, (const sockaddr*)&address, sizeof(address)) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    // Bound, close_endpoint() removes the socket file from now on
+    pInput->listener = fd;
+    return listen(fd, 1) == 0;
+}
+
+static bool open_endpoint(LiveInput *pInput, const char *path)
+{
+    size_t prefix = strlen(LIVE_SOCKET_PREFIX);
+    if (strncmp(path, LIVE_SOCKET_PREFIX, prefix) == 0) return open_socket(pInput, path + prefix);
+
+    // Non blocking so opening doesn't wait for a writer, poll() does
+    if (mkfifo(path, 0666) != 0 && errno != EEXIST) return false;
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) return false;
+    pInput->handle = fd;
+
+    struct stat info;
+    return fstat(fd, &info) == 0 && S_ISFIFO(info.st_mode);
+}
+
+static void close_endpoint(LiveInput *pInput)
+{
+    if (pInput->thread.joinable()) pInput->thread.join();
+    if (pInput->handle >= 0) close((int)pInput->handle);
+    if (pInput->listener >= 0)
+    {
+        close((int)pInput->listener);
+        unlink(pInput->path + strlen(LIVE_SOCKET_PREFIX));
+    }
+}
+
+#endif
+
+bool live_open(LiveInput *pInput, const char *path)
+{
+    pInput->read_pos = 0;
+    pInput->write_pos = 0;
+    pInput->dropped = 0;
+    pInput->ended = false;
+    pInput->quit = false;
+    pInput->running_status = 0;
+    pInput->data_count = 0;
+    pInput->path = path;
+    pInput->handle = -1;
+    pInput->listener = -1;
+
+    if (!open_endpoint(pInput, path))
+    {
+        fprintf(stderr, "Can't read live input from %s\n", path);
+        close_endpoint(pInput);
+        pInput->handle = -1;
+        pInput->listener = -1;
+        return false;
+    }
+    pInput->thread = std::thread(read_loop, pInput);
+    return true;
+}
+
+void live_close(LiveInput *pInput)
+{
+    pInput->quit = true;
+    close_endpoint(pInput);
+    pInput->handle = -1;
+    pInput->listener = -1;
+}
+
+bool live_pop(LiveInput *pInput, LiveEvent *pEvent)
+{
+    uint32_t read = pInput->read_pos.load(std::memory_order_relaxed);
+    if (read == pInput->write_pos.load(std::memory_order_acquire)) return false;
+    *pEvent = pInput->events[read & (LIVE_QUEUE_SIZE - 1)];
+    pInput->read_pos.store(read + 1, std::memory_order_release);
+    return true;
+}
+
+bool live_done(const LiveInput *pInput)
+{
+    return pInput->ended.load(std::memory_order_acquire) &&
+           pInput->read_pos.load(std::memory_order_relaxed) == pInput->write_pos.load(std::memory_order_acquire);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "midi_file.h"
+
+// Events the reader thread can get ahead of the render thread, a power of two
+#define LIVE_QUEUE_SIZE 1024
+
+typedef std::chrono::steady_clock LiveClock;
+
+struct LiveEvent
+{
+    LiveClock::time_point arrival;  // When the bytes were read
+    Event event;                    // time is unused
+};
+
+// Raw MIDI bytes from another process, read on their own thread. On Linux
+// and macOS path is a FIFO, created if missing, or a Unix socket listened on
+// when prefixed with "unix:". On Windows it's a named pipe, \\.\pipe\name.
+// The first writer to connect plays until it disconnects, then the input
+// ends.
+//
+// Only the channel messages playback knows about get through, running status
+// included. Real-time bytes, SysEx and system messages are skipped.
+struct LiveInput
+{
+    // Lock-free single producer, single consumer like RingBuffer, the reader
+    // thread pushes and the render thread pops
+    LiveEvent events[LIVE_QUEUE_SIZE];
+    alignas(64) std::atomic<uint32_t> read_pos;
+    alignas(64) std::atomic<uint32_t> write_pos;
+
+    std::atomic<uint32_t> dropped;  // Events lost to a full queue
+    std::atomic<bool> ended;        // The writer went away, nothing more will be pushed
+    std::atomic<bool> quit;
+    std::thread thread;
+
+    uint8_t running_status = 0;     // Parser state, reader thread only
+    uint8_t data[2];
+    int data_count = 0;
+
+    const char *path = nullptr;
+    intptr_t handle = -1;           // FIFO, socket or pipe being read
+    intptr_t listener = -1;         // Unix socket waiting for a writer
+};
+
+// Creates the endpoint and starts the reader thread, returns false if the
+// path can't be used
+bool live_open(LiveInput *pInput, const char *path);
+void live_close(LiveInput *pInput);
+
+// Render thread side, never blocks. Returns false when the queue is empty.
+bool live_pop(LiveInput *pInput, LiveEvent *pEvent);
+
+// The input ended and every event was popped
+bool live_done(const LiveInput *pInput);
@@ -1,758 +1,640 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <cassert>
-#include <algorithm>
-#include <cmath>
-#include <ctime>
-#include <vector>
-
-#define filename "assets/faxanadu.mid"
-
-#if defined(WIN32)
-#include <Audioclient.h>
-#include <Mmdeviceapi.h>
-
-const CLSID CLSID_MMDeviceEnumerator = __uuidof(MMDeviceEnumerator);
-const IID IID_IMMDeviceEnumerator = __uuidof(IMMDeviceEnumerator);
-const IID IID_IAudioClient = __uuidof(IAudioClient);
-const IID IID_IAudioRenderClient = __uuidof(IAudioRenderClient);
-
-UINT32 bufferFrameCount = 0;
-WAVEFORMATEX* pWaveFormat = nullptr;
-IMMDeviceEnumerator* pEnumerator = nullptr;
-IMMDevice* pDevice = nullptr;
-IAudioClient* pAudioClient = nullptr;
-HANDLE pEventHandler = nullptr;
-IAudioRenderClient* pRenderClient = nullptr;
-#else
-#error Unimplemented audio engine for that platform
-#endif
-
-bool init_audio();
-bool update_audio();
-void cleanup_audio();
-void progress(int frameCount, int sampleRate, int channelCount, float* pOut);
-bool open_midi();
-void update_midi(float dt);
-
-uint32_t sample_rate = 0;
-uint32_t total_ticks = 0;
-
-#define EVENT_NOTE_OFF 0
-#define EVENT_NOTE_ON 1
-#define EVENT_VOLUME 2
-#define EVENT_END_OF_TRACK 3
-
-static float volume = 1.0f;
-#define MAX_VOLUME 0.25f;
-
-struct Event
-{
-    uint32_t time;
-    int track;
-    int type;
-    int note;
-    float vel;
-};
-
-struct Instrument
-{
-    float freq = 0.0f;
-    float period = 0.0f;
-    float vol = 0.0f;
-    float sustain = 0.0f;
-    float shift = 0.5f;
-    int next_event = 0;
-    std::vector<Event> events;
-};
-Instrument instruments[4];
-
-uint8_t *pMidiData = nullptr;
-uint32_t playback_ticks = 0;
-
-// Note frequencies
-static const float NOTE_FREQS[] = {
-    16.35f, // C0
-    17.32f, // C#0
-    18.35f, // D0
-    19.45f, // D#0
-    20.60f, // E0
-    21.83f, // F0
-    23.12f, // F#0
-    24.50f, // G0
-    25.96f, // G#0
-    27.50f, // A0
-    29.14f, // A#0
-    30.87f, // B0
-    32.70f, // C1
-    34.65f,
-    36.71f,
-    38.89f,
-    41.20f,
-    43.65f,
-    46.25f,
-    49.00f,
-    51.91f,
-    55.00f,
-    58.27f,
-    61.74f,
-    65.41f, // C2
-    69.30f,
-    73.42f,
-    77.78f,
-    82.41f,
-    87.31f,
-    92.50f,
-    98.00f,
-    103.83f,
-    110.00f,
-    116.54f,
-    123.47f,
-    130.81f, // C3
-    138.59f,
-    146.83f,
-    155.56f,
-    164.81f,
-    174.61f,
-    185.00f,
-    196.00f,
-    207.65f,
-    220.00f,
-    233.08f,
-    246.94f,
-    261.63f, // C4
-    277.18f,
-    293.66f,
-    311.13f,
-    329.63f,
-    349.23f,
-    369.99f,
-    392.00f,
-    415.30f,
-    440.00f,
-    466.16f,
-    493.88f,
-    523.25f, // C5
-    554.37f,
-    587.33f,
-    622.25f,
-    659.25f,
-    698.46f,
-    739.99f,
-    783.99f,
-    830.61f,
-    880.00f,
-    932.33f,
-    987.77f,
-    1046.50f, // C6
-    1108.73f,
-    1174.66f,
-    1244.51f,
-    1318.51f,
-    1396.91f,
-    1479.98f,
-    1567.98f,
-    1661.22f,
-    1760.00f,
-    1864.66f,
-    1975.53f,
-    2093.00f, // C7
-    2217.46f,
-    2349.32f,
-    2489.02f,
-    2637.02f,
-    2793.83f,
-    2959.96f,
-    3135.96f,
-    3322.44f,
-    3520.00f,
-    3729.31f,
-    3951.07f,
-    4186.01f, // C8
-    4434.92f,
-    4698.63f,
-    4978.03f,
-    5274.04f,
-    5587.65f,
-    5919.91f,
-    6271.93f,
-    6644.88f,
-    7040.00f,
-    7458.62f,
-    7902.13f
-};
-static const int NOTE_C4 = 12 * 4;
-static const int NOTE_COUNT = sizeof(NOTE_FREQS) / sizeof(float);
-
-int main()
-{
-    srand((unsigned int)time(0));
-
-    if (!init_audio())
-    {
-        printf("Failed to init audio\n");
-        cleanup_audio();
-        system("pause");
-        return 1;
-    }
-
-    if (!open_midi())
-    {
-        printf("Failed to load midi file\n");
-        cleanup_audio();
-        system("pause");
-        return 2;
-    }
-
-    instruments[0].sustain = (float)(0.75 / (double)sample_rate);
-    instruments[1].sustain = instruments[0].sustain;
-    instruments[2].sustain = instruments[0].sustain;
-    instruments[3].sustain = (float)(8 / (double)sample_rate);
-
-    int printDelay = 0;
-    while (update_audio())
-    {
-        printDelay++;
-        if (printDelay > 10)
-        {
-            printDelay = 0;
-            printf("\r");
-            int percent = (playback_ticks * 70) / total_ticks;
-            for (int i = 0; i < percent; ++i)
-            {
-                printf("-");
-            }
-            printf("|");
-            for (int i = percent + 1; i < 70; ++i)
-            {
-                printf("-");
-            }
-        }
-    }
-    printf("\n");
-
-    cleanup_audio();
-    delete[] pMidiData;
-
-    system("pause");
-    return 0;
-}
-
-bool init_audio()
-{
-#if defined(WIN32)
-    HRESULT hr;
-
-    hr = CoInitialize(0);
-    assert(hr == S_OK);
-    if (hr != S_OK) return false;
-
-    hr = CoCreateInstance(CLSID_MMDeviceEnumerator, NULL, CLSCTX_ALL, IID_IMMDeviceEnumerator, (void**)&pEnumerator);
-    assert(hr == S_OK);
-    if (hr != S_OK) return false;
-
-    hr = pEnumerator->GetDefaultAudioEndpoint(eRender, eConsole, &pDevice);
-    assert(hr == S_OK);
-    if (hr != S_OK) return false;
-
-    hr = pDevice->Activate(IID_IAudioClient, CLSCTX_ALL, NULL, (void**)&pAudioClient);
-    assert(hr == S_OK);
-    if (hr != S_OK) return false;
-
-    hr = pAudioClient->GetMixFormat(&pWaveFormat);
-    assert(hr == S_OK);
-    if (hr != S_OK) return false;
-
-    hr = pAudioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, AUDCLNT_STREAMFLAGS_EVENTCALLBACK, 50000, 0, pWaveFormat, NULL);
-    assert(hr == S_OK);
-    if (hr != S_OK) return false;
-
-    pEventHandler = CreateEvent(nullptr, false, false, nullptr);
-    assert(pEventHandler);
-    if (pEventHandler == nullptr) return false;
-
-    hr = pAudioClient->SetEventHandle(pEventHandler);
-    assert(hr == S_OK);
-    if (hr != S_OK) return false;
-
-    hr = pAudioClient->GetBufferSize(&bufferFrameCount);
-    assert(hr == S_OK);
-    if (hr != S_OK) return false;
-
-    hr = pAudioClient->GetService(IID_IAudioRenderClient, (void**)&pRenderClient);
-    assert(hr == S_OK);
-    if (hr != S_OK) return false;
-
-    hr = pAudioClient->Start();  // Start playing.
-    assert(hr == S_OK);
-    if (hr != S_OK) return false;
-
-    sample_rate = (uint32_t)pWaveFormat->nSamplesPerSec;
-#else
-#endif
-
-    return true;
-}
-
-void cleanup_audio()
-{
-#if defined(WIN32)
-    CoTaskMemFree(pWaveFormat);
-    if (pEnumerator) pEnumerator->Release();
-    if (pDevice) pDevice->Release();
-    if (pAudioClient) pAudioClient->Release();
-    if (pRenderClient) pRenderClient->Release();
-#else
-#endif
-}
-
-bool update_audio()
-{
-#if defined(WIN32)
-    HRESULT hr;
-    UINT32 numFramesAvailable;
-    UINT32 numFramesPadding;
-    BYTE *pData;
-    DWORD retval;
-
-    retval = WaitForSingleObject(pEventHandler, 2000);
-    if (retval != WAIT_OBJECT_0)
-    {
-        // Event handle timed out after a 2-second wait.
-        pAudioClient->Stop();
-        return false;
-    }
-
-    // See how much buffer space is available.
-    hr = pAudioClient->GetCurrentPadding(&numFramesPadding);
-    assert(hr == S_OK);
-    if (hr != S_OK)
-    {
-        return false;
-    }
-
-    numFramesAvailable = bufferFrameCount - numFramesPadding;
-    if (numFramesAvailable > 0)
-    {
-        // Grab all the available space in the shared buffer.
-        hr = pRenderClient->GetBuffer(numFramesAvailable, &pData);
-        assert(hr == S_OK);
-        if (hr != S_OK)
-        {
-            return false;
-        }
-
-        progress(numFramesAvailable, pWaveFormat->nSamplesPerSec, pWaveFormat->nChannels, (float*)pData);
-
-        hr = pRenderClient->ReleaseBuffer(numFramesAvailable, 0);
-        assert(hr == S_OK);
-        if (hr != S_OK)
-        {
-            return false;
-        }
-    }
-#else
-#endif
-
-    // Are we done?
-    bool done = true;
-    for (int i = 0; i < 4; ++i)
-    {
-        if (instruments[i].next_event < (int)instruments[i].events.size())
-        {
-            done = false;
-            break;
-        }
-    }
-
-    return !done;
-}
-
-struct MidiChunk
-{
-    char type[4];
-    uint32_t len;
-    uint8_t *pData;
-};
-
-void readType(char *out, uint32_t *pos, uint8_t *pData)
-{
-    memcpy(out, pData + *pos, 4);
-    *pos += 4;
-}
-
-uint8_t readByte(uint32_t *pos, uint8_t *pData)
-{
-    uint8_t out = pData[*pos];
-    *pos += 1;
-    return out;
-}
-
-uint16_t readUint16(uint32_t *pos, uint8_t *pData)
-{
-    uint16_t out;
-    out =
-        (((pData[*pos + 0]) << 8) & 0xFF00) |
-         ((pData[*pos + 1])       & 0x00FF);
-    *pos += 2;
-    return out;
-}
-
-
-uint32_t readUint24(uint32_t *pos, uint8_t *pData)
-{
-    uint32_t out;
-    out =
-        (((pData[*pos + 0]) << 16) & 0x00FF0000) |
-        (((pData[*pos + 1]) << 8)  & 0x0000FF00) |
-         ((pData[*pos + 2])        & 0x000000FF);
-    *pos += 3;
-    return out;
-}
-
-uint32_t readUint32(uint32_t *pos, uint8_t *pData)
-{
-    uint32_t out;
-    out =
-        (((pData[*pos + 0]) << 24) & 0xFF000000) |
-        (((pData[*pos + 1]) << 16) & 0x00FF0000) |
-        (((pData[*pos + 2]) << 8)  & 0x0000FF00) |
-         ((pData[*pos + 3])        & 0x000000FF);
-    *pos += 4;
-    return out;
-}
-
-uint32_t readVariableInt(uint32_t *pos, uint8_t *pData)
-{
-    uint32_t out = 0;
-
-    uint32_t next = pData[*pos];
-    *pos += 1;
-    if (next & 0x80)
-    {
-        out = ((out << 7) & 0xFFFFFF80) | (next & 0x7F);
-    }
-    else
-    {
-        return next;
-    }
-
-    while (next & 0x80)
-    {
-        next = pData[*pos];
-        out = ((out << 7) & 0xFFFFFF80) | (next & 0x7F);
-        *pos += 1;
-    }
-
-    return out;
-}
-
-uint8_t *readData(uint32_t *pos, uint8_t *pData, uint32_t len)
-{
-    uint8_t *out = pData + *pos;
-    *pos += len;
-    return out;
-}
-
-bool open_midi()
-{
-    FILE *file = fopen(filename, "rb");
-    fseek(file, 0, SEEK_END);
-    auto size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    pMidiData = new uint8_t[size];
-    fread(pMidiData, 1, size, file);
-    fclose(file);
-
-    uint32_t pos = 0;
-    MidiChunk chunk;
-    uint32_t quarterNoteTime;
-    int currentTrack = 0;
-    uint32_t tempo = 120;
-    while (pos < (uint32_t)size)
-    {
-        // Read next chunk
-        readType(chunk.type, &pos, pMidiData);
-        chunk.len = readUint32(&pos, pMidiData);
-        chunk.pData = readData(&pos, pMidiData, chunk.len);
-
-        if (strncmp(chunk.type, "MThd", 4) == 0)
-        {
-            uint32_t i = 0;
-            uint16_t format = readUint16(&i, chunk.pData);
-            if (format != 0 && format != 1 && format != 2)
-            {
-                assert(false);
-                return false;
-            }
-            uint16_t tracks = (int)readUint16(&i, chunk.pData);
-            if (tracks == 0)
-            {
-                assert(false);
-                return false;
-            }
-            uint16_t division = (int)readUint16(&i, chunk.pData);
-            if (division & 0x8000)
-            {
-                assert(false);
-            }
-            else
-            {
-                quarterNoteTime = (uint32_t)division;
-            }
-        }
-        else if (strncmp(chunk.type, "MTrk", 4) == 0)
-        {
-            if (currentTrack == 4)
-            {
-                break; // Stop here, we emulate only 4 tracks for our NES toy
-            }
-
-            Instrument *pInst = instruments + currentTrack;
-
-            uint32_t t = 0;
-            uint32_t i = 0;
-
-            while (i < chunk.len)
-            {
-                Event e;
-                e.track = currentTrack;
-
-                uint32_t delta_time = readVariableInt(&i, chunk.pData);
-                t += delta_time;
-
-                double tick_per_second = (double)tempo * (double)quarterNoteTime / 60.0;
-                double samples_per_tick = (double)sample_rate / tick_per_second;
-                e.time = (uint32_t)((double)t * samples_per_tick);
-
-                uint8_t status_byte = readByte(&i, chunk.pData);
-                uint8_t channel = status_byte & 0xF; // Probably don't care
-
-                switch ((status_byte >> 4) & 0xF)
-                {
-                    case 0x8: // Note Off event
-                    {
-                        e.note = (int)readByte(&i, chunk.pData) & 0x7F;
-                        e.vel = (float)((int)readByte(&i, chunk.pData) & 0x7F) / 127.0f;
-                        e.type = EVENT_NOTE_OFF;
-                        pInst->events.push_back(e);
-                        break;
-                    }
-                    case 0x9: // Note On event
-                    {
-                        e.note = (int)readByte(&i, chunk.pData) & 0x7F;
-                        e.vel = (float)((int)readByte(&i, chunk.pData) & 0x7F) / 127.0f;
-                        e.type = EVENT_NOTE_ON;
-                        pInst->events.push_back(e);
-                        break;
-                    }
-                    case 0xA: // Polyphonic Key Pressure (Aftertouch)
-                    {
-                        readByte(&i, chunk.pData);
-                        readByte(&i, chunk.pData);
-                        break;
-                    }
-                    case 0xB: // Control Change
-                    {
-                        auto controller = readByte(&i, chunk.pData) & 0x7F;
-                        auto val = (float)((int)readByte(&i, chunk.pData) & 0x7F) / 127.0f;
-                        if (controller == 7)
-                        {
-                            e.vel = volume;
-                            e.type = EVENT_VOLUME;
-                            pInst->events.push_back(e);
-                        }
-                        break;
-                    }
-                    case 0xC: // Program Change
-                    {
-                        readByte(&i, chunk.pData);
-                        break;
-                    }
-                    case 0xD: // Channel Pressure (After-touch)
-                    {
-                        readByte(&i, chunk.pData);
-                        break;
-                    }
-                    case 0xE: // Pitch Wheel Change
-                    {
-                        readByte(&i, chunk.pData);
-                        readByte(&i, chunk.pData);
-                        break;
-                    }
-                    case 0xF: // System Common Messages
-                    {
-                        switch (status_byte)
-                        {
-                            case 0xFF: // Meta Events
-                            {
-                                uint8_t type = readByte(&i, chunk.pData);
-                                uint32_t meta_len = readVariableInt(&i, chunk.pData);
-                                auto pMetaData = readData(&i, chunk.pData, meta_len);
-                                switch (type)
-                                {
-                                    case 0x51: // Set Tempo
-                                    {
-                                        uint32_t j = 0;
-                                        uint32_t new_tempo = readUint24(&j, pMetaData);
-                                        double beat_per_second = 1.0 / ((double)new_tempo / 1000000.0);
-                                        tempo = (uint32_t)(beat_per_second * 60);
-                                        break;
-                                    }
-                                    case 0x2F: // End of track
-                                    {
-                                        e.type = EVENT_END_OF_TRACK;
-                                        pInst->events.push_back(e);
-                                        total_ticks = std::max<uint32_t>(total_ticks, e.time);
-                                        break;
-                                    }
-                                    case 0x03:
-                                    {
-                                        char name[250] = { '\0' };
-                                        memcpy(name, pMetaData, meta_len);
-                                        printf("Track %i name: %s\n", currentTrack, name);
-                                        break;
-                                    }
-                                    default:
-                                    {
-                                        break;
-                                    }
-                                }
-                                break;
-                            }
-                            default:
-                            {
-                                assert(false);
-                                return false;
-                            }
-                        }
-                        break;
-                    }
-                    default:
-                    {
-                        assert(false);
-                        return false;
-                    }
-                }
-            }
-
-            ++currentTrack;
-        }
-    }
-
-    printf("Midi file loaded\n");
-    return true;
-}
-
-void update_midi(float dt)
-{
-    ++playback_ticks;
-
-    for (int i = 0; i < 4; ++i)
-    {
-        auto pInst = instruments + i;
-        pInst->vol = std::max<float>(0.0f, pInst->vol - pInst->sustain);
-
-        if (pInst->next_event < (int)pInst->events.size())
-        {
-            auto& e = pInst->events[pInst->next_event];
-            if (e.time <= playback_ticks)
-            {
-                ++pInst->next_event;
-                switch (e.type)
-                {
-                    case EVENT_NOTE_OFF:
-                    {
-                        int note_id = e.note - 60 + NOTE_C4;
-                        if (note_id >= 0 && note_id < NOTE_COUNT)
-                        {
-                            pInst->freq = NOTE_FREQS[note_id];
-                            pInst->vol = 0.0f;
-                        }
-                        break;
-                    }
-                    case EVENT_NOTE_ON:
-                    {
-                        int note_id = e.note - 60 + NOTE_C4;
-                        if (note_id >= 0 && note_id < NOTE_COUNT)
-                        {
-                            pInst->freq = NOTE_FREQS[note_id];
-                            pInst->vol = e.vel;
-                            if (i == 3)
-                            {
-                                // Drum, adjust shift
-                                //pInst->sustain = 0.05f / pInst->freq;
-                            }
-                        }
-                        break;
-                    }
-                    case EVENT_VOLUME:
-                    {
-                        volume = e.vel;
-                        break;
-                    }
-                }
-            }
-        }
-    }
-}
-
-void update_instrument(int index, float dt)
-{
-    instruments[index].period = std::fmodf(instruments[index].period + instruments[index].freq * dt, 1.0f);
-}
-
-float amp_to_4bits(float amplitude)
-{
-    return (float)(int)((amplitude + 1.0f) * 8.0f) / 8.0f - 1.0f;
-}
-
-float progress_pulse1(float dt)
-{
-    update_instrument(0, dt);
-    return amp_to_4bits((instruments[0].period < instruments[0].shift ? 1.0f : -1.0f) * instruments[0].vol);
-}
-
-float progress_pulse2(float dt)
-{
-    update_instrument(1, dt);
-    return amp_to_4bits((instruments[1].period < instruments[1].shift ? 1.0f : -1.0f) * instruments[1].vol);
-}
-
-float progress_triangle(float dt)
-{
-    update_instrument(2, dt);
-    return amp_to_4bits((instruments[2].period < instruments[2].shift ? (instruments[2].period * 4.0f - 1.0f) : (1.0f - (instruments[2].period * 4.0f - 2.0f))) * instruments[2].vol);
-}
-
-float progress_noise(float dt)
-{
-    update_instrument(3, dt);
-    return amp_to_4bits((float)rand() / (float)RAND_MAX * instruments[3].vol);
-}
-
-void progress(int frameCount, int sampleRate, int channelCount, float* pOut)
-{
-    memset(pOut, 0, sizeof(float) * frameCount * channelCount);
-
-    float dt = 1.0f / (float)sampleRate;
-
-    for (int i = 0; i < frameCount; ++i)
-    {
-        update_midi(dt);
-
-        float sample =
-            progress_pulse1(dt) +
-            progress_pulse2(dt) +
-            progress_triangle(dt) +
-            progress_noise(dt);
-
-        sample = std::min<float>(1.0f, sample);
-        sample = std::max<float>(-1.0f, sample) * volume * MAX_VOLUME;
-
-        for (int c = 0; c < channelCount; ++c)
-        {
-            pOut[i * channelCount + c] = sample;
-        }
-    }
-}
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "audio_backend.h"
+#include "batch.h"
+#include "live_input.h"
+#include "oscillators.h"
+#include "output_stage.h"
+#include "pcm_writer.h"
+#include "player.h"
+#include "render_thread.h"
+#include "resampler.h"
+#include "wavetables.h"
+
+#define filename "assets/faxanadu.mid"
+
+struct RenderOptions
+{
+    const char *midi_path = nullptr; // filename unless playing live input only
+    const char *out_path = nullptr; // Offline render when set, "-" for stdout
+    const char *batch_path = nullptr; // Directory or manifest to render in batch
+    const char *out_dir = ".";      // Batch outputs
+    int container = PCM_CONTAINER_WAV;
+    int sample_type = SAMPLE_S16;    // Files, devices take floats unless -s is given
+    bool dither = false;
+    int channel_count = 2;
+    uint32_t sample_rate = 44100;   // Output, synthesis always runs at PLAYER_SAMPLE_RATE
+    int resample_quality = RESAMPLE_MEDIUM;
+    int isa = -1;                   // OSC_ISA_*, -1 picks the best one
+    double start_time = 0.0;        // Seconds
+    size_t wavetable_budget = WT_DEFAULT_BUDGET;
+    int thread_count = 0;           // Offline render threads, 0 uses every core
+    double segment_length = 60.0;   // Batch songs longer than that are split
+    const char *stem_prefix = nullptr; // Also write one file per channel when set
+    double lookahead_ms = RENDER_LOOKAHEAD_MS; // Realtime, rendered ahead of the device
+    const char *audio_backend = nullptr; // Realtime, nullptr for the native one
+    const char *live_path = nullptr; // Realtime, FIFO or socket to read live MIDI from
+    AudioConfig audio;
+    int report_format = PERF_FORMAT_BAR; // Realtime console output
+    PlayerConfig player;
+};
+
+int render_offline(const RenderOptions& options);
+int render_batch(const RenderOptions& options);
+
+Player player;
+WavetableCache wavetables;
+RenderThread render_thread;
+LiveInput live_input;
+
+static void print_usage()
+{
+    fprintf(stderr,
+        "usage: midi_experiment [options] [file.mid]\n"
+        "  -o <path>   Render offline as fast as possible to path (- for stdout)\n"
+        "  -f <fmt>    Offline container: wav (default), raw\n"
+        "  -s <type>   Sample type: s16, s24 or f32. Files default to s16, audio devices\n"
+        "              to f32 and may pick another one\n"
+        "  -d          TPDF dither for the s16 and s24 sample types\n"
+        "  -r <rate>   Output sample rate (default 44100), audio devices may pick another\n"
+        "              one. Synthesis always runs at %i then gets resampled.\n"
+        "  -q <tier>   Resampling quality: fast, medium (default) or high\n"
+        "  -c <count>  Channel count up to %i (default 2), audio devices may pick another one\n"
+        "  -i <isa>    Oscillator kernels: scalar, sse2, avx2 (default best supported)\n"
+        "  -b          Band-limited pulse and triangle voices\n"
+        "  -A          Cycle-accurate 2A03 timers with band-limited steps instead of the\n"
+        "              oscillator kernels, 4-bit volumes included\n"
+        "  -m <KB>     Band-limited wavetable memory budget (default %i)\n"
+        "  -t <speed>  Playback speed multiplier (default 1)\n"
+        "  -p <sec>    Start playing at that position\n"
+        "  -v <count>  Voice pool size, up to %i (default %i)\n"
+        "  -x <count>  Play the loop that many more times, inf to loop forever (realtime\n"
+        "              only). The loop goes between the loopStart and loopEnd markers,\n"
+        "              by default from the start to the end of the song.\n"
+        "  -X <ticks>  Loop points as start:end in ticks, instead of the markers\n"
+        "  -E          Decode the whole file up front into a packed event store, instead\n"
+        "              of while playing\n"
+        "  -C <dir>    Like -E, and keep the event store in a cache file in dir so later\n"
+        "              runs on the same file map it instead of decoding\n"
+        "  -R <route>  Route a MIDI channel to a voice type, as channel=type[:priority]\n"
+        "              with channel 1-16 and type pulse, pulse12, pulse25, pulse75,\n"
+        "              triangle or noise. Lower priority voices are stolen first.\n"
+        "              Default: 2=triangle:2, 3=noise:0, 10=noise:0, others pulse:1\n"
+        "  -j <count>  Offline render threads (default one per core)\n"
+        "  -S <prefix> Offline, also write each channel to <prefix>_ch<channel>.<fmt>\n"
+        "  -B <path>   Batch render every .mid of a directory, or the files listed in a\n"
+        "              manifest (one path per line), with the offline options\n"
+        "  -O <dir>    Batch output directory (default .)\n"
+        "  -L <sec>    Batch songs longer than that are split in segments (default 60)\n"
+        "  -l <ms>     Realtime, audio rendered ahead of the device (default %i)\n"
+        "  -a <name>   Realtime audio backend: wasapi, alsa or null, a simulated device\n"
+        "              measuring scheduling (default the native one, when compiled in)\n"
+        "  -P <frames> Realtime device period (default depends on the backend)\n"
+        "  -N <count>  Realtime device periods queued (default depends on the backend)\n"
+        "  -M <fmt>    Realtime report: bar (default, progress only), text or json, one\n"
+        "              line per second with the render load, underruns, events and voices\n"
+        "  -I <path>   Realtime, also play raw MIDI written to path: a FIFO (created if\n"
+        "              missing), unix:<path> for a Unix socket, or \\\\.\\pipe\\<name> on\n"
+        "              Windows. Without a file only the live events play. Ends once the\n"
+        "              writer disconnects.\n",
+        PLAYER_SAMPLE_RATE, OUTPUT_MAX_CHANNELS, WT_DEFAULT_BUDGET / 1024, VOICE_MAX, VOICE_MAX, RENDER_LOOKAHEAD_MS);
+}
+
+// The whole of val as a base 10 integer between minVal and maxVal
+static bool parse_int(const char *val, long minVal, long maxVal, long *pOut)
+{
+    char *pEnd = nullptr;
+    errno = 0;
+    long result = strtol(val, &pEnd, 10);
+    if (pEnd == val || *pEnd != '\0' || errno == ERANGE) return false;
+    if (result < minVal || result > maxVal) return false;
+    *pOut = result;
+    return true;
+}
+
+// The whole of val as a finite number, at least minVal
+static bool parse_double(const char *val, double minVal, double *pOut)
+{
+    char *pEnd = nullptr;
+    errno = 0;
+    double result = strtod(val, &pEnd);
+    if (pEnd == val || *pEnd != '\0' || errno == ERANGE || !std::isfinite(result)) return false;
+    if (result < minVal) return false;
+    *pOut = result;
+    return true;
+}
+
+static bool parse_route(const char *val, VoiceRoute *pRoutes)
+{
+    char type[16];
+    int channel = 0;
+    int len = 0;
+    if (sscanf(val, "%d=%15[a-z0-9]%n", &channel, type, &len) != 2) return false;
+    if (channel < 1 || channel > VOICE_CHANNELS) return false;
+
+    VoiceRoute route = pRoutes[channel - 1];
+    route.duty = 0x80000000;
+    if (strcmp(type, "pulse") == 0 || strcmp(type, "pulse50") == 0) route.type = VOICE_PULSE;
+    else if (strcmp(type, "pulse12") == 0) { route.type = VOICE_PULSE; route.duty = 0x20000000; }
+    else if (strcmp(type, "pulse25") == 0) { route.type = VOICE_PULSE; route.duty = 0x40000000; }
+    else if (strcmp(type, "pulse75") == 0) { route.type = VOICE_PULSE; route.duty = 0xC0000000; }
+    else if (strcmp(type, "triangle") == 0) route.type = VOICE_TRIANGLE;
+    else if (strcmp(type, "noise") == 0) route.type = VOICE_NOISE;
+    else return false;
+
+    if (val[len] == ':')
+    {
+        long priority = 0;
+        if (!parse_int(val + len + 1, INT_MIN, INT_MAX, &priority)) return false;
+        route.priority = (int)priority;
+    }
+    else if (val[len] != '\0') return false;
+
+    pRoutes[channel - 1] = route;
+    return true;
+}
+
+static bool parse_args(int argc, char **argv, RenderOptions *pOptions)
+{
+    std::copy(DEFAULT_ROUTES, DEFAULT_ROUTES + VOICE_CHANNELS, pOptions->player.routes);
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (arg[0] != '-' || strcmp(arg, "-") == 0)
+        {
+            pOptions->midi_path = arg;
+            continue;
+        }
+        if (strcmp(arg, "-b") == 0)
+        {
+            pOptions->player.pWavetables = &wavetables;
+            continue;
+        }
+        if (strcmp(arg, "-A") == 0)
+        {
+            pOptions->player.apu = true;
+            continue;
+        }
+        if (strcmp(arg, "-E") == 0)
+        {
+            pOptions->player.preload = true;
+            continue;
+        }
+        if (strcmp(arg, "-d") == 0)
+        {
+            pOptions->dither = true;
+            pOptions->audio.dither = true;
+            continue;
+        }
+        if (!val || arg[2] != '\0') return false;
+        ++i;
+        long num = 0;
+        double real = 0.0;
+        switch (arg[1])
+        {
+            case 'o': pOptions->out_path = val; break;
+            case 'f':
+                if (strcmp(val, "wav") == 0) pOptions->container = PCM_CONTAINER_WAV;
+                else if (strcmp(val, "raw") == 0) pOptions->container = PCM_CONTAINER_RAW;
+                else return false;
+                break;
+            case 's':
+                pOptions->sample_type = output_parse_sample_type(val);
+                if (pOptions->sample_type < 0) return false;
+                pOptions->audio.sample_type = pOptions->sample_type;
+                break;
+            case 'r':
+                if (!parse_int(val, 1, INT_MAX, &num)) return false;
+                pOptions->sample_rate = (uint32_t)num;
+                break;
+            case 'q':
+                pOptions->resample_quality = resample_parse_quality(val);
+                if (pOptions->resample_quality < 0) return false;
+                break;
+            case 'c':
+                if (!parse_int(val, 1, OUTPUT_MAX_CHANNELS, &num)) return false;
+                pOptions->channel_count = (int)num;
+                break;
+            case 'i':
+                if (strcmp(val, "scalar") == 0) pOptions->isa = OSC_ISA_SCALAR;
+                else if (strcmp(val, "sse2") == 0) pOptions->isa = OSC_ISA_SSE2;
+                else if (strcmp(val, "avx2") == 0) pOptions->isa = OSC_ISA_AVX2;
+                else return false;
+                break;
+            case 'm':
+                if (!parse_int(val, 0, INT_MAX / 1024, &num)) return false;
+                pOptions->wavetable_budget = (size_t)num * 1024;
+                break;
+            case 't':
+                if (!parse_double(val, 0.0, &real) || real == 0.0) return false;
+                pOptions->player.speed = real;
+                break;
+            case 'p':
+                if (!parse_double(val, 0.0, &pOptions->start_time)) return false;
+                break;
+            case 'x':
+                if (strcmp(val, "inf") == 0) num = PLAYER_LOOP_FOREVER;
+                else if (!parse_int(val, 0, INT_MAX, &num)) return false;
+                pOptions->player.loop_count = (int)num;
+                break;
+            case 'X':
+                if (sscanf(val, "%u:%u", &pOptions->player.loop_start, &pOptions->player.loop_end) != 2 ||
+                    pOptions->player.loop_end <= pOptions->player.loop_start)
+                {
+                    return false;
+                }
+                break;
+            case 'v':
+                if (!parse_int(val, 1, VOICE_MAX, &num)) return false;
+                pOptions->player.voice_count = (int)num;
+                break;
+            case 'R':
+                if (!parse_route(val, pOptions->player.routes)) return false;
+                break;
+            case 'j':
+                if (!parse_int(val, 0, INT_MAX, &num)) return false;
+                pOptions->thread_count = (int)num;
+                break;
+            case 'C':
+                pOptions->player.cache_dir = val;
+                pOptions->player.preload = true;
+                break;
+            case 'S': pOptions->stem_prefix = val; break;
+            case 'B': pOptions->batch_path = val; break;
+            case 'O': pOptions->out_dir = val; break;
+            case 'L':
+                if (!parse_double(val, 0.0, &real) || real == 0.0) return false;
+                pOptions->segment_length = real;
+                break;
+            case 'a': pOptions->audio_backend = val; break;
+            case 'I': pOptions->live_path = val; break;
+            case 'P':
+                if (!parse_int(val, 1, INT_MAX, &num)) return false;
+                pOptions->audio.period_frames = (uint32_t)num;
+                break;
+            case 'N':
+                if (!parse_int(val, 1, INT_MAX, &num)) return false;
+                pOptions->audio.buffer_count = (int)num;
+                break;
+            case 'M':
+                if (strcmp(val, "bar") == 0) pOptions->report_format = PERF_FORMAT_BAR;
+                else if (strcmp(val, "text") == 0) pOptions->report_format = PERF_FORMAT_TEXT;
+                else if (strcmp(val, "json") == 0) pOptions->report_format = PERF_FORMAT_JSON;
+                else return false;
+                break;
+            case 'l':
+                if (!parse_double(val, 0.0, &real) || real == 0.0) return false;
+                pOptions->lookahead_ms = real;
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+// Decoding runs on the render thread, so it's only told once playback is done
+static void print_track_error()
+{
+    TrackError error = player_track_error(&player);
+    if (error.reason)
+    {
+        fprintf(stderr, "Track %i: %s at byte %u, skipped the rest\n", error.track, error.reason, error.pos);
+    }
+}
+
+static bool open_song(const RenderOptions& options)
+{
+    auto start = std::chrono::steady_clock::now();
+    if (!player_open(&player, options.midi_path, options.player)) return false;
+    double open_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (int i = 0; i < (int)player.midi_file.tracks.size(); ++i)
+    {
+        char name[250];
+        bool named = options.player.preload ? store_track_name(&player.event_store, i, name, sizeof(name))
+                                            : midi_track_name(&player.midi_file, i, name, sizeof(name));
+        if (named)
+        {
+            fprintf(stderr, "Track %i name: %s\n", i, name);
+        }
+    }
+    fprintf(stderr, "Midi file loaded\n");
+
+    if (options.player.preload)
+    {
+        const EventStore& store = player.event_store;
+        double events = (double)std::max<uint64_t>(store.event_count, 1);
+        fprintf(stderr, "Event store: %llu events in %.1f KB, %.2f bytes/event (%i as Event records), %s in %.1fms\n",
+                (unsigned long long)store.event_count, store_memory_used(&store) / 1024.0,
+                store_memory_used(&store) / events, (int)sizeof(Event), store.cached ? "loaded from cache" : "built",
+                open_time * 1000.0);
+        if (store.cache_failed)
+        {
+            fprintf(stderr, "Couldn't write the event cache in %s\n", options.player.cache_dir);
+        }
+    }
+
+    if (options.start_time > 0.0)
+    {
+        start = std::chrono::steady_clock::now();
+        player_seek(&player, (uint32_t)std::min<double>(options.start_time * (double)options.player.sample_rate,
+                                                        4294967295.0));
+        double seek_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        fprintf(stderr, "Seeked to %.2fs in %.3fms\n", options.start_time, seek_time * 1000.0);
+    }
+    return true;
+}
+
+static void pull_audio(void *pContext, float *pOut, uint32_t frameCount)
+{
+    render_thread_read((RenderThread*)pContext, pOut, frameCount);
+}
+
+static int play_realtime(RenderOptions& options)
+{
+    AudioDevice device;
+    options.audio.sample_rate = options.sample_rate;
+    options.audio.channel_count = options.channel_count;
+    if (!audio_open(&device, options.audio_backend, options.audio, pull_audio, &render_thread))
+    {
+        const AudioBackend *backends[8];
+        int count = audio_backends(backends, 8);
+        fprintf(stderr, "Failed to init audio, available backends:");
+        for (int i = 0; i < count; ++i)
+        {
+            fprintf(stderr, " %s", backends[i]->name);
+        }
+        fprintf(stderr, "\nUse -o to render offline\n");
+        return 1;
+    }
+    uint32_t sample_rate = device.config.sample_rate;
+    if (options.live_path && !live_open(&live_input, options.live_path))
+    {
+        audio_close(&device);
+        return 1;
+    }
+
+    if (options.player.pWavetables)
+    {
+        wt_init(options.player.pWavetables, options.player.sample_rate, options.wavetable_budget, NOTE_FREQS,
+                NOTE_COUNT);
+    }
+    if (!open_song(options))
+    {
+        fprintf(stderr, "Failed to load midi file\n");
+        if (options.live_path) live_close(&live_input);
+        audio_close(&device);
+        return 2;
+    }
+
+    // The render thread owns the player from here on. Live events play late
+    // enough for the lookahead, the device period and the render thread
+    // waking up only a few times per lookahead.
+    uint32_t lookahead = (uint32_t)std::max(1.0, options.lookahead_ms * sample_rate / 1000.0);
+    if (options.live_path)
+    {
+        render_thread.pLive = &live_input;
+        render_thread.live_delay = lookahead + lookahead / 2 + device.config.period_frames;
+        fprintf(stderr, "Live input on %s, events play %.1fms after they arrive\n", options.live_path,
+                render_thread.live_delay * 1000.0 / sample_rate);
+    }
+    render_thread_start(&render_thread, &player, device.config.channel_count, sample_rate, options.resample_quality,
+                        lookahead);
+
+    // Console output stays on the reporter thread
+    PerfReporter reporter;
+    perf_report_start(&reporter, &render_thread.counters, sample_rate, options.report_format,
+                      options.report_format == PERF_FORMAT_BAR ? 0.1 : 1.0);
+
+    bool ok = audio_start(&device);
+    while (ok && !render_thread_done(&render_thread))
+    {
+        ok = audio_update(&device);
+    }
+
+    perf_report_stop(&reporter);
+    render_thread_stop(&render_thread);
+    audio_print_stats(&device);
+    print_track_error();
+    const PerfCounters& counters = render_thread.counters;
+    fprintf(stderr, "Lookahead %.1fms: %u underruns (%.1fms of silence), %u refills, lowest fill %.1fms\n",
+            lookahead * 1000.0 / sample_rate, (unsigned)counters.underruns,
+            counters.underrun_frames * 1000.0 / sample_rate, (unsigned)counters.refills,
+            std::min<uint32_t>(counters.min_fill, lookahead) * 1000.0 / sample_rate);
+    if (options.live_path)
+    {
+        live_close(&live_input);
+        uint64_t events = counters.live_events;
+        fprintf(stderr, "Live input: %llu events, latency to the device %.2fms avg, %.2fms max, %u late, %u dropped\n",
+                (unsigned long long)events, counters.live_latency_total * 1000.0 / (double)std::max<uint64_t>(events, 1),
+                counters.live_latency_max * 1000.0, (unsigned)counters.live_late, (unsigned)live_input.dropped);
+    }
+
+    audio_close(&device);
+    player_close(&player);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    RenderOptions options;
+    if (!parse_args(argc, argv, &options))
+    {
+        print_usage();
+        return 1;
+    }
+
+    if (!options.midi_path && (!options.live_path || options.out_path))
+    {
+        options.midi_path = filename;
+    }
+    if ((options.out_path || options.batch_path) && options.player.loop_count == PLAYER_LOOP_FOREVER)
+    {
+        fprintf(stderr, "Looping forever only works in realtime\n");
+        return 1;
+    }
+
+    int isa = osc_pick_isa(options.isa);
+    if (options.isa >= 0 && isa != options.isa)
+    {
+        fprintf(stderr, "%s kernels are not supported, using %s\n", osc_isa_name(options.isa), osc_isa_name(isa));
+    }
+    options.player.isa = isa;
+    options.audio.isa = isa;
+
+    if (options.batch_path)
+    {
+        return render_batch(options);
+    }
+
+    if (options.out_path)
+    {
+        return render_offline(options);
+    }
+
+    return play_realtime(options);
+}
+
+static bool open_stem(PcmWriter *pWriter, const RenderOptions& options, int channel, uint64_t silentFrames)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s_ch%i.%s", options.stem_prefix, channel + 1,
+             options.container == PCM_CONTAINER_WAV ? "wav" : "raw");
+    if (!pcm_open(pWriter, path, options.container, options.sample_type, options.sample_rate, 1, 0) ||
+        !pcm_resample_from(pWriter, options.player.sample_rate, options.resample_quality, options.player.isa))
+    {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return false;
+    }
+    pcm_set_dither(pWriter, options.dither);
+
+    // The channel started playing late, catch up with the mix
+    static const float SILENCE[STEM_BLOCK_FRAMES] = {};
+    bool ok = true;
+    for (uint64_t frame = 0; ok && frame < silentFrames; frame += STEM_BLOCK_FRAMES)
+    {
+        ok = pcm_write(pWriter, SILENCE, (int)std::min<uint64_t>(STEM_BLOCK_FRAMES, silentFrames - frame));
+    }
+    return ok;
+}
+
+// Drive the synth without a device, as fast as the CPU allows. The control
+// thread plays the events and records what each voice does, then the workers
+// synthesize one stem per channel and mix them.
+int render_offline(const RenderOptions& options)
+{
+    static const int BATCH_FRAMES = 32 * STEM_BLOCK_FRAMES;
+    static PcmWriter stem_writers[VOICE_CHANNELS];
+
+    auto load_start = std::chrono::steady_clock::now();
+    uint32_t sample_rate = options.player.sample_rate;
+    if (options.player.pWavetables)
+    {
+        wt_init(options.player.pWavetables, sample_rate, options.wavetable_budget, NOTE_FREQS, NOTE_COUNT);
+    }
+    if (!open_song(options))
+    {
+        fprintf(stderr, "Failed to load midi file\n");
+        return 2;
+    }
+
+    // The song length is only known once every track has been played
+    PcmWriter writer;
+    if (!pcm_open(&writer, options.out_path, options.container, options.sample_type,
+                  options.sample_rate, options.channel_count, 0) ||
+        !pcm_resample_from(&writer, sample_rate, options.resample_quality, options.player.isa))
+    {
+        fprintf(stderr, "Failed to open %s\n", options.out_path);
+        player_close(&player);
+        return 3;
+    }
+    pcm_set_dither(&writer, options.dither);
+
+    WorkerPool workers;
+    workers_start(&workers, options.thread_count);
+
+    StemBatch batch;
+    batch.keep_stems = options.stem_prefix != nullptr;
+    auto start = std::chrono::steady_clock::now();
+    double first_block_time = 0.0;
+    int stems_open = 0;
+
+    bool ok = true;
+    uint64_t rendered = 0;
+    while (ok && !player.song_ended)
+    {
+        int frameCount = player_plan_stems(&player, &batch, BATCH_FRAMES);
+        stems_render(&batch, &workers, options.channel_count);
+        ok = pcm_write(&writer, batch.output.data(), frameCount);
+        if (rendered == 0)
+        {
+            first_block_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - load_start).count();
+        }
+
+        for (int i = 0; ok && batch.keep_stems && i < batch.stem_count; ++i)
+        {
+            if (i == stems_open)
+            {
+                ok = open_stem(stem_writers + i, options, batch.stem_keys[i], rendered);
+                ++stems_open;
+            }
+            ok = ok && pcm_write(stem_writers + i, stems_get(&batch, i), frameCount);
+        }
+        rendered += frameCount;
+    }
+    ok = pcm_close(&writer) && ok;
+    for (int i = 0; i < stems_open; ++i)
+    {
+        ok = pcm_close(stem_writers + i) && ok;
+    }
+    int threadCount = workers_thread_count(&workers);
+    workers_stop(&workers);
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double duration = (double)rendered / (double)sample_rate;
+    fprintf(stderr, "Rendered %.2fs of audio in %.3fs (%.1fx realtime) on %i threads, %i stems\n",
+            duration, elapsed, elapsed > 0.0 ? duration / elapsed : 0.0, threadCount,
+            batch.stem_count);
+    fprintf(stderr, "First block ready %.2fms after opening the file\n", first_block_time * 1000.0);
+    print_track_error();
+    fprintf(stderr, "Seek index: %i snapshots, %.1f KB\n", (int)player.snapshots.size(),
+            (double)player_index_size(&player) / 1024.0);
+    fprintf(stderr, "Voices: peak %i of %i, %u stolen\n", player.voice_pool.peak_count,
+            player.voice_pool.capacity, player.voice_pool.steal_count);
+    if (options.player.pWavetables)
+    {
+        fprintf(stderr, "Wavetables: %.1f KB\n", (double)wt_memory_used(options.player.pWavetables) / 1024.0);
+    }
+
+    player_close(&player);
+    if (!ok)
+    {
+        fprintf(stderr, "Failed to write %s\n", options.out_path);
+        return 3;
+    }
+    return 0;
+}
+
+// Renders many songs at once, one per core, splitting the long ones
+int render_batch(const RenderOptions& options)
+{
+    std::vector<std::string> files;
+    if (!batch_collect(options.batch_path, &files))
+    {
+        fprintf(stderr, "Failed to read %s\n", options.batch_path);
+        return 2;
+    }
+
+    // Songs share the wavetable cache, build it up front so it's read only
+    if (options.player.pWavetables)
+    {
+        wt_init(options.player.pWavetables, options.player.sample_rate, options.wavetable_budget, NOTE_FREQS,
+                NOTE_COUNT);
+        wt_build_all(options.player.pWavetables);
+    }
+
+    BatchConfig config;
+    config.player = options.player;
+    config.container = options.container;
+    config.sample_type = options.sample_type;
+    config.dither = options.dither;
+    config.channel_count = options.channel_count;
+    config.sample_rate = options.sample_rate;
+    config.resample_quality = options.resample_quality;
+    config.thread_count = options.thread_count;
+    config.segment_length = options.segment_length;
+    config.out_dir = options.out_dir;
+    return batch_render(files, config) == 0 ? 0 : 3;
+}
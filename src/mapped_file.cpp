@@ -0,0 +1,73 @@
+#include "mapped_file.h"
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool map_open(MappedFile *pFile, const char *path)
+{
+#if defined(WIN32)
+    HANDLE hFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hFile, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(hFile);
+        return false;
+    }
+    HANDLE hMapping = CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!hMapping)
+    {
+        CloseHandle(hFile);
+        return false;
+    }
+    pFile->pData = (const uint8_t *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (!pFile->pData)
+    {
+        CloseHandle(hMapping);
+        CloseHandle(hFile);
+        return false;
+    }
+    pFile->hFile = hFile;
+    pFile->hMapping = hMapping;
+    pFile->size = (size_t)size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+    void *pData = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pData == MAP_FAILED) return false;
+    pFile->pData = (const uint8_t *)pData;
+    pFile->size = (size_t)st.st_size;
+#endif
+    return true;
+}
+
+void map_close(MappedFile *pFile)
+{
+    if (pFile->pData)
+    {
+#if defined(WIN32)
+        UnmapViewOfFile(pFile->pData);
+        CloseHandle((HANDLE)pFile->hMapping);
+        CloseHandle((HANDLE)pFile->hFile);
+        pFile->hFile = nullptr;
+        pFile->hMapping = nullptr;
+#else
+        munmap((void *)pFile->pData, pFile->size);
+#endif
+    }
+    pFile->pData = nullptr;
+    pFile->size = 0;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A whole file mapped read only
+struct MappedFile
+{
+    const uint8_t *pData = nullptr;
+    size_t size = 0;
+#if defined(WIN32)
+    void *hFile = nullptr;
+    void *hMapping = nullptr;
+#endif
+};
+
+// Fails on empty files too
+bool map_open(MappedFile *pFile, const char *path);
+void map_close(MappedFile *pFile);
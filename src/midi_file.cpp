@@ -0,0 +1,471 @@
+#include "midi_file.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+
+#include "event_store.h"
+
+struct MidiChunk
+{
+    char type[4];
+    uint32_t len;
+    const uint8_t *pData;
+};
+
+static void readType(char *out, uint32_t *pos, const uint8_t *pData)
+{
+    memcpy(out, pData + *pos, 4);
+    *pos += 4;
+}
+
+static uint16_t readUint16(uint32_t *pos, const uint8_t *pData)
+{
+    uint16_t out;
+    out =
+        (((pData[*pos + 0]) << 8) & 0xFF00) |
+         ((pData[*pos + 1])       & 0x00FF);
+    *pos += 2;
+    return out;
+}
+
+
+static uint32_t readUint24(uint32_t *pos, const uint8_t *pData)
+{
+    uint32_t out;
+    out =
+        (((pData[*pos + 0]) << 16) & 0x00FF0000) |
+        (((pData[*pos + 1]) << 8)  & 0x0000FF00) |
+         ((pData[*pos + 2])        & 0x000000FF);
+    *pos += 3;
+    return out;
+}
+
+static uint32_t readUint32(uint32_t *pos, const uint8_t *pData)
+{
+    uint32_t out;
+    out =
+        (((pData[*pos + 0]) << 24) & 0xFF000000) |
+        (((pData[*pos + 1]) << 16) & 0x00FF0000) |
+        (((pData[*pos + 2]) << 8)  & 0x0000FF00) |
+         ((pData[*pos + 3])        & 0x000000FF);
+    *pos += 4;
+    return out;
+}
+
+static const uint8_t *readData(uint32_t *pos, const uint8_t *pData, uint32_t len)
+{
+    const uint8_t *out = pData + *pos;
+    *pos += len;
+    return out;
+}
+
+bool midi_open(MidiFile *pFile, const char *path)
+{
+    if (!map_open(&pFile->mapping, path)) return false;
+    pFile->pData = pFile->mapping.pData;
+    pFile->size = pFile->mapping.size;
+
+    // MIDI chunk lengths are 32 bits, so are our offsets
+    uint32_t size = (uint32_t)std::min<size_t>(pFile->size, 0xFFFFFFFF);
+    uint32_t pos = 0;
+    MidiChunk chunk;
+    bool has_header = false;
+    while (pos + 8 <= size)
+    {
+        // Read next chunk header
+        readType(chunk.type, &pos, pFile->pData);
+        uint32_t len = readUint32(&pos, pFile->pData);
+        chunk.len = std::min<uint32_t>(len, size - pos);
+        chunk.pData = pFile->pData + pos;
+
+        if (strncmp(chunk.type, "MThd", 4) == 0 && chunk.len >= 6)
+        {
+            uint32_t i = 0;
+            pFile->format = readUint16(&i, chunk.pData);
+            uint16_t tracks = readUint16(&i, chunk.pData);
+            pFile->division = readUint16(&i, chunk.pData);
+
+            // SMPTE time divisions aren't supported
+            if (pFile->format > 2 || tracks == 0 || pFile->division == 0 || (pFile->division & 0x8000))
+            {
+                midi_close(pFile);
+                return false;
+            }
+            pFile->tracks.reserve(tracks);
+            has_header = true;
+        }
+        else if (strncmp(chunk.type, "MTrk", 4) == 0)
+        {
+            MidiTrack track = { pos, chunk.len };
+            pFile->tracks.push_back(track);
+        }
+
+        readData(&pos, pFile->pData, chunk.len);
+    }
+
+    if (!has_header)
+    {
+        midi_close(pFile);
+        return false;
+    }
+    return true;
+}
+
+void midi_close(MidiFile *pFile)
+{
+    map_close(&pFile->mapping);
+    pFile->pData = nullptr;
+    pFile->size = 0;
+    pFile->tracks.clear();
+}
+
+static void cursor_init(TrackCursor *pCursor, const MidiFile *pFile, int track)
+{
+    pCursor->pData = pFile->pData + pFile->tracks[track].offset;
+    pCursor->len = pFile->tracks[track].len;
+    pCursor->pos = 0;
+    pCursor->tick = 0;
+    pCursor->track = track;
+    pCursor->ended = false;
+    pCursor->running_status = 0;
+    pCursor->error = nullptr;
+    pCursor->error_pos = 0;
+}
+
+// Variable length quantity, at most 4 bytes. The fast path decodes without
+// checking the length byte by byte, the slow one only runs near the end of
+// the track. Returns false if it's truncated or too long.
+static bool read_vlq(const uint8_t *pData, uint32_t len, uint32_t *pPos, uint32_t *pOut)
+{
+    uint32_t pos = *pPos;
+    if (len - pos >= 4)
+    {
+        const uint8_t *p = pData + pos;
+        uint32_t value = p[0];
+        if (value < 0x80) { *pOut = value; *pPos = pos + 1; return true; }
+        value = ((value & 0x7F) << 7) | (p[1] & 0x7F);
+        if (p[1] < 0x80) { *pOut = value; *pPos = pos + 2; return true; }
+        value = (value << 7) | (p[2] & 0x7F);
+        if (p[2] < 0x80) { *pOut = value; *pPos = pos + 3; return true; }
+        value = (value << 7) | (p[3] & 0x7F);
+        if (p[3] < 0x80) { *pOut = value; *pPos = pos + 4; return true; }
+        return false;
+    }
+
+    uint32_t value = 0;
+    for (int i = 0; i < 4 && pos < len; ++i)
+    {
+        uint8_t next = pData[pos++];
+        value = (value << 7) | (next & 0x7F);
+        if (next < 0x80)
+        {
+            *pOut = value;
+            *pPos = pos;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Channel messages by status high nibble, from 0x8 to 0xE
+struct ChannelMessage
+{
+    uint8_t data_bytes;
+    int8_t type;        // EVENT_*, -1 when playback ignores it
+};
+
+static const ChannelMessage CHANNEL_MESSAGES[7] =
+{
+    { 2, EVENT_NOTE_OFF },  // Note off
+    { 2, EVENT_NOTE_ON },   // Note on
+    { 2, -1 },              // Polyphonic key pressure
+    { 2, EVENT_VOLUME },    // Control change, only the volume one is kept
+    { 1, -1 },              // Program change
+    { 1, -1 },              // Channel pressure
+    { 2, -1 },              // Pitch wheel
+};
+
+// Marker texts setting loop points, matched ignoring case
+static const char *LOOP_MARKERS[] = { "loopStart", "loopEnd" };
+
+static bool is_marker(const uint8_t *pText, uint32_t len, const char *marker)
+{
+    if (len != strlen(marker)) return false;
+    for (uint32_t i = 0; i < len; ++i)
+    {
+        if (tolower(pText[i]) != tolower((uint8_t)marker[i])) return false;
+    }
+    return true;
+}
+
+static bool cursor_fail(TrackCursor *pCursor, uint32_t pos, const char *reason)
+{
+    pCursor->error = reason;
+    pCursor->error_pos = pos;
+    pCursor->pos = pCursor->len;
+    pCursor->ended = true;
+    return false;
+}
+
+// Decodes events until one playback cares about. Returns false, and marks the
+// cursor as ended, when there's none left. Never reads past the track, and
+// gives up on the rest of it when the data doesn't make sense.
+static bool cursor_next(TrackCursor *pCursor)
+{
+    const uint8_t *pData = pCursor->pData;
+    const uint32_t len = pCursor->len;
+    uint32_t pos = pCursor->pos;
+    Event& e = pCursor->event;
+    e.track = pCursor->track;
+
+    while (pos < len)
+    {
+        uint32_t delta_time;
+        if (!read_vlq(pData, len, &pos, &delta_time)) return cursor_fail(pCursor, pos, "bad delta time");
+        pCursor->tick += delta_time;
+        if (pos >= len) return cursor_fail(pCursor, pos, "truncated event");
+
+        // Without a status byte, the previous channel message status applies
+        uint8_t status_byte = pData[pos];
+        if (status_byte & 0x80) ++pos;
+        else if (pCursor->running_status) status_byte = pCursor->running_status;
+        else return cursor_fail(pCursor, pos, "data byte without running status");
+
+        if (status_byte < 0xF0)
+        {
+            const ChannelMessage& message = CHANNEL_MESSAGES[(status_byte >> 4) - 0x8];
+            if (len - pos < message.data_bytes) return cursor_fail(pCursor, pos, "truncated event");
+            uint8_t data0 = pData[pos] & 0x7F;
+            uint8_t data1 = message.data_bytes > 1 ? pData[pos + 1] & 0x7F : 0;
+            pos += message.data_bytes;
+            pCursor->running_status = status_byte;
+
+            if (message.type < 0) continue;
+            if (message.type == EVENT_VOLUME)
+            {
+                if (data0 != 7) continue;
+                // The master volume as it was when loading, which is full
+                data1 = 127;
+            }
+
+            e.time = pCursor->tick;
+            e.channel = status_byte & 0xF;
+            e.type = message.type;
+            e.note = data0;
+            e.vel = (float)data1 / 127.0f;
+            pCursor->pos = pos;
+            return true;
+        }
+
+        // Meta events and SysEx both carry their length, so anything we don't
+        // know about can be skipped. Running status is kept across them since
+        // plenty of files rely on that.
+        uint8_t meta_type = 0;
+        if (status_byte == 0xFF)
+        {
+            if (pos >= len) return cursor_fail(pCursor, pos, "truncated meta event");
+            meta_type = pData[pos++];
+        }
+        else if (status_byte != 0xF0 && status_byte != 0xF7)
+        {
+            return cursor_fail(pCursor, pos, "unsupported status");
+        }
+
+        uint32_t data_len;
+        if (!read_vlq(pData, len, &pos, &data_len) || data_len > len - pos)
+        {
+            return cursor_fail(pCursor, pos, "truncated meta or SysEx event");
+        }
+        const uint8_t *pEventData = pData + pos;
+        pos += data_len;
+        if (status_byte != 0xFF) continue;
+
+        if (meta_type == 0x51 && data_len >= 3) // Set Tempo
+        {
+            uint32_t j = 0;
+            e.time = pCursor->tick;
+            e.channel = status_byte & 0xF;
+            e.note = (int)readUint24(&j, pEventData);
+            e.type = EVENT_TEMPO;
+            pCursor->pos = pos;
+            return true;
+        }
+        if (meta_type == 0x06) // Marker
+        {
+            int loop = is_marker(pEventData, data_len, LOOP_MARKERS[0]) ? EVENT_LOOP_START :
+                       is_marker(pEventData, data_len, LOOP_MARKERS[1]) ? EVENT_LOOP_END : -1;
+            if (loop < 0) continue;
+            e.time = pCursor->tick;
+            e.channel = 0;
+            e.type = loop;
+            pCursor->pos = pos;
+            return true;
+        }
+        if (meta_type == 0x2F) // End of track
+        {
+            e.time = pCursor->tick;
+            e.channel = status_byte & 0xF;
+            e.type = EVENT_END_OF_TRACK;
+            pCursor->pos = pos;
+            return true;
+        }
+    }
+
+    pCursor->pos = pos;
+    pCursor->ended = true;
+    return false;
+}
+
+bool midi_track_name(const MidiFile *pFile, int track, char *out, size_t outSize)
+{
+    if (track < 0 || track >= (int)pFile->tracks.size() || outSize == 0) return false;
+
+    const uint8_t *pData = pFile->pData + pFile->tracks[track].offset;
+    uint32_t len = pFile->tracks[track].len;
+    uint32_t pos = 0;
+
+    // Names are in the meta events that start the track
+    while (pos < len)
+    {
+        uint32_t delta_time;
+        if (!read_vlq(pData, len, &pos, &delta_time) || delta_time != 0) return false;
+        if (len - pos < 2 || pData[pos] != 0xFF) return false;
+        uint8_t type = pData[pos + 1];
+        pos += 2;
+        uint32_t meta_len;
+        if (!read_vlq(pData, len, &pos, &meta_len) || meta_len > len - pos) return false;
+        auto pMetaData = readData(&pos, pData, meta_len);
+        if (type == 0x03)
+        {
+            size_t size = std::min<size_t>(meta_len, outSize - 1);
+            memcpy(out, pMetaData, size);
+            out[size] = '\0';
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool cursor_before(const TrackCursor& a, const TrackCursor& b)
+{
+    if (a.event.time != b.event.time) return a.event.time < b.event.time;
+    return a.track < b.track;
+}
+
+static void rebuild_heap(EventStream *pStream)
+{
+    pStream->heap.clear();
+    for (int i = 0; i < (int)pStream->cursors.size(); ++i)
+    {
+        if (!pStream->cursors[i].ended) pStream->heap.push_back(i);
+    }
+
+    auto& cursors = pStream->cursors;
+    std::make_heap(pStream->heap.begin(), pStream->heap.end(), [&cursors](int a, int b)
+    {
+        return cursor_before(cursors[b], cursors[a]);
+    });
+}
+
+static void stream_note_error(EventStream *pStream, const TrackCursor& cursor)
+{
+    if (!cursor.error || pStream->error.reason) return;
+    pStream->error.reason = cursor.error;
+    pStream->error.track = cursor.track;
+    pStream->error.pos = cursor.error_pos;
+}
+
+void stream_init(EventStream *pStream, const MidiFile *pFile, int trackCount)
+{
+    trackCount = std::min<int>(trackCount, (int)pFile->tracks.size());
+    pStream->pFile = pFile;
+    pStream->pStore = nullptr;
+    pStream->cursors.resize(trackCount);
+    pStream->heap.reserve(trackCount);
+    pStream->total_len = 0;
+    pStream->error = TrackError();
+    for (int i = 0; i < trackCount; ++i)
+    {
+        cursor_init(&pStream->cursors[i], pFile, i);
+        if (!cursor_next(&pStream->cursors[i])) stream_note_error(pStream, pStream->cursors[i]);
+        pStream->total_len += pFile->tracks[i].len;
+    }
+    rebuild_heap(pStream);
+}
+
+void stream_restore(EventStream *pStream, const TrackCursor *pCursors)
+{
+    std::copy(pCursors, pCursors + pStream->cursors.size(), pStream->cursors.begin());
+    rebuild_heap(pStream);
+}
+
+const Event *stream_peek(const EventStream *pStream)
+{
+    if (pStream->heap.empty()) return nullptr;
+    return &pStream->cursors[pStream->heap.front()].event;
+}
+
+void stream_pop(EventStream *pStream)
+{
+    auto& cursors = pStream->cursors;
+    auto& heap = pStream->heap;
+
+    TrackCursor *pTop = &cursors[heap.front()];
+    bool more = pStream->pStore ? store_next(pStream->pStore, pTop) : cursor_next(pTop);
+    if (!more)
+    {
+        stream_note_error(pStream, *pTop);
+        heap.front() = heap.back();
+        heap.pop_back();
+        if (heap.empty()) return;
+    }
+
+    // Only the top changed, so a single sift down replaces a pop and a push
+    size_t count = heap.size();
+    size_t i = 0;
+    int item = heap[0];
+    while (true)
+    {
+        size_t child = 2 * i + 1;
+        if (child >= count) break;
+        if (child + 1 < count && cursor_before(cursors[heap[child + 1]], cursors[heap[child]])) ++child;
+        if (!cursor_before(cursors[heap[child]], cursors[item])) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = item;
+}
+
+void stream_find_loop(const EventStream *pStream, uint32_t *pStart, uint32_t *pEnd, uint32_t *pLastTick)
+{
+    *pStart = UINT32_MAX;
+    *pEnd = UINT32_MAX;
+    *pLastTick = 0;
+
+    // Cursors are plain data, copies decode on their own
+    for (TrackCursor cursor : pStream->cursors)
+    {
+        bool more = !cursor.ended;
+        while (more)
+        {
+            const Event& e = cursor.event;
+            if (e.type == EVENT_LOOP_START) *pStart = std::min(*pStart, e.time);
+            if (e.type == EVENT_LOOP_END) *pEnd = std::min(*pEnd, e.time);
+            *pLastTick = std::max(*pLastTick, e.time);
+            more = pStream->pStore ? store_next(pStream->pStore, &cursor) : cursor_next(&cursor);
+        }
+    }
+}
+
+float stream_progress(const EventStream *pStream)
+{
+    if (pStream->total_len == 0) return 1.0f;
+    uint64_t pos = 0;
+    for (auto& cursor : pStream->cursors)
+    {
+        pos += cursor.ended ? cursor.len : cursor.pos;
+    }
+    return (float)((double)pos / (double)pStream->total_len);
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "mapped_file.h"
+
+#define EVENT_NOTE_OFF 0
+#define EVENT_NOTE_ON 1
+#define EVENT_VOLUME 2
+#define EVENT_END_OF_TRACK 3
+#define EVENT_TEMPO 4
+#define EVENT_LOOP_START 5  // "loopStart" marker
+#define EVENT_LOOP_END 6    // "loopEnd" marker
+
+struct Event
+{
+    uint32_t time;  // In ticks
+    int track;
+    int channel;
+    int type;
+    int note;       // Microseconds per quarter note for EVENT_TEMPO
+    float vel;
+};
+
+struct MidiTrack
+{
+    uint32_t offset;    // Of the track data, past the chunk header
+    uint32_t len;
+};
+
+// A memory mapped .mid file. Opening it only walks the chunk headers, tracks
+// are decoded while they play.
+struct MidiFile
+{
+    const uint8_t *pData = nullptr;
+    size_t size = 0;
+    uint16_t format = 0;
+    uint16_t division = 0;
+    std::vector<MidiTrack> tracks;
+    MappedFile mapping;
+};
+
+bool midi_open(MidiFile *pFile, const char *path);
+void midi_close(MidiFile *pFile);
+
+// Copies the name meta event found at the start of the track, if any
+bool midi_track_name(const MidiFile *pFile, int track, char *out, size_t outSize);
+
+// Decoding position in one track, with the next event already decoded. It's
+// plain data so seek snapshots can copy it around.
+struct TrackCursor
+{
+    const uint8_t *pData;
+    uint32_t len;
+    uint32_t pos;
+    uint32_t tick;
+    int track;
+    bool ended;
+    uint8_t running_status;     // Last channel message status, 0 before any
+    const char *error;          // Why the rest of the track was skipped, nullptr if it wasn't
+    uint32_t error_pos;
+    Event event;
+};
+
+// The first track decoding gave up on. It's only recorded, tracks decode on
+// the render thread and callers report it once playback is done.
+struct TrackError
+{
+    const char *reason = nullptr;   // nullptr without any
+    int track = -1;
+    uint32_t pos = 0;               // Byte offset in the track data
+};
+
+struct EventStore;
+
+// Merges the cursors of several tracks into a single stream ordered by time,
+// then by track.
+struct EventStream
+{
+    const MidiFile *pFile = nullptr;
+    const EventStore *pStore = nullptr;    // Preloaded events, see event_store.h
+    std::vector<TrackCursor> cursors;
+    std::vector<int> heap;          // Indices of the cursors that haven't ended
+    uint64_t total_len = 0;         // Sum of the track lengths
+    TrackError error;               // Kept across stream_restore()
+};
+
+void stream_init(EventStream *pStream, const MidiFile *pFile, int trackCount);
+
+// Restores cursors previously copied out of stream->cursors
+void stream_restore(EventStream *pStream, const TrackCursor *pCursors);
+
+// Returns nullptr once every track ended
+const Event *stream_peek(const EventStream *pStream);
+void stream_pop(EventStream *pStream);
+
+// Fraction of the track data decoded so far
+float stream_progress(const EventStream *pStream);
+
+// Decodes the rest of the stream on the side, without moving it, for the
+// first loop markers (UINT32_MAX when missing) and the tick of the last event
+void stream_find_loop(const EventStream *pStream, uint32_t *pStart, uint32_t *pEnd, uint32_t *pLastTick);
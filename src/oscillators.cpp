@@ -0,0 +1,389 @@
+#include "oscillators.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "apu.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define OSC_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__)
+#define OSC_TARGET_SSE2 __attribute__((target("sse2")))
+#define OSC_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define OSC_TARGET_SSE2
+#define OSC_TARGET_AVX2
+#endif
+
+// Output levels are what amp_to_4bits() used to produce: floor(amp * 8) with
+// amp in [-1, 1], scaled back by 1/8. Volume is Q24 so the pulse level is
+// simply (+/-vol) >> 21. The triangle multiplies a Q14 wave by a Q14 volume
+// which fits in 16 bits, so SSE2 can do it with pmaddwd.
+#define PULSE_LEVEL_SHIFT 21
+#define TRIANGLE_LEVEL_SHIFT 25
+#define LEVEL_SCALE 0.125f
+
+int osc_active_count(const OscVoice *pVoice, int count)
+{
+    if (pVoice->vol <= 0) return 0;
+    if (pVoice->sustain <= 0) return count;
+    int64_t samples = ((int64_t)pVoice->vol + pVoice->sustain - 1) / pVoice->sustain;
+    return (int)std::min<int64_t>(count, samples);
+}
+
+void osc_skip(OscVoice *pVoice, int count)
+{
+    pVoice->phase += (uint32_t)count * pVoice->step;
+    int64_t vol = (int64_t)pVoice->vol - (int64_t)(count - 1) * pVoice->sustain;
+    pVoice->vol = (int32_t)std::max<int64_t>(0, vol);
+}
+
+uint32_t osc_step(float freq, uint32_t sample_rate)
+{
+    return (uint32_t)std::llround((double)freq * 4294967296.0 / (double)sample_rate);
+}
+
+int32_t osc_vol(float vol)
+{
+    return (int32_t)std::lround((double)vol * (double)OSC_VOL_ONE);
+}
+
+//------------------------------------------------------------------------------
+// Scalar
+//------------------------------------------------------------------------------
+
+// Sample i of a span plays at phase + (i + 1) * step and vol - i * sustain.
+// The tails of the SIMD kernels go through these as well.
+
+static void pulse_span(uint32_t phase, int32_t vol, const OscVoice *pVoice, float *pMix, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        phase += pVoice->step;
+        int32_t amp = phase < pVoice->duty ? vol : -vol;
+        pMix[i] += (float)(amp >> PULSE_LEVEL_SHIFT) * LEVEL_SCALE;
+        vol -= pVoice->sustain;
+    }
+}
+
+static void triangle_span(uint32_t phase, int32_t vol, const OscVoice *pVoice, float *pMix, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        phase += pVoice->step;
+        int32_t t = (int32_t)(phase >> 18) * 4;
+        int32_t tri = phase < pVoice->duty ? t - 16384 : 49152 - t;
+        pMix[i] += (float)((tri * (vol >> 10)) >> TRIANGLE_LEVEL_SHIFT) * LEVEL_SCALE;
+        vol -= pVoice->sustain;
+    }
+}
+
+void osc_pulse_ref(OscVoice *pVoice, float *pMix, int count)
+{
+    pulse_span(pVoice->phase, pVoice->vol, pVoice, pMix, osc_active_count(pVoice, count));
+    osc_skip(pVoice, count);
+}
+
+void osc_triangle_ref(OscVoice *pVoice, float *pMix, int count)
+{
+    triangle_span(pVoice->phase, pVoice->vol, pVoice, pMix, osc_active_count(pVoice, count));
+    osc_skip(pVoice, count);
+}
+
+//------------------------------------------------------------------------------
+// Noise
+//------------------------------------------------------------------------------
+
+// Feedback is bit 0 xor bit 1 (long) or bit 6 (short). The k bits fed back by
+// the next k clocks only depend on bits the register still holds, up to 14
+// clocks in long mode and 9 in short mode, so they're computed all at once.
+uint32_t osc_lfsr_clock(uint32_t lfsr, bool short_mode, uint32_t clocks)
+{
+    const int tap = short_mode ? 6 : 1;
+    const uint32_t batch = short_mode ? 9 : 14;
+
+    while (clocks)
+    {
+        uint32_t k = std::min<uint32_t>(clocks, batch);
+        uint32_t feedback = (lfsr ^ (lfsr >> tap)) & ((1u << k) - 1);
+        lfsr = (lfsr >> k) | (feedback << (15 - k));
+        clocks -= k;
+    }
+
+    return lfsr;
+}
+
+static void noise_advance(OscVoice *pVoice, uint32_t frac, int count)
+{
+    uint64_t clocks = (uint64_t)frac + (uint64_t)count * pVoice->step;
+    uint32_t loop = pVoice->noise_short ? APU_NOISE_SHORT_LOOP : APU_NOISE_LONG_LOOP;
+    pVoice->lfsr = (uint16_t)osc_lfsr_clock(pVoice->lfsr, pVoice->noise_short, (uint32_t)((clocks >> 16) % loop));
+    pVoice->phase = (uint32_t)(clocks & 0xFFFF);
+}
+
+void osc_noise(OscVoice *pVoice, float *pMix, int count)
+{
+    int active = osc_active_count(pVoice, count);
+    uint32_t lfsr = pVoice->lfsr;
+    uint32_t frac = pVoice->phase;
+    int32_t vol = pVoice->vol;
+
+    // The channel is muted while bit 0 is set
+    for (int i = 0; i < active; ++i)
+    {
+        frac += pVoice->step;
+        lfsr = osc_lfsr_clock(lfsr, pVoice->noise_short, frac >> 16);
+        frac &= 0xFFFF;
+        int32_t amp = (lfsr & 1) ? 0 : vol;
+        pMix[i] += (float)(amp >> PULSE_LEVEL_SHIFT) * LEVEL_SCALE;
+        vol -= pVoice->sustain;
+    }
+
+    pVoice->lfsr = (uint16_t)lfsr;
+    noise_advance(pVoice, frac, count - active);
+    int64_t end_vol = (int64_t)pVoice->vol - (int64_t)(count - 1) * pVoice->sustain;
+    pVoice->vol = (int32_t)std::max<int64_t>(0, end_vol);
+}
+
+void osc_noise_skip(OscVoice *pVoice, int count)
+{
+    noise_advance(pVoice, pVoice->phase, count);
+    int64_t vol = (int64_t)pVoice->vol - (int64_t)(count - 1) * pVoice->sustain;
+    pVoice->vol = (int32_t)std::max<int64_t>(0, vol);
+}
+
+void osc_noise_note(OscVoice *pVoice, int note, uint32_t sample_rate)
+{
+    int setting = note & 31;
+    uint32_t period = APU_NOISE_PERIODS[15 - (setting & 15)];
+    pVoice->noise_short = setting >= 16;
+    pVoice->step = (uint32_t)std::llround((double)APU_CPU_CLOCK / ((double)period * (double)sample_rate) * 65536.0);
+}
+
+#if defined(OSC_X86)
+
+//------------------------------------------------------------------------------
+// SSE2, 8 samples per iteration
+//------------------------------------------------------------------------------
+
+OSC_TARGET_SSE2 static void add_levels_sse2(float *pMix, __m128i level)
+{
+    __m128 sample = _mm_mul_ps(_mm_cvtepi32_ps(level), _mm_set1_ps(LEVEL_SCALE));
+    _mm_storeu_ps(pMix, _mm_add_ps(_mm_loadu_ps(pMix), sample));
+}
+
+// SSE2 has no unsigned compare, flip the sign bits and compare signed
+OSC_TARGET_SSE2 static __m128i phase_below_sse2(__m128i phase, __m128i duty)
+{
+    const __m128i sign = _mm_set1_epi32((int)0x80000000);
+    return _mm_cmplt_epi32(_mm_xor_si128(phase, sign), _mm_xor_si128(duty, sign));
+}
+
+OSC_TARGET_SSE2 static __m128i select_sse2(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+OSC_TARGET_SSE2 static __m128i pulse_level_sse2(__m128i phase, __m128i vol, __m128i duty)
+{
+    __m128i amp = select_sse2(phase_below_sse2(phase, duty), vol, _mm_sub_epi32(_mm_setzero_si128(), vol));
+    return _mm_srai_epi32(amp, PULSE_LEVEL_SHIFT);
+}
+
+OSC_TARGET_SSE2 static __m128i triangle_level_sse2(__m128i phase, __m128i vol, __m128i duty)
+{
+    __m128i t = _mm_slli_epi32(_mm_srli_epi32(phase, 18), 2);
+    __m128i up = _mm_sub_epi32(t, _mm_set1_epi32(16384));
+    __m128i down = _mm_sub_epi32(_mm_set1_epi32(49152), t);
+    __m128i tri = select_sse2(phase_below_sse2(phase, duty), up, down);
+    // The high halves of the volume lanes are zero, so pmaddwd is a 16x16
+    // multiply of the low halves.
+    __m128i prod = _mm_madd_epi16(tri, _mm_srli_epi32(vol, 10));
+    return _mm_srai_epi32(prod, TRIANGLE_LEVEL_SHIFT);
+}
+
+template<__m128i (*level_fn)(__m128i, __m128i, __m128i), void (*span_fn)(uint32_t, int32_t, const OscVoice *, float *, int)>
+OSC_TARGET_SSE2 static void osc_kernel_sse2(OscVoice *pVoice, float *pMix, int count)
+{
+    int active = osc_active_count(pVoice, count);
+    int vectorized = active & ~7;
+
+    const uint32_t step = pVoice->step;
+    const int32_t sustain = pVoice->sustain;
+    __m128i phase0 = _mm_setr_epi32((int)(pVoice->phase + step), (int)(pVoice->phase + step * 2),
+                                    (int)(pVoice->phase + step * 3), (int)(pVoice->phase + step * 4));
+    __m128i vol0 = _mm_setr_epi32(pVoice->vol, pVoice->vol - sustain,
+                                  pVoice->vol - sustain * 2, pVoice->vol - sustain * 3);
+    const __m128i phase_step4 = _mm_set1_epi32((int)(step * 4));
+    const __m128i phase_step8 = _mm_set1_epi32((int)(step * 8));
+    const __m128i vol_step4 = _mm_set1_epi32(sustain * 4);
+    const __m128i vol_step8 = _mm_set1_epi32(sustain * 8);
+    const __m128i duty = _mm_set1_epi32((int)pVoice->duty);
+
+    for (int i = 0; i < vectorized; i += 8)
+    {
+        __m128i phase1 = _mm_add_epi32(phase0, phase_step4);
+        __m128i vol1 = _mm_sub_epi32(vol0, vol_step4);
+        add_levels_sse2(pMix + i, level_fn(phase0, vol0, duty));
+        add_levels_sse2(pMix + i + 4, level_fn(phase1, vol1, duty));
+        phase0 = _mm_add_epi32(phase0, phase_step8);
+        vol0 = _mm_sub_epi32(vol0, vol_step8);
+    }
+
+    span_fn(pVoice->phase + (uint32_t)vectorized * step, pVoice->vol - vectorized * sustain,
+            pVoice, pMix + vectorized, active - vectorized);
+    osc_skip(pVoice, count);
+}
+
+//------------------------------------------------------------------------------
+// AVX2, 16 samples per iteration
+//------------------------------------------------------------------------------
+
+OSC_TARGET_AVX2 static void add_levels_avx2(float *pMix, __m256i level)
+{
+    __m256 sample = _mm256_mul_ps(_mm256_cvtepi32_ps(level), _mm256_set1_ps(LEVEL_SCALE));
+    _mm256_storeu_ps(pMix, _mm256_add_ps(_mm256_loadu_ps(pMix), sample));
+}
+
+OSC_TARGET_AVX2 static __m256i phase_below_avx2(__m256i phase, __m256i duty)
+{
+    const __m256i sign = _mm256_set1_epi32((int)0x80000000);
+    return _mm256_cmpgt_epi32(_mm256_xor_si256(duty, sign), _mm256_xor_si256(phase, sign));
+}
+
+OSC_TARGET_AVX2 static __m256i pulse_level_avx2(__m256i phase, __m256i vol, __m256i duty)
+{
+    __m256i amp = _mm256_blendv_epi8(_mm256_sub_epi32(_mm256_setzero_si256(), vol), vol, phase_below_avx2(phase, duty));
+    return _mm256_srai_epi32(amp, PULSE_LEVEL_SHIFT);
+}
+
+OSC_TARGET_AVX2 static __m256i triangle_level_avx2(__m256i phase, __m256i vol, __m256i duty)
+{
+    __m256i t = _mm256_slli_epi32(_mm256_srli_epi32(phase, 18), 2);
+    __m256i up = _mm256_sub_epi32(t, _mm256_set1_epi32(16384));
+    __m256i down = _mm256_sub_epi32(_mm256_set1_epi32(49152), t);
+    __m256i tri = _mm256_blendv_epi8(down, up, phase_below_avx2(phase, duty));
+    __m256i prod = _mm256_mullo_epi32(tri, _mm256_srli_epi32(vol, 10));
+    return _mm256_srai_epi32(prod, TRIANGLE_LEVEL_SHIFT);
+}
+
+template<__m256i (*level_fn)(__m256i, __m256i, __m256i), void (*span_fn)(uint32_t, int32_t, const OscVoice *, float *, int)>
+OSC_TARGET_AVX2 static void osc_kernel_avx2(OscVoice *pVoice, float *pMix, int count)
+{
+    int active = osc_active_count(pVoice, count);
+    int vectorized = active & ~15;
+
+    const uint32_t step = pVoice->step;
+    const int32_t sustain = pVoice->sustain;
+    int32_t phases[8];
+    int32_t vols[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        phases[i] = (int32_t)(pVoice->phase + step * (uint32_t)(i + 1));
+        vols[i] = pVoice->vol - sustain * i;
+    }
+    __m256i phase0 = _mm256_loadu_si256((const __m256i *)phases);
+    __m256i vol0 = _mm256_loadu_si256((const __m256i *)vols);
+    const __m256i phase_step8 = _mm256_set1_epi32((int)(step * 8));
+    const __m256i phase_step16 = _mm256_set1_epi32((int)(step * 16));
+    const __m256i vol_step8 = _mm256_set1_epi32(sustain * 8);
+    const __m256i vol_step16 = _mm256_set1_epi32(sustain * 16);
+    const __m256i duty = _mm256_set1_epi32((int)pVoice->duty);
+
+    for (int i = 0; i < vectorized; i += 16)
+    {
+        __m256i phase1 = _mm256_add_epi32(phase0, phase_step8);
+        __m256i vol1 = _mm256_sub_epi32(vol0, vol_step8);
+        add_levels_avx2(pMix + i, level_fn(phase0, vol0, duty));
+        add_levels_avx2(pMix + i + 8, level_fn(phase1, vol1, duty));
+        phase0 = _mm256_add_epi32(phase0, phase_step16);
+        vol0 = _mm256_sub_epi32(vol0, vol_step16);
+    }
+
+    span_fn(pVoice->phase + (uint32_t)vectorized * step, pVoice->vol - vectorized * sustain,
+            pVoice, pMix + vectorized, active - vectorized);
+    osc_skip(pVoice, count);
+}
+
+static bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave || (_xgetbv(0) & 0x6) != 0x6) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+static bool cpu_has_sse2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2") != 0;
+#endif
+}
+
+#endif // OSC_X86
+
+static int best_isa()
+{
+    int best = OSC_ISA_SCALAR;
+#if defined(OSC_X86)
+    if (cpu_has_sse2()) best = OSC_ISA_SSE2;
+    if (cpu_has_avx2()) best = OSC_ISA_AVX2;
+#endif
+    return best;
+}
+
+int osc_pick_isa(int isa)
+{
+    // Initialized once, even with several threads asking
+    static const int best = best_isa();
+    return isa < 0 || isa > best ? best : isa;
+}
+
+OscKernels osc_kernels(int isa)
+{
+    OscKernels kernels;
+    switch (isa)
+    {
+#if defined(OSC_X86)
+        case OSC_ISA_AVX2:
+            kernels.pulse = osc_kernel_avx2<pulse_level_avx2, pulse_span>;
+            kernels.triangle = osc_kernel_avx2<triangle_level_avx2, triangle_span>;
+            break;
+        case OSC_ISA_SSE2:
+            kernels.pulse = osc_kernel_sse2<pulse_level_sse2, pulse_span>;
+            kernels.triangle = osc_kernel_sse2<triangle_level_sse2, triangle_span>;
+            break;
+#endif
+        default:
+            break;
+    }
+    return kernels;
+}
+
+const char *osc_isa_name(int isa)
+{
+    switch (isa)
+    {
+        case OSC_ISA_SSE2: return "sse2";
+        case OSC_ISA_AVX2: return "avx2";
+        default: return "scalar";
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+
+#define OSC_ISA_SCALAR 0
+#define OSC_ISA_SSE2 1
+#define OSC_ISA_AVX2 2
+
+// 1.0 in the fixed point volume format
+#define OSC_VOL_ONE (1 << 24)
+
+// Fixed point state of a tone voice. Everything is integer so the vectorized
+// kernels produce exactly the same output as the scalar reference.
+struct OscVoice
+{
+    uint32_t phase = 0;             // One cycle is 2^32
+    uint32_t step = 0;              // Phase increment per sample
+    uint32_t duty = 0x80000000;     // Phase at which the wave flips
+    int32_t vol = 0;                // Q24, OSC_VOL_ONE is full volume
+    int32_t sustain = 0;            // Q24, volume lost per sample
+    uint16_t lfsr = 1;              // Noise shift register
+    bool noise_short = false;       // Noise short (93 steps) mode
+};
+
+// Synthesizes count samples and adds them to pMix. The first sample is played
+// at the current volume, the decay is applied before each of the next ones.
+typedef void (*OscKernel)(OscVoice *pVoice, float *pMix, int count);
+
+// Scalar reference implementations
+void osc_pulse_ref(OscVoice *pVoice, float *pMix, int count);
+void osc_triangle_ref(OscVoice *pVoice, float *pMix, int count);
+
+// Each user keeps its own copy, so players with different kernels can run
+// side by side
+struct OscKernels
+{
+    OscKernel pulse = osc_pulse_ref;
+    OscKernel triangle = osc_triangle_ref;
+};
+
+// Advance a voice by count samples without producing any sound
+void osc_skip(OscVoice *pVoice, int count);
+
+// Number of samples, up to count, that will be heard before the volume
+// reaches zero.
+int osc_active_count(const OscVoice *pVoice, int count);
+
+// The noise voice is the 2A03's 15-bit LFSR. It reuses OscVoice with step as
+// the number of LFSR clocks per sample in Q16, and phase holding the
+// fractional clock. Like trackers do, notes wrap around the 16 hardware
+// periods in long mode, then the same 16 in short mode.
+void osc_noise(OscVoice *pVoice, float *pMix, int count);
+void osc_noise_skip(OscVoice *pVoice, int count);
+void osc_noise_note(OscVoice *pVoice, int note, uint32_t sample_rate);
+
+// Clocks a noise shift register, any number of times
+uint32_t osc_lfsr_clock(uint32_t lfsr, bool short_mode, uint32_t clocks);
+
+uint32_t osc_step(float freq, uint32_t sample_rate);
+int32_t osc_vol(float vol);
+
+// Returns isa if this CPU supports it, else the best OSC_ISA_* it does, also
+// when isa is -1
+int osc_pick_isa(int isa = -1);
+
+// Kernels for an OSC_ISA_* returned by osc_pick_isa()
+OscKernels osc_kernels(int isa);
+const char *osc_isa_name(int isa);
@@ -0,0 +1,362 @@
+#include "output_stage.h"
+
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+
+#include "oscillators.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define OUTPUT_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define OUTPUT_TARGET_SSE2 __attribute__((target("sse2")))
+#define OUTPUT_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define OUTPUT_TARGET_SSE2
+#define OUTPUT_TARGET_AVX2
+#endif
+
+// Samples fanned out at once when buses and channels differ, at least a
+// frame of OUTPUT_MAX_CHANNELS
+#define OUTPUT_BLOCK_SAMPLES 1024
+
+#define S16_SCALE 32767.0f
+#define S24_SCALE 8388607.0f
+
+// One LSB of noise, the difference of two 16-bit uniforms
+#define DITHER_SCALE (1.0f / 65536.0f)
+
+// Converts count interleaved samples, the first being number first of the
+// stream for the dither
+typedef void (*ConvertKernel)(const float *pIn, int count, uint32_t first, const OutputDither *pDither,
+                              void *pOut);
+
+//------------------------------------------------------------------------------
+// Scalar
+//------------------------------------------------------------------------------
+
+// Integer hash of the sample index, the SIMD kernels compute the same one
+static uint32_t dither_hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+
+static float dither_noise(const OutputDither *pDither, uint32_t index)
+{
+    uint32_t hash = dither_hash(index + pDither->seed);
+    return (float)((int32_t)(hash & 0xFFFF) - (int32_t)(hash >> 16)) * DITHER_SCALE;
+}
+
+// Rounds to nearest even like the SIMD conversions
+static int32_t quantize(float sample, float scale, const OutputDither *pDither, uint32_t index)
+{
+    float value = std::min<float>(1.0f, std::max<float>(-1.0f, sample)) * scale;
+    if (pDither)
+    {
+        value = std::min<float>(scale, std::max<float>(-scale, value + dither_noise(pDither, index)));
+    }
+    return (int32_t)std::lrint(value);
+}
+
+static void put_s24(uint8_t *pOut, int32_t value)
+{
+    pOut[0] = (uint8_t)(value & 0xFF);
+    pOut[1] = (uint8_t)((value >> 8) & 0xFF);
+    pOut[2] = (uint8_t)((value >> 16) & 0xFF);
+}
+
+static void s16_scalar(const float *pIn, int count, uint32_t first, const OutputDither *pDither, void *pOut)
+{
+    uint8_t *pBytes = (uint8_t*)pOut;
+    for (int i = 0; i < count; ++i)
+    {
+        uint16_t value = (uint16_t)(int16_t)quantize(pIn[i], S16_SCALE, pDither, first + (uint32_t)i);
+        pBytes[i * 2] = (uint8_t)(value & 0xFF);
+        pBytes[i * 2 + 1] = (uint8_t)(value >> 8);
+    }
+}
+
+static void s24_scalar(const float *pIn, int count, uint32_t first, const OutputDither *pDither, void *pOut)
+{
+    uint8_t *pBytes = (uint8_t*)pOut;
+    for (int i = 0; i < count; ++i)
+    {
+        put_s24(pBytes + i * 3, quantize(pIn[i], S24_SCALE, pDither, first + (uint32_t)i));
+    }
+}
+
+//------------------------------------------------------------------------------
+// SSE2, 4 samples per iteration
+//------------------------------------------------------------------------------
+
+#if defined(OUTPUT_X86)
+
+// SSE2 only multiplies the even lanes, do both halves
+OUTPUT_TARGET_SSE2 static __m128i mullo_sse2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+OUTPUT_TARGET_SSE2 static __m128 dither_noise_sse2(const OutputDither *pDither, uint32_t index)
+{
+    __m128i x = _mm_add_epi32(_mm_set1_epi32((int)(index + pDither->seed)), _mm_setr_epi32(0, 1, 2, 3));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    x = mullo_sse2(x, _mm_set1_epi32(0x7FEB352D));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+    x = mullo_sse2(x, _mm_set1_epi32((int)0x846CA68Bu));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    __m128i diff = _mm_sub_epi32(_mm_and_si128(x, _mm_set1_epi32(0xFFFF)), _mm_srli_epi32(x, 16));
+    return _mm_mul_ps(_mm_cvtepi32_ps(diff), _mm_set1_ps(DITHER_SCALE));
+}
+
+// Same clamps as quantize(), max and min return the bound for NaNs too
+OUTPUT_TARGET_SSE2 static __m128i quantize_sse2(__m128 sample, float scale, const OutputDither *pDither,
+                                                uint32_t index)
+{
+    const __m128 bound = _mm_set1_ps(scale);
+    __m128 value = _mm_mul_ps(_mm_min_ps(_mm_max_ps(sample, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f)), bound);
+    if (pDither)
+    {
+        value = _mm_add_ps(value, dither_noise_sse2(pDither, index));
+        value = _mm_min_ps(_mm_max_ps(value, _mm_sub_ps(_mm_setzero_ps(), bound)), bound);
+    }
+    return _mm_cvtps_epi32(value);
+}
+
+OUTPUT_TARGET_SSE2 static void s16_sse2(const float *pIn, int count, uint32_t first, const OutputDither *pDither,
+                                        void *pOut)
+{
+    uint8_t *pBytes = (uint8_t*)pOut;
+    int vectorized = count & ~7;
+    for (int i = 0; i < vectorized; i += 8)
+    {
+        __m128i low = quantize_sse2(_mm_loadu_ps(pIn + i), S16_SCALE, pDither, first + (uint32_t)i);
+        __m128i high = quantize_sse2(_mm_loadu_ps(pIn + i + 4), S16_SCALE, pDither, first + (uint32_t)i + 4);
+        _mm_storeu_si128((__m128i*)(pBytes + i * 2), _mm_packs_epi32(low, high));
+    }
+    s16_scalar(pIn + vectorized, count - vectorized, first + (uint32_t)vectorized, pDither, pBytes + vectorized * 2);
+}
+
+OUTPUT_TARGET_SSE2 static void s24_sse2(const float *pIn, int count, uint32_t first, const OutputDither *pDither,
+                                        void *pOut)
+{
+    uint8_t *pBytes = (uint8_t*)pOut;
+    int vectorized = count & ~3;
+    int32_t values[4];
+    for (int i = 0; i < vectorized; i += 4)
+    {
+        _mm_storeu_si128((__m128i*)values, quantize_sse2(_mm_loadu_ps(pIn + i), S24_SCALE, pDither,
+                                                         first + (uint32_t)i));
+        for (int k = 0; k < 4; ++k) put_s24(pBytes + (i + k) * 3, values[k]);
+    }
+    s24_scalar(pIn + vectorized, count - vectorized, first + (uint32_t)vectorized, pDither, pBytes + vectorized * 3);
+}
+
+//------------------------------------------------------------------------------
+// AVX2, 8 samples per iteration
+//------------------------------------------------------------------------------
+
+OUTPUT_TARGET_AVX2 static __m256 dither_noise_avx2(const OutputDither *pDither, uint32_t index)
+{
+    __m256i x = _mm256_add_epi32(_mm256_set1_epi32((int)(index + pDither->seed)),
+                                 _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x7FEB352D));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32((int)0x846CA68Bu));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    __m256i diff = _mm256_sub_epi32(_mm256_and_si256(x, _mm256_set1_epi32(0xFFFF)), _mm256_srli_epi32(x, 16));
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(diff), _mm256_set1_ps(DITHER_SCALE));
+}
+
+OUTPUT_TARGET_AVX2 static __m256i quantize_avx2(__m256 sample, float scale, const OutputDither *pDither,
+                                                uint32_t index)
+{
+    const __m256 bound = _mm256_set1_ps(scale);
+    __m256 value = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(sample, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(1.0f)),
+                                 bound);
+    if (pDither)
+    {
+        value = _mm256_add_ps(value, dither_noise_avx2(pDither, index));
+        value = _mm256_min_ps(_mm256_max_ps(value, _mm256_sub_ps(_mm256_setzero_ps(), bound)), bound);
+    }
+    return _mm256_cvtps_epi32(value);
+}
+
+OUTPUT_TARGET_AVX2 static void s16_avx2(const float *pIn, int count, uint32_t first, const OutputDither *pDither,
+                                        void *pOut)
+{
+    uint8_t *pBytes = (uint8_t*)pOut;
+    int vectorized = count & ~15;
+    for (int i = 0; i < vectorized; i += 16)
+    {
+        __m256i low = quantize_avx2(_mm256_loadu_ps(pIn + i), S16_SCALE, pDither, first + (uint32_t)i);
+        __m256i high = quantize_avx2(_mm256_loadu_ps(pIn + i + 8), S16_SCALE, pDither, first + (uint32_t)i + 8);
+        // Packing works per 128-bit lane, put the quarters back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i*)(pBytes + i * 2), packed);
+    }
+    s16_sse2(pIn + vectorized, count - vectorized, first + (uint32_t)vectorized, pDither, pBytes + vectorized * 2);
+}
+
+// Drops the top byte of each sample, 4 samples to 12 bytes in each lane
+OUTPUT_TARGET_AVX2 static void s24_avx2(const float *pIn, int count, uint32_t first, const OutputDither *pDither,
+                                        void *pOut)
+{
+    uint8_t *pBytes = (uint8_t*)pOut;
+    const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                             0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    int vectorized = count & ~7;
+    uint8_t packed[32];
+    for (int i = 0; i < vectorized; i += 8)
+    {
+        __m256i values = quantize_avx2(_mm256_loadu_ps(pIn + i), S24_SCALE, pDither, first + (uint32_t)i);
+        _mm256_storeu_si256((__m256i*)packed, _mm256_shuffle_epi8(values, shuffle));
+        memcpy(pBytes + i * 3, packed, 12);
+        memcpy(pBytes + i * 3 + 12, packed + 16, 12);
+    }
+    s24_sse2(pIn + vectorized, count - vectorized, first + (uint32_t)vectorized, pDither, pBytes + vectorized * 3);
+}
+
+// One bus to two channels
+OUTPUT_TARGET_SSE2 static void mono_to_stereo_sse2(const float *pIn, int frameCount, float *pOut)
+{
+    int vectorized = frameCount & ~3;
+    for (int i = 0; i < vectorized; i += 4)
+    {
+        __m128 mono = _mm_loadu_ps(pIn + i);
+        _mm_storeu_ps(pOut + i * 2, _mm_unpacklo_ps(mono, mono));
+        _mm_storeu_ps(pOut + i * 2 + 4, _mm_unpackhi_ps(mono, mono));
+    }
+    for (int i = vectorized; i < frameCount; ++i)
+    {
+        pOut[i * 2] = pIn[i];
+        pOut[i * 2 + 1] = pIn[i];
+    }
+}
+
+#endif // OUTPUT_X86
+
+struct Kernels
+{
+    ConvertKernel s16 = s16_scalar;
+    ConvertKernel s24 = s24_scalar;
+    bool simd_fan_out = false;
+};
+
+static Kernels pick_kernels(int isa)
+{
+    Kernels kernels;
+    switch (isa)
+    {
+#if defined(OUTPUT_X86)
+        case OSC_ISA_AVX2:
+            kernels.s16 = s16_avx2;
+            kernels.s24 = s24_avx2;
+            kernels.simd_fan_out = true;
+            break;
+        case OSC_ISA_SSE2:
+            kernels.s16 = s16_sse2;
+            kernels.s24 = s24_sse2;
+            kernels.simd_fan_out = true;
+            break;
+#endif
+        default:
+            break;
+    }
+    return kernels;
+}
+
+//------------------------------------------------------------------------------
+// Stage
+//------------------------------------------------------------------------------
+
+int output_sample_size(int sampleType)
+{
+    switch (sampleType)
+    {
+        case SAMPLE_F32: return 4;
+        case SAMPLE_S24: return 3;
+        default: return 2;
+    }
+}
+
+int output_parse_sample_type(const char *name)
+{
+    if (strcmp(name, "s16") == 0) return SAMPLE_S16;
+    if (strcmp(name, "s24") == 0) return SAMPLE_S24;
+    if (strcmp(name, "f32") == 0) return SAMPLE_F32;
+    return -1;
+}
+
+static void fan_out(const Kernels& kernels, const float *pIn, int busCount, int frameCount, int channelCount,
+                    float *pOut)
+{
+#if defined(OUTPUT_X86)
+    if (kernels.simd_fan_out && busCount == 1 && channelCount == 2)
+    {
+        mono_to_stereo_sse2(pIn, frameCount, pOut);
+        return;
+    }
+#endif
+    for (int i = 0; i < frameCount; ++i)
+    {
+        const float *pFrame = pIn + (size_t)i * busCount;
+        for (int c = 0; c < channelCount; ++c)
+        {
+            *pOut++ = pFrame[c % busCount];
+        }
+    }
+}
+
+static void convert(const Kernels& kernels, const float *pIn, int count, int sampleType, OutputDither *pDither,
+                    void *pOut)
+{
+    const OutputDither *pNoise = pDither && pDither->enabled ? pDither : nullptr;
+    uint32_t first = pDither ? pDither->position : 0;
+    switch (sampleType)
+    {
+        case SAMPLE_F32: memcpy(pOut, pIn, sizeof(float) * count); break;
+        case SAMPLE_S24: kernels.s24(pIn, count, first, pNoise, pOut); break;
+        default: kernels.s16(pIn, count, first, pNoise, pOut); break;
+    }
+    if (pDither) pDither->position += (uint32_t)count;
+}
+
+void output_convert(const float *pIn, int busCount, int frameCount, int channelCount, int sampleType,
+                    OutputDither *pDither, int isa, void *pOut)
+{
+    Kernels kernels = pick_kernels(isa);
+    if (busCount == channelCount)
+    {
+        convert(kernels, pIn, frameCount * channelCount, sampleType, pDither, pOut);
+        return;
+    }
+    if (sampleType == SAMPLE_F32)
+    {
+        fan_out(kernels, pIn, busCount, frameCount, channelCount, (float*)pOut);
+        return;
+    }
+
+    float block[OUTPUT_BLOCK_SAMPLES];
+    int blockFrames = std::max(1, OUTPUT_BLOCK_SAMPLES / channelCount);
+    uint8_t *pBytes = (uint8_t*)pOut;
+    for (int frame = 0; frame < frameCount; frame += blockFrames)
+    {
+        int count = std::min(blockFrames, frameCount - frame);
+        fan_out(kernels, pIn + (size_t)frame * busCount, busCount, count, channelCount, block);
+        convert(kernels, block, count * channelCount, sampleType, pDither, pBytes);
+        pBytes += (size_t)count * channelCount * output_sample_size(sampleType);
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+// Sample formats of files and devices, little endian
+#define SAMPLE_S16 0
+#define SAMPLE_F32 1
+#define SAMPLE_S24 2    // Packed, 3 bytes per sample
+
+#define OUTPUT_MAX_CHANNELS 256
+
+// TPDF dither for the integer formats: up to one LSB of triangular noise is
+// added before rounding. The noise only depends on seed and on the sample
+// index, so dithered outputs are still the same on every machine.
+struct OutputDither
+{
+    bool enabled = false;
+    uint32_t seed = 1;
+    uint32_t position = 0;      // Samples converted so far
+};
+
+int output_sample_size(int sampleType);
+
+// "s16", "s24" or "f32", returns -1 for anything else
+int output_parse_sample_type(const char *name);
+
+// Converts frameCount frames of busCount interleaved float buses into
+// channelCount interleaved samples of sampleType at pOut. Channel c plays
+// bus c % busCount, so one bus goes to every channel. Integer formats are
+// clamped to [-1, 1] first, floats are copied as is. pDither may be null.
+// isa is an OSC_ISA_* returned by osc_pick_isa(), the output is the same
+// with each of them.
+void output_convert(const float *pIn, int busCount, int frameCount, int channelCount, int sampleType,
+                    OutputDither *pDither, int isa, void *pOut);
@@ -0,0 +1,277 @@
+#include "pcm_writer.h"
+
+#include <string.h>
+#include <algorithm>
+
+#if defined(WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "oscillators.h"
+
+// Hand a buffer over to the writer thread once it gets that big
+#define PCM_FLUSH_SIZE (256 * 1024)
+
+// Frames converted at once when resampling
+#define PCM_RESAMPLE_FRAMES 4096
+
+#define WAV_HEADER_SIZE 44
+#define WAV_EXTENSIBLE_HEADER_SIZE 68   // fmt chunk grows from 16 to 40 bytes
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_IEEE_FLOAT 3
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+// KSDATAFORMAT_SUBTYPE_* GUIDs are the format tag followed by these bytes
+static const uint8_t WAV_SUBTYPE_SUFFIX[12] = { 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71 };
+
+static void put_uint16(uint8_t *pOut, uint16_t val)
+{
+    pOut[0] = (uint8_t)(val & 0xFF);
+    pOut[1] = (uint8_t)((val >> 8) & 0xFF);
+}
+
+static void put_uint32(uint8_t *pOut, uint32_t val)
+{
+    pOut[0] = (uint8_t)(val & 0xFF);
+    pOut[1] = (uint8_t)((val >> 8) & 0xFF);
+    pOut[2] = (uint8_t)((val >> 16) & 0xFF);
+    pOut[3] = (uint8_t)((val >> 24) & 0xFF);
+}
+
+// Formats a plain fmt chunk can't describe unambiguously (more than 16 bits
+// per sample, more than 2 channels) need WAVE_FORMAT_EXTENSIBLE
+static bool wav_extensible(const PcmWriter *pWriter)
+{
+    return pWriter->sample_type == SAMPLE_S24 || pWriter->channel_count > 2;
+}
+
+static uint32_t wav_header_size(const PcmWriter *pWriter)
+{
+    return wav_extensible(pWriter) ? WAV_EXTENSIBLE_HEADER_SIZE : WAV_HEADER_SIZE;
+}
+
+// Speakers in the standard order, mono goes to the front center. Channels
+// past the 18 known positions aren't assigned one.
+static uint32_t wav_channel_mask(int channelCount)
+{
+    if (channelCount == 1) return 0x4;
+    if (channelCount >= 18) return 0x3FFFF;
+    return (1u << channelCount) - 1;
+}
+
+// Writes wav_header_size() bytes. An odd data_size is followed by a pad byte,
+// counted in the RIFF size.
+static void make_wav_header(uint8_t *pOut, const PcmWriter *pWriter, uint64_t data_size)
+{
+    uint32_t header_size = wav_header_size(pWriter);
+    uint32_t block_align = (uint32_t)(pWriter->channel_count * output_sample_size(pWriter->sample_type));
+    uint32_t size = (uint32_t)std::min<uint64_t>(data_size, 0xFFFFFFFE - header_size);
+    uint16_t format = pWriter->sample_type == SAMPLE_F32 ? WAV_FORMAT_IEEE_FLOAT : WAV_FORMAT_PCM;
+    uint16_t bits = (uint16_t)(output_sample_size(pWriter->sample_type) * 8);
+
+    memcpy(pOut + 0, "RIFF", 4);
+    put_uint32(pOut + 4, size + (size & 1) + header_size - 8);
+    memcpy(pOut + 8, "WAVE", 4);
+    memcpy(pOut + 12, "fmt ", 4);
+    put_uint32(pOut + 16, header_size - 28);
+    put_uint16(pOut + 20, wav_extensible(pWriter) ? WAV_FORMAT_EXTENSIBLE : format);
+    put_uint16(pOut + 22, (uint16_t)pWriter->channel_count);
+    put_uint32(pOut + 24, pWriter->sample_rate);
+    put_uint32(pOut + 28, pWriter->sample_rate * block_align);
+    put_uint16(pOut + 32, (uint16_t)block_align);
+    put_uint16(pOut + 34, bits);
+    if (wav_extensible(pWriter))
+    {
+        put_uint16(pOut + 36, 22);
+        put_uint16(pOut + 38, bits);
+        put_uint32(pOut + 40, wav_channel_mask(pWriter->channel_count));
+        put_uint16(pOut + 44, format);
+        put_uint16(pOut + 46, 0);
+        memcpy(pOut + 48, WAV_SUBTYPE_SUFFIX, sizeof(WAV_SUBTYPE_SUFFIX));
+    }
+    memcpy(pOut + header_size - 8, "data", 4);
+    put_uint32(pOut + header_size - 4, size);
+}
+
+static void writer_thread(PcmWriter *pWriter)
+{
+    std::unique_lock<std::mutex> lock(pWriter->mutex);
+    while (true)
+    {
+        pWriter->cv.wait(lock, [pWriter] { return pWriter->pending || pWriter->quit; });
+        if (!pWriter->pending) break;
+
+        const auto& buffer = pWriter->buffers[1 - pWriter->back];
+        size_t size = pWriter->pending_size;
+
+        lock.unlock();
+        bool ok = fwrite(buffer.data(), 1, size, pWriter->file) == size;
+        lock.lock();
+
+        if (!ok) pWriter->failed.store(true, std::memory_order_relaxed);
+        pWriter->bytes_written += size;
+        pWriter->pending = false;
+        pWriter->cv.notify_all();
+    }
+}
+
+// Give the back buffer to the writer thread and start filling the other one
+static void flush_back_buffer(PcmWriter *pWriter)
+{
+    std::unique_lock<std::mutex> lock(pWriter->mutex);
+    pWriter->cv.wait(lock, [pWriter] { return !pWriter->pending; });
+
+    auto& buffer = pWriter->buffers[pWriter->back];
+    if (buffer.empty()) return;
+
+    pWriter->pending_size = buffer.size();
+    pWriter->pending = true;
+    pWriter->back = 1 - pWriter->back;
+    pWriter->buffers[pWriter->back].clear();
+    pWriter->cv.notify_all();
+}
+
+bool pcm_open(PcmWriter *pWriter, const char *path, int container, int sample_type,
+              uint32_t sample_rate, int channel_count, uint64_t expected_frames)
+{
+    if (strcmp(path, "-") == 0)
+    {
+#if defined(WIN32)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        pWriter->file = stdout;
+        pWriter->owns_file = false;
+    }
+    else
+    {
+        pWriter->file = fopen(path, "wb");
+        if (!pWriter->file) return false;
+        pWriter->owns_file = true;
+    }
+
+    pWriter->container = container;
+    pWriter->sample_type = sample_type;
+    pWriter->sample_rate = sample_rate;
+    pWriter->channel_count = channel_count;
+    pWriter->isa = osc_pick_isa();
+    pWriter->bytes_written = 0;
+    pWriter->failed = false;
+    pWriter->back = 0;
+    pWriter->pending = false;
+    pWriter->quit = false;
+    resampler_init(&pWriter->resampler, sample_rate, sample_rate, channel_count, RESAMPLE_MEDIUM, pWriter->isa);
+    pWriter->dither = OutputDither();
+    for (auto& buffer : pWriter->buffers)
+    {
+        buffer.clear();
+        buffer.reserve(PCM_FLUSH_SIZE + 4096);
+    }
+
+    if (container == PCM_CONTAINER_WAV)
+    {
+        uint8_t header[WAV_EXTENSIBLE_HEADER_SIZE];
+        uint64_t data_size = expected_frames * channel_count * output_sample_size(sample_type);
+        make_wav_header(header, pWriter, expected_frames ? data_size : 0xFFFFFFFF);
+        pWriter->buffers[0].insert(pWriter->buffers[0].end(), header, header + wav_header_size(pWriter));
+    }
+
+    pWriter->thread = std::thread(writer_thread, pWriter);
+    return true;
+}
+
+bool pcm_resample_from(PcmWriter *pWriter, uint32_t source_rate, int quality, int isa)
+{
+    pWriter->isa = isa;
+    if (!resampler_init(&pWriter->resampler, source_rate, pWriter->sample_rate, pWriter->channel_count, quality,
+                        isa))
+    {
+        return false;
+    }
+    pWriter->resampled.resize((size_t)PCM_RESAMPLE_FRAMES * pWriter->channel_count);
+    return true;
+}
+
+void pcm_set_dither(PcmWriter *pWriter, bool enabled)
+{
+    pWriter->dither.enabled = enabled;
+}
+
+static void convert(PcmWriter *pWriter, const float *pFrames, int frameCount)
+{
+    auto& buffer = pWriter->buffers[pWriter->back];
+    int sampleCount = frameCount * pWriter->channel_count;
+    size_t offset = buffer.size();
+
+    buffer.resize(offset + (size_t)sampleCount * output_sample_size(pWriter->sample_type));
+    output_convert(pFrames, pWriter->channel_count, frameCount, pWriter->channel_count,
+                   pWriter->sample_type, &pWriter->dither, pWriter->isa, buffer.data() + offset);
+
+    if (buffer.size() >= PCM_FLUSH_SIZE)
+    {
+        flush_back_buffer(pWriter);
+    }
+}
+
+// Converts every frame the resampler can produce so far
+static void drain_resampler(PcmWriter *pWriter)
+{
+    while (uint32_t frameCount = resampler_read(&pWriter->resampler, pWriter->resampled.data(), PCM_RESAMPLE_FRAMES))
+    {
+        convert(pWriter, pWriter->resampled.data(), (int)frameCount);
+    }
+}
+
+bool pcm_write(PcmWriter *pWriter, const float *pFrames, int frameCount)
+{
+    if (pWriter->resampler.taps == 0)
+    {
+        convert(pWriter, pFrames, frameCount);
+    }
+    else
+    {
+        resampler_write(&pWriter->resampler, pFrames, (uint32_t)frameCount);
+        drain_resampler(pWriter);
+    }
+    return !pWriter->failed.load(std::memory_order_relaxed);
+}
+
+bool pcm_close(PcmWriter *pWriter)
+{
+    if (!pWriter->file) return false;
+
+    if (pWriter->resampler.taps > 0)
+    {
+        resampler_end(&pWriter->resampler);
+        drain_resampler(pWriter);
+    }
+    flush_back_buffer(pWriter);
+    {
+        std::lock_guard<std::mutex> lock(pWriter->mutex);
+        pWriter->quit = true;
+        pWriter->cv.notify_all();
+    }
+    pWriter->thread.join();
+
+    if (pWriter->container == PCM_CONTAINER_WAV)
+    {
+        // RIFF chunks are word aligned
+        uint32_t header_size = wav_header_size(pWriter);
+        uint64_t data_size = pWriter->bytes_written - header_size;
+        if ((data_size & 1) && fputc(0, pWriter->file) == EOF) pWriter->failed = true;
+
+        // Now that we know the real size, fix the header if we can seek back to it
+        if (pWriter->owns_file && fseek(pWriter->file, 0, SEEK_SET) == 0)
+        {
+            uint8_t header[WAV_EXTENSIBLE_HEADER_SIZE];
+            make_wav_header(header, pWriter, data_size);
+            if (fwrite(header, 1, header_size, pWriter->file) != header_size) pWriter->failed = true;
+        }
+    }
+
+    if (fflush(pWriter->file) != 0) pWriter->failed = true;
+    if (pWriter->owns_file) fclose(pWriter->file);
+    pWriter->file = nullptr;
+
+    return !pWriter->failed;
+}
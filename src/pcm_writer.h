@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "output_stage.h"
+#include "resampler.h"
+
+#define PCM_CONTAINER_WAV 0
+#define PCM_CONTAINER_RAW 1
+
+// Double buffered asynchronous PCM file writer. The render thread converts
+// into the back buffer while the writer thread flushes the front one, so disk
+// (or pipe) latency never stalls synthesis.
+struct PcmWriter
+{
+    FILE *file = nullptr;
+    bool owns_file = false;
+    int container = PCM_CONTAINER_WAV;
+    int sample_type = SAMPLE_S16;
+    uint32_t sample_rate = 0;
+    int channel_count = 0;
+    int isa = 0;                    // OSC_ISA_* of the kernels, see pcm_resample_from()
+    uint64_t bytes_written = 0;
+    std::atomic<bool> failed{false};  // Also set by the writer thread
+
+    Resampler resampler;            // From the rate frames are written at, see pcm_resample_from()
+    std::vector<float> resampled;
+    OutputDither dither;
+
+    std::vector<uint8_t> buffers[2];
+    size_t pending_size = 0;  // Bytes in the buffer handed to the writer thread
+    int back = 0;             // Buffer the render thread is filling
+    bool pending = false;
+    bool quit = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread thread;
+};
+
+// sample_type is SAMPLE_*, path "-" writes to stdout. expected_frames is used for the WAV header when
+// the output can't be seeked back into (pipes), pass 0 if unknown.
+bool pcm_open(PcmWriter *pWriter, const char *path, int container, int sample_type,
+              uint32_t sample_rate, int channel_count, uint64_t expected_frames);
+
+// Frames written from now on are at source_rate, and get resampled to the
+// file's rate, nothing to do when both match. They're converted with the
+// kernels for isa, from osc_pick_isa(), instead of the best ones.
+bool pcm_resample_from(PcmWriter *pWriter, uint32_t source_rate, int quality, int isa);
+
+// TPDF dither for the integer sample types
+void pcm_set_dither(PcmWriter *pWriter, bool enabled);
+
+bool pcm_write(PcmWriter *pWriter, const float *pFrames, int frameCount);
+bool pcm_close(PcmWriter *pWriter);
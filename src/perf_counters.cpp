@@ -0,0 +1,205 @@
+#include "perf_counters.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+
+#if defined(WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#endif
+
+void perf_reset(PerfCounters *pCounters)
+{
+    for (int i = 0; i < PERF_BUCKETS; ++i)
+    {
+        pCounters->load_histogram[i] = 0;
+    }
+    pCounters->load_max = 0.0f;
+    pCounters->renders = 0;
+    pCounters->events = 0;
+    pCounters->active_voices = 0;
+    pCounters->peak_voices = 0;
+    pCounters->progress = 0.0f;
+    pCounters->underruns = 0;
+    pCounters->underrun_frames = 0;
+    pCounters->refills = 0;
+    pCounters->min_fill = UINT32_MAX;
+    pCounters->live_events = 0;
+    pCounters->live_late = 0;
+    pCounters->live_latency_total = 0.0;
+    pCounters->live_latency_max = 0.0;
+}
+
+void perf_record_render(PerfCounters *pCounters, double renderSeconds, double audioSeconds)
+{
+    double load = audioSeconds > 0.0 ? renderSeconds / audioSeconds : 0.0;
+    int bucket = std::min(PERF_BUCKETS - 1, (int)(load / PERF_BUCKET_STEP));
+
+    // Single writer, no need for read-modify-write atomics
+    pCounters->load_histogram[bucket].store(pCounters->load_histogram[bucket].load(std::memory_order_relaxed) + 1,
+                                            std::memory_order_relaxed);
+    if (load > pCounters->load_max.load(std::memory_order_relaxed))
+    {
+        pCounters->load_max.store((float)load, std::memory_order_relaxed);
+    }
+    pCounters->renders.store(pCounters->renders.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+double perf_load_percentile(const uint32_t *pHistogram, double fraction)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < PERF_BUCKETS; ++i)
+    {
+        total += pHistogram[i];
+    }
+    if (total == 0) return 0.0;
+
+    uint64_t target = (uint64_t)(fraction * total + 0.5);
+    uint64_t count = 0;
+    for (int i = 0; i < PERF_BUCKETS; ++i)
+    {
+        count += pHistogram[i];
+        if (count >= std::max<uint64_t>(target, 1)) return (i + 1) * PERF_BUCKET_STEP;
+    }
+    return PERF_BUCKETS * PERF_BUCKET_STEP;
+}
+
+// What gets compared between two reports
+struct PerfSample
+{
+    uint32_t histogram[PERF_BUCKETS];
+    uint64_t events;
+    double time;
+};
+
+static void take_sample(const PerfCounters *pCounters, double time, PerfSample *pSample)
+{
+    for (int i = 0; i < PERF_BUCKETS; ++i)
+    {
+        pSample->histogram[i] = pCounters->load_histogram[i].load(std::memory_order_relaxed);
+    }
+    pSample->events = pCounters->events.load(std::memory_order_relaxed);
+    pSample->time = time;
+}
+
+static void print_bar(float progress)
+{
+    printf("\r");
+    int percent = (int)(progress * 70.0f);
+    for (int i = 0; i < percent; ++i)
+    {
+        printf("-");
+    }
+    printf("|");
+    for (int i = percent + 1; i < 70; ++i)
+    {
+        printf("-");
+    }
+    fflush(stdout);
+}
+
+// Covers what happened between from and to, the whole run when final
+static void print_report(const PerfReporter *pReporter, const PerfSample& from, const PerfSample& to, bool final)
+{
+    const PerfCounters *pCounters = pReporter->pCounters;
+    uint32_t histogram[PERF_BUCKETS];
+    for (int i = 0; i < PERF_BUCKETS; ++i)
+    {
+        histogram[i] = to.histogram[i] - from.histogram[i];
+    }
+
+    double maxLoad = pCounters->load_max;
+    double p50 = std::min(maxLoad, perf_load_percentile(histogram, 0.5));
+    double p99 = std::min(maxLoad, perf_load_percentile(histogram, 0.99));
+    double elapsed = std::max(to.time - from.time, 1e-9);
+    double eventRate = (to.events - from.events) / elapsed;
+    uint32_t underruns = pCounters->underruns;
+    double silence = pCounters->underrun_frames * 1000.0 / pReporter->sample_rate;
+    uint64_t liveEvents = pCounters->live_events;
+    double liveAvg = pCounters->live_latency_total * 1000.0 / (double)std::max<uint64_t>(liveEvents, 1);
+    double liveMax = pCounters->live_latency_max * 1000.0;
+
+    if (pReporter->format == PERF_FORMAT_JSON)
+    {
+        printf("{\"final\": %s, \"time\": %.3f, \"progress\": %.4f, \"load_p50\": %.3f, \"load_p99\": %.3f, "
+               "\"load_max\": %.3f, \"underruns\": %u, \"underrun_ms\": %.1f, \"events_per_sec\": %.1f, "
+               "\"active_voices\": %i, \"peak_voices\": %i, \"live_events\": %llu, \"live_late\": %u, "
+               "\"live_latency_avg_ms\": %.3f, \"live_latency_max_ms\": %.3f}\n",
+               final ? "true" : "false", to.time, (float)pCounters->progress, p50, p99, maxLoad, underruns, silence,
+               eventRate, (int)pCounters->active_voices, (int)pCounters->peak_voices, (unsigned long long)liveEvents,
+               (unsigned)pCounters->live_late, liveAvg, liveMax);
+    }
+    else if (pReporter->format == PERF_FORMAT_TEXT || final)
+    {
+        if (pReporter->format == PERF_FORMAT_BAR) printf("\n");
+        printf("%s%7.1fs %3i%%: load p50 %.0f%%, p99 %.0f%%, max %.0f%%, %u underruns, %.0f events/s, %i voices (peak %i)",
+               final ? "Total " : "", to.time, (int)(pCounters->progress * 100.0f), p50 * 100.0, p99 * 100.0,
+               maxLoad * 100.0, underruns, eventRate, (int)pCounters->active_voices, (int)pCounters->peak_voices);
+        if (liveEvents > 0) printf(", live latency %.2fms avg, %.2fms max", liveAvg, liveMax);
+        printf("\n");
+    }
+    else
+    {
+        print_bar(pCounters->progress);
+    }
+    fflush(stdout);
+}
+
+static void lower_priority()
+{
+#if defined(WIN32)
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(__linux__)
+    // Per thread on Linux
+    setpriority(PRIO_PROCESS, 0, 10);
+#endif
+}
+
+static void report_loop(PerfReporter *pReporter)
+{
+    lower_priority();
+
+    auto start = std::chrono::steady_clock::now();
+    auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(pReporter->interval));
+
+    PerfSample first, previous, current;
+    take_sample(pReporter->pCounters, 0.0, &first);
+    previous = first;
+
+    std::unique_lock<std::mutex> lock(pReporter->mutex);
+    while (!pReporter->wake.wait_for(lock, period, [&] { return pReporter->quit; }))
+    {
+        double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        take_sample(pReporter->pCounters, time, &current);
+        print_report(pReporter, previous, current, false);
+        previous = current;
+    }
+
+    double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    take_sample(pReporter->pCounters, time, &current);
+    print_report(pReporter, first, current, true);
+}
+
+void perf_report_start(PerfReporter *pReporter, const PerfCounters *pCounters, uint32_t sampleRate,
+                       int format, double interval)
+{
+    pReporter->pCounters = pCounters;
+    pReporter->sample_rate = sampleRate;
+    pReporter->format = format;
+    pReporter->interval = interval;
+    pReporter->quit = false;
+    pReporter->thread = std::thread(report_loop, pReporter);
+}
+
+void perf_report_stop(PerfReporter *pReporter)
+{
+    {
+        std::lock_guard<std::mutex> lock(pReporter->mutex);
+        pReporter->quit = true;
+    }
+    pReporter->wake.notify_one();
+    if (pReporter->thread.joinable()) pReporter->thread.join();
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Render load histogram, time spent rendering over the duration of the audio
+// rendered, in 1% steps. The last bucket holds everything above 200%.
+#define PERF_BUCKETS 201
+#define PERF_BUCKET_STEP 0.01
+
+#define PERF_FORMAT_BAR 0   // Only the progress bar
+#define PERF_FORMAT_TEXT 1
+#define PERF_FORMAT_JSON 2
+
+// Written by the render thread and the device callback, each counter by a
+// single side, and read by the reporter while they run.
+struct PerfCounters
+{
+    std::atomic<uint32_t> load_histogram[PERF_BUCKETS];
+    std::atomic<float> load_max;
+    std::atomic<uint64_t> renders;
+    std::atomic<uint64_t> events;           // Dispatched by the player
+    std::atomic<int> active_voices;
+    std::atomic<int> peak_voices;
+    std::atomic<float> progress;
+
+    std::atomic<uint32_t> underruns;        // Device reads that came up short
+    std::atomic<uint64_t> underrun_frames;  // Silence played because of them
+    std::atomic<uint32_t> refills;          // Times the render thread topped the ring up
+    std::atomic<uint32_t> min_fill;         // Lowest fill seen by the device, in frames
+
+    std::atomic<uint64_t> live_events;      // Live events handed to the device
+    std::atomic<uint32_t> live_late;        // Arrived too late to keep their timing
+    std::atomic<double> live_latency_total; // Seconds from arrival to the device, summed
+    std::atomic<double> live_latency_max;
+};
+
+void perf_reset(PerfCounters *pCounters);
+
+// One render of audioSeconds worth of audio, which took renderSeconds
+void perf_record_render(PerfCounters *pCounters, double renderSeconds, double audioSeconds);
+
+// Load at or below which a fraction of the renders were, from the histogram
+double perf_load_percentile(const uint32_t *pHistogram, double fraction);
+
+// Low priority thread printing the counters to stdout every interval seconds,
+// keeping console output away from the render and device threads.
+struct PerfReporter
+{
+    const PerfCounters *pCounters = nullptr;
+    uint32_t sample_rate = 0;
+    int format = PERF_FORMAT_BAR;
+    double interval = 1.0;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool quit = false;
+};
+
+void perf_report_start(PerfReporter *pReporter, const PerfCounters *pCounters, uint32_t sampleRate,
+                       int format, double interval);
+
+// Prints a last report covering the whole run
+void perf_report_stop(PerfReporter *pReporter);
@@ -0,0 +1,881 @@
+#include "player.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "output_stage.h"
+#include "wavetables.h"
+
+// Note frequencies
+const float NOTE_FREQS[] = {
+    16.35f, // C0
+    17.32f, // C#0
+    18.35f, // D0
+    19.45f, // D#0
+    20.60f, // E0
+    21.83f, // F0
+    23.12f, // F#0
+    24.50f, // G0
+    25.96f, // G#0
+    27.50f, // A0
+    29.14f, // A#0
+    30.87f, // B0
+    32.70f, // C1
+    34.65f,
+    36.71f,
+    38.89f,
+    41.20f,
+    43.65f,
+    46.25f,
+    49.00f,
+    51.91f,
+    55.00f,
+    58.27f,
+    61.74f,
+    65.41f, // C2
+    69.30f,
+    73.42f,
+    77.78f,
+    82.41f,
+    87.31f,
+    92.50f,
+    98.00f,
+    103.83f,
+    110.00f,
+    116.54f,
+    123.47f,
+    130.81f, // C3
+    138.59f,
+    146.83f,
+    155.56f,
+    164.81f,
+    174.61f,
+    185.00f,
+    196.00f,
+    207.65f,
+    220.00f,
+    233.08f,
+    246.94f,
+    261.63f, // C4
+    277.18f,
+    293.66f,
+    311.13f,
+    329.63f,
+    349.23f,
+    369.99f,
+    392.00f,
+    415.30f,
+    440.00f,
+    466.16f,
+    493.88f,
+    523.25f, // C5
+    554.37f,
+    587.33f,
+    622.25f,
+    659.25f,
+    698.46f,
+    739.99f,
+    783.99f,
+    830.61f,
+    880.00f,
+    932.33f,
+    987.77f,
+    1046.50f, // C6
+    1108.73f,
+    1174.66f,
+    1244.51f,
+    1318.51f,
+    1396.91f,
+    1479.98f,
+    1567.98f,
+    1661.22f,
+    1760.00f,
+    1864.66f,
+    1975.53f,
+    2093.00f, // C7
+    2217.46f,
+    2349.32f,
+    2489.02f,
+    2637.02f,
+    2793.83f,
+    2959.96f,
+    3135.96f,
+    3322.44f,
+    3520.00f,
+    3729.31f,
+    3951.07f,
+    4186.01f, // C8
+    4434.92f,
+    4698.63f,
+    4978.03f,
+    5274.04f,
+    5587.65f,
+    5919.91f,
+    6271.93f,
+    6644.88f,
+    7040.00f,
+    7458.62f,
+    7902.13f
+};
+static const int NOTE_C4 = 12 * 4;
+const int NOTE_COUNT = sizeof(NOTE_FREQS) / sizeof(float);
+
+const VoiceRoute DEFAULT_ROUTES[VOICE_CHANNELS] = {
+    { VOICE_PULSE, 0x80000000, 1 },
+    { VOICE_TRIANGLE, 0x80000000, 2 },
+    { VOICE_NOISE, 0x80000000, 0 },
+    { VOICE_PULSE, 0x80000000, 1 },
+    { VOICE_PULSE, 0x80000000, 1 },
+    { VOICE_PULSE, 0x80000000, 1 },
+    { VOICE_PULSE, 0x80000000, 1 },
+    { VOICE_PULSE, 0x80000000, 1 },
+    { VOICE_PULSE, 0x80000000, 1 },
+    { VOICE_NOISE, 0x80000000, 0 },
+    { VOICE_PULSE, 0x80000000, 1 },
+    { VOICE_PULSE, 0x80000000, 1 },
+    { VOICE_PULSE, 0x80000000, 1 },
+    { VOICE_PULSE, 0x80000000, 1 },
+    { VOICE_PULSE, 0x80000000, 1 },
+    { VOICE_PULSE, 0x80000000, 1 },
+};
+
+static void init_voices(Player *pPlayer)
+{
+    uint32_t sample_rate = pPlayer->config.sample_rate;
+    pPlayer->voice_sustain[VOICE_PULSE] = osc_vol((float)(0.75 / (double)sample_rate));
+    pPlayer->voice_sustain[VOICE_TRIANGLE] = pPlayer->voice_sustain[VOICE_PULSE];
+    pPlayer->voice_sustain[VOICE_NOISE] = osc_vol((float)(8 / (double)sample_rate));
+}
+
+static void set_voice_note(Player *pPlayer, Voice *pVoice, int note_id)
+{
+    pVoice->note_id = note_id;
+    if (pPlayer->config.apu)
+    {
+        apu_note(&pVoice->apu, pVoice->type, note_id, NOTE_FREQS[note_id], pVoice->osc.duty,
+                 pPlayer->config.sample_rate);
+    }
+    if (pVoice->type == VOICE_NOISE)
+    {
+        osc_noise_note(&pVoice->osc, note_id, pPlayer->config.sample_rate);
+    }
+    else
+    {
+        pVoice->osc.step = osc_step(NOTE_FREQS[note_id], pPlayer->config.sample_rate);
+        if (pPlayer->config.pWavetables && !pPlayer->config.apu)
+        {
+            int shape = pVoice->type == VOICE_TRIANGLE ? WT_TRIANGLE : wt_pulse_shape(pVoice->osc.duty);
+            pVoice->pTable = wt_get(pPlayer->config.pWavetables, shape, note_id);
+        }
+    }
+}
+
+static void note_on(Player *pPlayer, int channel, int note, float vel)
+{
+    int note_id = note - 60 + NOTE_C4;
+    if (note_id < 0 || note_id >= NOTE_COUNT) return;
+
+    const VoiceRoute& route = pPlayer->config.routes[channel];
+    Voice stolen;
+    Voice *pVoice = pool_note_on(&pPlayer->voice_pool, channel, note_id, route.priority, &stolen);
+    if (!pVoice) return;
+    if (stolen.channel >= 0 && pPlayer->config.apu)
+    {
+        apu_release(&stolen.apu, &pPlayer->apu_channels[stolen.channel]);
+    }
+
+    pVoice->type = route.type;
+    pVoice->osc.duty = route.duty;
+    pVoice->osc.sustain = pPlayer->voice_sustain[route.type];
+    set_voice_note(pPlayer, pVoice, note_id);
+    pVoice->osc.vol = osc_vol(vel);
+}
+
+// The APU core also steps the voice back to 0 on the next span
+static void release_voice(Player *pPlayer, Voice *pVoice)
+{
+    if (pPlayer->config.apu)
+    {
+        apu_release(&pVoice->apu, &pPlayer->apu_channels[pVoice->channel]);
+    }
+    pool_release(&pPlayer->voice_pool, pVoice);
+}
+
+static void note_off(Player *pPlayer, int channel, int note)
+{
+    Voice *pVoice = pool_find(&pPlayer->voice_pool, channel, note - 60 + NOTE_C4);
+    if (pVoice)
+    {
+        release_voice(pPlayer, pVoice);
+    }
+}
+
+static void save_snapshot(Player *pPlayer, Snapshot *pSnapshot)
+{
+    auto& voice_pool = pPlayer->voice_pool;
+    auto& cursors = pPlayer->event_stream.cursors;
+    pSnapshot->sample = pPlayer->playback_samples;
+    pSnapshot->volume = pPlayer->volume;
+    pSnapshot->voice_serial = voice_pool.serial;
+    pSnapshot->voice_count = voice_pool.active_count;
+    pSnapshot->first_voice = pPlayer->snapshot_voices.size();
+    for (int i = 0; i < voice_pool.active_count; ++i)
+    {
+        pPlayer->snapshot_voices.push_back(voice_pool.voices[voice_pool.active[i]]);
+    }
+
+    pSnapshot->first_cursor = pPlayer->snapshot_cursors.size();
+    pPlayer->snapshot_cursors.insert(pPlayer->snapshot_cursors.end(), cursors.begin(), cursors.end());
+
+    pSnapshot->loop_offset = pPlayer->loop_offset;
+    pSnapshot->loop_pass = pPlayer->loop_pass;
+    pSnapshot->loop_saved = pPlayer->loop_saved;
+
+    pSnapshot->first_apu = pPlayer->snapshot_apu.size();
+    if (pPlayer->config.apu)
+    {
+        pPlayer->snapshot_apu.insert(pPlayer->snapshot_apu.end(), pPlayer->apu_channels,
+                                     pPlayer->apu_channels + VOICE_CHANNELS);
+    }
+}
+
+// The current sustain is kept, it depends on the output rate only
+static void restore_snapshot(Player *pPlayer, const Snapshot *pSnapshot)
+{
+    auto& voice_pool = pPlayer->voice_pool;
+    pPlayer->playback_samples = pSnapshot->sample;
+    pPlayer->song_ended = false;
+    pPlayer->volume = pSnapshot->volume;
+    pPlayer->loop_offset = pSnapshot->loop_offset;
+    pPlayer->loop_pass = pSnapshot->loop_pass;
+    pPlayer->loop_saved = pSnapshot->loop_saved;
+    pool_restore(&voice_pool, pPlayer->snapshot_voices.data() + pSnapshot->first_voice, pSnapshot->voice_count,
+                 pSnapshot->voice_serial);
+    for (int i = 0; i < voice_pool.active_count; ++i)
+    {
+        Voice *pVoice = voice_pool.voices + voice_pool.active[i];
+        pVoice->osc.sustain = pPlayer->voice_sustain[pVoice->type];
+    }
+
+    stream_restore(&pPlayer->event_stream, pPlayer->snapshot_cursors.data() + pSnapshot->first_cursor);
+    if (pPlayer->config.apu)
+    {
+        std::copy(pPlayer->snapshot_apu.begin() + pSnapshot->first_apu,
+                  pPlayer->snapshot_apu.begin() + pSnapshot->first_apu + VOICE_CHANNELS, pPlayer->apu_channels);
+    }
+}
+
+// Saves a snapshot the first time playback goes SNAPSHOT_INTERVAL past the
+// previous one, at the end of the index or in a gap left by a rate change
+static void index_position(Player *pPlayer)
+{
+    auto& snapshots = pPlayer->snapshots;
+    if (pPlayer->live || pPlayer->loop_pass != 0) return;
+
+    size_t& index = pPlayer->snapshot_index;
+    while (index + 1 < snapshots.size() && snapshots[index + 1].sample <= pPlayer->playback_samples) ++index;
+    if (pPlayer->playback_samples >= snapshots[index].sample + pPlayer->config.sample_rate * SNAPSHOT_INTERVAL)
+    {
+        ++index;
+        snapshots.insert(snapshots.begin() + index, Snapshot());
+        save_snapshot(pPlayer, &snapshots[index]);
+    }
+}
+
+static void dispatch(Player *pPlayer, const Event& e)
+{
+    pPlayer->event_count++;
+    switch (e.type)
+    {
+        case EVENT_NOTE_ON:
+        {
+            if (e.vel > 0.0f)
+            {
+                note_on(pPlayer, e.channel, e.note, e.vel);
+            }
+            else
+            {
+                // Velocity 0 is a note off
+                note_off(pPlayer, e.channel, e.note);
+            }
+            break;
+        }
+        case EVENT_NOTE_OFF:
+        {
+            note_off(pPlayer, e.channel, e.note);
+            break;
+        }
+        case EVENT_VOLUME:
+        {
+            pPlayer->volume = e.vel;
+            break;
+        }
+        case EVENT_TEMPO:
+        {
+            tempo_map_add(&pPlayer->tempo_map, e.time, (uint32_t)e.note);
+            break;
+        }
+    }
+}
+
+// A loop was found and has passes left
+static bool loop_active(const Player *pPlayer)
+{
+    return pPlayer->loop_end > 0 &&
+           (pPlayer->config.loop_count == PLAYER_LOOP_FOREVER || pPlayer->loop_pass < pPlayer->config.loop_count);
+}
+
+// Loop length in samples, whole so every pass lasts exactly as long
+static uint32_t loop_length(const Player *pPlayer)
+{
+    return tempo_map_tick_to_sample(&pPlayer->tempo_map, pPlayer->loop_end) -
+           tempo_map_tick_to_sample(&pPlayer->tempo_map, pPlayer->loop_start);
+}
+
+// Back to the cursors saved at the loop start. Voices carry on through the
+// seam, the loop start events play on the same sample the end was reached.
+static void wrap_loop(Player *pPlayer)
+{
+    auto& stream = pPlayer->event_stream;
+
+    // Notes ending right on the seam are still released, what starts there
+    // belongs after the loop
+    while (const Event *pNext = stream_peek(&stream))
+    {
+        if (pNext->time != pPlayer->loop_end) break;
+        Event e = *pNext;
+        stream_pop(&stream);
+        if (e.type == EVENT_NOTE_OFF || (e.type == EVENT_NOTE_ON && e.vel == 0.0f)) dispatch(pPlayer, e);
+    }
+
+    pPlayer->loop_offset += loop_length(pPlayer);
+    pPlayer->loop_pass++;
+    stream_restore(&stream, pPlayer->loop_cursors.data());
+}
+
+// Applies the volume decay of the next sample and every event due on it, then
+// returns how many samples can be synthesized before another event is due.
+static uint32_t update_midi(Player *pPlayer)
+{
+    auto& voice_pool = pPlayer->voice_pool;
+    uint32_t now = pPlayer->playback_samples + 1;
+
+    // Voices that faded out go back to the pool, the last active one takes
+    // their slot
+    for (int i = 0; i < voice_pool.active_count;)
+    {
+        Voice *pVoice = voice_pool.voices + voice_pool.active[i];
+        pVoice->osc.vol = std::max<int32_t>(0, pVoice->osc.vol - pVoice->osc.sustain);
+        if (pVoice->osc.vol == 0) release_voice(pPlayer, pVoice);
+        else ++i;
+    }
+
+    // An event due at sample t is consumed by the sample that brings
+    // playback_samples to t, so that's where the current span ends. Spans
+    // are at least 1 sample long, 0 means nothing is coming up.
+    uint32_t span = 0;
+    while (true)
+    {
+        const Event *pNext = stream_peek(&pPlayer->event_stream);
+        if (loop_active(pPlayer))
+        {
+            // Saved before anything on the first tick of the loop plays
+            if (!pPlayer->loop_saved && pNext && pNext->time >= pPlayer->loop_start)
+            {
+                std::copy(pPlayer->event_stream.cursors.begin(), pPlayer->event_stream.cursors.end(),
+                          pPlayer->loop_cursors.begin());
+                pPlayer->loop_saved = true;
+            }
+            if (pPlayer->loop_saved && (!pNext || pNext->time >= pPlayer->loop_end))
+            {
+                uint32_t seam = tempo_map_tick_to_sample(&pPlayer->tempo_map, pPlayer->loop_end) +
+                                pPlayer->loop_offset;
+                if (seam > now)
+                {
+                    span = seam - 1 - pPlayer->playback_samples;
+                    break;
+                }
+                wrap_loop(pPlayer);
+                continue;
+            }
+        }
+        if (!pNext) break;
+
+        // Only converted when it's coming up, the tempo map may still grow
+        uint32_t next_time = tempo_map_tick_to_sample(&pPlayer->tempo_map, pNext->time) + pPlayer->loop_offset;
+        if (next_time > now)
+        {
+            span = next_time - 1 - pPlayer->playback_samples;
+            break;
+        }
+
+        Event e = *pNext;
+        stream_pop(&pPlayer->event_stream);
+        dispatch(pPlayer, e);
+    }
+
+    // Live events right after the song's ones due on the same sample
+    while (pPlayer->live_count > 0)
+    {
+        const Event& e = pPlayer->live_events[pPlayer->live_first];
+        if (e.time > now)
+        {
+            uint32_t live_span = e.time - 1 - pPlayer->playback_samples;
+            span = span ? std::min(span, live_span) : live_span;
+            break;
+        }
+        dispatch(pPlayer, e);
+        pPlayer->live_first = (pPlayer->live_first + 1) & (PLAYER_LIVE_EVENTS - 1);
+        pPlayer->live_count--;
+    }
+    if (span) return span;
+
+    // Nothing left, the song ends with this sample unless it's live
+    return pPlayer->live ? UINT32_MAX : 1;
+}
+
+// Runs the APU voices over a span at offset of the channel passes. Released
+// voices step back to 0 first.
+static void run_apu(Player *pPlayer, ApuPass *pPasses, int offset, int count)
+{
+    auto& voice_pool = pPlayer->voice_pool;
+    for (int c = 0; c < VOICE_CHANNELS; ++c)
+    {
+        apu_flush(pPlayer->apu_channels + c, pPasses + c, offset);
+    }
+    for (int i = 0; i < voice_pool.active_count; ++i)
+    {
+        Voice *pVoice = voice_pool.voices + voice_pool.active[i];
+        apu_run(&pVoice->apu, &pVoice->osc, pVoice->type, pPlayer->apu_channels + pVoice->channel,
+                pPasses + pVoice->channel, offset, count);
+    }
+}
+
+static void skip_voices(Player *pPlayer, int count)
+{
+    auto& voice_pool = pPlayer->voice_pool;
+    if (pPlayer->config.apu)
+    {
+        // Only the steps that reach past the span are kept
+        ApuPass passes[VOICE_CHANNELS];
+        for (int c = 0; c < VOICE_CHANNELS; ++c)
+        {
+            apu_pass_begin(pPlayer->apu_channels + c, passes + c, nullptr, count, nullptr);
+        }
+        run_apu(pPlayer, passes, 0, count);
+        for (int c = 0; c < VOICE_CHANNELS; ++c)
+        {
+            apu_pass_end(pPlayer->apu_channels + c, passes + c);
+        }
+        return;
+    }
+
+    for (int i = 0; i < voice_pool.active_count; ++i)
+    {
+        Voice *pVoice = voice_pool.voices + voice_pool.active[i];
+        if (pVoice->type == VOICE_NOISE) osc_noise_skip(&pVoice->osc, count);
+        else osc_skip(&pVoice->osc, count);
+    }
+}
+
+// Moves playback over a span that was just synthesized or skipped
+static void advance(Player *pPlayer, int count)
+{
+    pPlayer->playback_samples += (uint32_t)count;
+    pPlayer->song_ended = stream_peek(&pPlayer->event_stream) == nullptr && !pPlayer->live &&
+                          pPlayer->live_count == 0 && !(loop_active(pPlayer) && pPlayer->loop_saved);
+}
+
+// Plays up to sample without synthesizing anything. Voices advance the same
+// way they do when they're silent, so the state ends up identical to what
+// rendering would have produced.
+static void fast_forward(Player *pPlayer, uint32_t sample)
+{
+    while (pPlayer->playback_samples < sample && !pPlayer->song_ended)
+    {
+        index_position(pPlayer);
+        uint32_t span = update_midi(pPlayer);
+        int count = (int)std::min<uint32_t>(std::min<uint32_t>(span, sample - pPlayer->playback_samples), INT32_MAX);
+        skip_voices(pPlayer, count);
+        advance(pPlayer, count);
+    }
+}
+
+bool player_open(Player *pPlayer, const char *path, const PlayerConfig& config)
+{
+    if (path && !midi_open(&pPlayer->midi_file, path)) return false;
+    if (path && config.preload && !store_open(&pPlayer->event_store, &pPlayer->midi_file, config.cache_dir))
+    {
+        midi_close(&pPlayer->midi_file);
+        return false;
+    }
+
+    pPlayer->config = config;
+    pPlayer->config.preload = config.preload && path;
+    pPlayer->config.isa = osc_pick_isa(config.isa);
+    pPlayer->kernels = osc_kernels(pPlayer->config.isa);
+    pool_init(&pPlayer->voice_pool, config.voice_count);
+    init_voices(pPlayer);
+    player_reset(pPlayer);
+    return true;
+}
+
+void player_close(Player *pPlayer)
+{
+    midi_close(&pPlayer->midi_file);
+    store_clear(&pPlayer->event_store);
+    pPlayer->snapshots.clear();
+    pPlayer->snapshot_voices.clear();
+    pPlayer->snapshot_cursors.clear();
+    pPlayer->snapshot_apu.clear();
+}
+
+// Loop points from the config, else from the markers, else the whole song
+static void find_loop(Player *pPlayer)
+{
+    const PlayerConfig& config = pPlayer->config;
+    uint32_t start = config.loop_start;
+    uint32_t end = config.loop_end;
+    if (start == 0 && end == 0)
+    {
+        uint32_t lastTick;
+        stream_find_loop(&pPlayer->event_stream, &start, &end, &lastTick);
+        if (start == UINT32_MAX) start = 0;
+        if (end == UINT32_MAX || end <= start) end = lastTick;
+    }
+    if (end <= start) return;
+
+    pPlayer->loop_start = start;
+    pPlayer->loop_end = end;
+    pPlayer->loop_cursors.resize(pPlayer->event_stream.cursors.size());
+}
+
+void player_reset(Player *pPlayer)
+{
+    auto& tempo_map = pPlayer->tempo_map;
+    tempo_map.sample_rate = pPlayer->config.sample_rate;
+    tempo_map.speed = pPlayer->config.speed;
+    tempo_map_clear(&tempo_map, pPlayer->midi_file.division);
+
+    if (pPlayer->config.preload)
+    {
+        stream_init_store(&pPlayer->event_stream, &pPlayer->midi_file, &pPlayer->event_store);
+    }
+    else
+    {
+        stream_init(&pPlayer->event_stream, &pPlayer->midi_file, (int)pPlayer->midi_file.tracks.size());
+    }
+
+    pPlayer->playback_samples = 0;
+    pPlayer->song_ended = false;
+    pPlayer->volume = 1.0f;
+    pPlayer->live_first = 0;
+    pPlayer->live_count = 0;
+    pPlayer->loop_start = 0;
+    pPlayer->loop_end = 0;
+    pPlayer->loop_offset = 0;
+    pPlayer->loop_pass = 0;
+    pPlayer->loop_saved = false;
+    if (pPlayer->config.loop_count != 0) find_loop(pPlayer);
+    pool_init(&pPlayer->voice_pool, pPlayer->voice_pool.capacity);
+    std::fill(pPlayer->channel_stems, pPlayer->channel_stems + VOICE_CHANNELS, -1);
+    for (ApuChannel& channel : pPlayer->apu_channels)
+    {
+        apu_channel_reset(&channel);
+    }
+
+    pPlayer->snapshots.clear();
+    pPlayer->snapshot_voices.clear();
+    pPlayer->snapshot_cursors.clear();
+    pPlayer->snapshot_apu.clear();
+    pPlayer->snapshots.push_back(Snapshot());
+    pPlayer->snapshot_index = 0;
+    save_snapshot(pPlayer, &pPlayer->snapshots.back());
+}
+
+void player_change_rate(Player *pPlayer, uint32_t sample_rate, double speed)
+{
+    double tick = tempo_map_sample_to_tick(&pPlayer->tempo_map, pPlayer->playback_samples - pPlayer->loop_offset);
+    int pass = pPlayer->loop_pass;
+
+    bool rate_changed = sample_rate != pPlayer->config.sample_rate;
+    pPlayer->config.sample_rate = sample_rate;
+    pPlayer->config.speed = speed;
+    tempo_map_build(&pPlayer->tempo_map, sample_rate, speed);
+    if (rate_changed)
+    {
+        auto& voice_pool = pPlayer->voice_pool;
+        init_voices(pPlayer);
+        for (int i = 0; i < voice_pool.active_count; ++i)
+        {
+            Voice *pVoice = voice_pool.voices + voice_pool.active[i];
+            pVoice->osc.sustain = pPlayer->voice_sustain[pVoice->type];
+            set_voice_note(pPlayer, pVoice, pVoice->note_id);
+        }
+    }
+
+    // The cursors stay where they are, events get converted with the new map
+    // as they come up
+    pPlayer->loop_offset = pass > 0 ? (uint32_t)pass * loop_length(pPlayer) : 0;
+    pPlayer->playback_samples = tempo_map_tick_to_sample(&pPlayer->tempo_map, tick) + pPlayer->loop_offset;
+
+    // Snapshots hold sample positions and per sample decays, only the one at
+    // the start still holds, it's saved first in each array
+    pPlayer->snapshots.resize(1);
+    pPlayer->snapshot_index = 0;
+    pPlayer->snapshot_voices.resize(pPlayer->snapshots[0].voice_count);
+    if (rate_changed)
+    {
+        for (Voice& voice : pPlayer->snapshot_voices) set_voice_note(pPlayer, &voice, voice.note_id);
+    }
+    pPlayer->snapshot_cursors.resize(pPlayer->event_stream.cursors.size());
+    pPlayer->snapshot_apu.resize(pPlayer->config.apu ? VOICE_CHANNELS : 0);
+}
+
+bool player_seek(Player *pPlayer, uint32_t sample)
+{
+    auto& snapshots = pPlayer->snapshots;
+    if (snapshots.empty()) return false;
+
+    auto it = std::upper_bound(snapshots.begin(), snapshots.end(), sample,
+                               [](uint32_t s, const Snapshot& snapshot) { return s < snapshot.sample; });
+    pPlayer->snapshot_index = (size_t)(it - 1 - snapshots.begin());
+    restore_snapshot(pPlayer, &*(it - 1));
+    fast_forward(pPlayer, sample);
+    return true;
+}
+
+int player_render(Player *pPlayer, int frameCount, int channelCount, float *pOut)
+{
+    static const int MIX_FRAMES = 1024;
+    float mix[MIX_FRAMES];
+    int32_t deltas[MIX_FRAMES];
+    ApuPass passes[VOICE_CHANNELS];
+    int rendered = 0;
+    auto& voice_pool = pPlayer->voice_pool;
+    const bool apu = pPlayer->config.apu;
+
+    for (int offset = 0; offset < frameCount; offset += MIX_FRAMES)
+    {
+        int mixCount = std::min<int>(MIX_FRAMES, frameCount - offset);
+        memset(mix, 0, sizeof(float) * mixCount);
+
+        // Every channel steps into the same deltas, only their tails stay apart
+        int32_t acc = 0;
+        if (apu)
+        {
+            memset(deltas, 0, sizeof(int32_t) * mixCount);
+            for (int c = 0; c < VOICE_CHANNELS; ++c)
+            {
+                apu_pass_begin(pPlayer->apu_channels + c, passes + c, deltas, mixCount, &acc);
+            }
+        }
+
+        int pos = 0;
+        while (pos < mixCount && !pPlayer->song_ended)
+        {
+            index_position(pPlayer);
+            uint32_t span = update_midi(pPlayer);
+            int count = (int)std::min<uint32_t>(span, (uint32_t)(mixCount - pos));
+
+            if (apu)
+            {
+                run_apu(pPlayer, passes, pos, count);
+                apu_integrate(deltas + pos, count, &acc, mix + pos);
+            }
+            for (int i = 0; i < voice_pool.active_count && !apu; ++i)
+            {
+                Voice *pVoice = voice_pool.voices + voice_pool.active[i];
+                if (pVoice->pTable)
+                {
+                    wt_render(pVoice->pTable, &pVoice->osc, mix + pos, count);
+                    continue;
+                }
+                switch (pVoice->type)
+                {
+                    case VOICE_PULSE: pPlayer->kernels.pulse(&pVoice->osc, mix + pos, count); break;
+                    case VOICE_TRIANGLE: pPlayer->kernels.triangle(&pVoice->osc, mix + pos, count); break;
+                    case VOICE_NOISE: osc_noise(&pVoice->osc, mix + pos, count); break;
+                }
+            }
+
+            // Volume only changes on events, so it's constant over the span
+            float gain = pPlayer->volume * MAX_VOLUME;
+            for (int i = pos; i < pos + count; ++i)
+            {
+                mix[i] = std::max<float>(-1.0f, std::min<float>(1.0f, mix[i])) * gain;
+            }
+
+            pos += count;
+            advance(pPlayer, count);
+        }
+        rendered += pos;
+
+        for (int c = 0; c < VOICE_CHANNELS && apu; ++c)
+        {
+            apu_pass_end(pPlayer->apu_channels + c, passes + c);
+        }
+
+        output_convert(mix, 1, mixCount, channelCount, SAMPLE_F32, nullptr, pPlayer->config.isa,
+                       pOut + offset * channelCount);
+    }
+
+    return rendered;
+}
+
+// Stem of the channel, added the first time it plays. With the APU core
+// the stem also gets a row of steps, fed by the channel pass.
+static int channel_stem(Player *pPlayer, StemBatch *pBatch, int channel, ApuPass *pPasses)
+{
+    int& stem = pPlayer->channel_stems[channel];
+    if (stem < 0)
+    {
+        stem = stems_add_stem(pBatch, channel);
+        if (pPlayer->config.apu)
+        {
+            int32_t *pRow = pBatch->apu_deltas.data() + (size_t)stem * pBatch->apu_stride;
+            std::fill(pRow, pRow + pBatch->apu_stride, 0);
+            pPasses[channel].pMix = pRow;
+        }
+    }
+    return stem;
+}
+
+static bool apu_channel_busy(const ApuChannel *pChannel)
+{
+    if (pChannel->level != 0 || pChannel->flush != 0) return true;
+    return std::any_of(pChannel->pending, pChannel->pending + APU_BLEP_TAPS, [](int32_t tap) { return tap != 0; });
+}
+
+// Channels still sounding get their stem before the pass starts
+static void plan_apu_begin(Player *pPlayer, StemBatch *pBatch, int frameCount, ApuPass *pPasses, int32_t *pAccs)
+{
+    pBatch->apu = true;
+    pBatch->apu_stride = frameCount;
+    pBatch->apu_deltas.resize((size_t)VOICE_CHANNELS * frameCount);
+    for (int c = 0; c < VOICE_CHANNELS; ++c)
+    {
+        const ApuChannel *pChannel = pPlayer->apu_channels + c;
+        int stem = pPlayer->channel_stems[c];
+        if (stem < 0 && !apu_channel_busy(pChannel))
+        {
+            apu_pass_begin(pChannel, pPasses + c, nullptr, frameCount, nullptr);
+            continue;
+        }
+
+        stem = channel_stem(pPlayer, pBatch, c, pPasses);
+        int32_t *pRow = pBatch->apu_deltas.data() + (size_t)stem * frameCount;
+        std::fill(pRow, pRow + frameCount, 0);
+        apu_pass_begin(pChannel, pPasses + c, pRow, frameCount, pAccs + stem);
+    }
+}
+
+// Integrated value of each stem at the start of each block, so the workers
+// can integrate the blocks in any order
+static void plan_apu_end(Player *pPlayer, StemBatch *pBatch, int frameCount, ApuPass *pPasses, int32_t *pAccs)
+{
+    for (int c = 0; c < VOICE_CHANNELS; ++c)
+    {
+        apu_pass_end(pPlayer->apu_channels + c, pPasses + c);
+    }
+
+    int blockCount = (frameCount + STEM_BLOCK_FRAMES - 1) / STEM_BLOCK_FRAMES;
+    pBatch->apu_block_acc.resize((size_t)blockCount * pBatch->stem_count);
+    for (int stem = 0; stem < pBatch->stem_count; ++stem)
+    {
+        const int32_t *pRow = pBatch->apu_deltas.data() + (size_t)stem * pBatch->apu_stride;
+        int32_t acc = pAccs[stem];
+        for (int block = 0; block < blockCount; ++block)
+        {
+            pBatch->apu_block_acc[(size_t)block * pBatch->stem_count + stem] = acc;
+            int start = block * STEM_BLOCK_FRAMES;
+            int end = std::min(frameCount, start + STEM_BLOCK_FRAMES);
+            for (int i = start; i < end; ++i) acc += pRow[i];
+        }
+    }
+}
+
+int player_plan_stems(Player *pPlayer, StemBatch *pBatch, int frameCount)
+{
+    auto& voice_pool = pPlayer->voice_pool;
+    const bool apu = pPlayer->config.apu;
+    stems_clear(pBatch);
+    pBatch->isa = pPlayer->config.isa;
+
+    // Stems never outnumber the channels
+    ApuPass passes[VOICE_CHANNELS];
+    int32_t accs[VOICE_CHANNELS] = {};
+    if (apu) plan_apu_begin(pPlayer, pBatch, frameCount, passes, accs);
+
+    int pos = 0;
+    while (pos < frameCount && !pPlayer->song_ended)
+    {
+        index_position(pPlayer);
+        uint32_t span = update_midi(pPlayer);
+        int blockEnd = std::min<int>(frameCount, (pos / STEM_BLOCK_FRAMES + 1) * STEM_BLOCK_FRAMES);
+        int count = (int)std::min<uint32_t>(span, (uint32_t)(blockEnd - pos));
+
+        for (int i = 0; i < voice_pool.active_count; ++i)
+        {
+            Voice *pVoice = voice_pool.voices + voice_pool.active[i];
+            int stem = channel_stem(pPlayer, pBatch, pVoice->channel, passes);
+            if (apu) continue;
+
+            StemSpan stemSpan = { pVoice->osc, pVoice->pTable, pVoice->type, stem, (uint32_t)pos, count };
+            stems_add_span(pBatch, stemSpan);
+        }
+        if (apu) run_apu(pPlayer, passes, pos, count);
+        else skip_voices(pPlayer, count);
+        stems_add_gain(pBatch, (uint32_t)pos, count, pPlayer->volume * MAX_VOLUME);
+
+        pos += count;
+        advance(pPlayer, count);
+    }
+
+    if (apu) plan_apu_end(pPlayer, pBatch, pos, passes, accs);
+    return pos;
+}
+
+void player_set_loop(Player *pPlayer, uint32_t startTick, uint32_t endTick, int count)
+{
+    pPlayer->config.loop_start = startTick;
+    pPlayer->config.loop_end = endTick;
+    pPlayer->config.loop_count = count;
+    player_reset(pPlayer);
+}
+
+void player_set_live(Player *pPlayer, bool live)
+{
+    pPlayer->live = live;
+}
+
+bool player_schedule(Player *pPlayer, uint32_t sample, const Event& e)
+{
+    if (pPlayer->live_count >= PLAYER_LIVE_EVENTS) return false;
+
+    // Past samples are played on the next one, which is also where the
+    // previous event may already be waiting
+    sample = std::max(sample, pPlayer->playback_samples + 1);
+    if (pPlayer->live_count > 0)
+    {
+        uint32_t last = (pPlayer->live_first + pPlayer->live_count - 1) & (PLAYER_LIVE_EVENTS - 1);
+        sample = std::max(sample, pPlayer->live_events[last].time);
+    }
+
+    Event& scheduled = pPlayer->live_events[(pPlayer->live_first + pPlayer->live_count) & (PLAYER_LIVE_EVENTS - 1)];
+    scheduled = e;
+    scheduled.time = sample;
+    pPlayer->live_count++;
+    return true;
+}
+
+size_t player_index_size(const Player *pPlayer)
+{
+    return pPlayer->snapshots.size() * sizeof(Snapshot) + pPlayer->snapshot_voices.size() * sizeof(Voice) +
+           pPlayer->snapshot_cursors.size() * sizeof(TrackCursor) + pPlayer->snapshot_apu.size() * sizeof(ApuChannel);
+}
+
+TrackError player_track_error(const Player *pPlayer)
+{
+    return pPlayer->event_store.error.reason ? pPlayer->event_store.error : pPlayer->event_stream.error;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "event_store.h"
+#include "midi_file.h"
+#include "stems.h"
+#include "tempo_map.h"
+#include "voice_pool.h"
+
+#define MAX_VOLUME 0.25f
+
+// Synthesis rate. Players run at this rate whatever the device or output
+// file, so the cost per second and the output are the same everywhere, and
+// a Resampler converts afterwards.
+#define PLAYER_SAMPLE_RATE 44100
+
+// Seek index, the whole playback state every SNAPSHOT_INTERVAL seconds. It's
+// recorded the first time playback goes through a position, since tracks
+// are only decoded while they play.
+#define SNAPSHOT_INTERVAL 1
+
+// Events scheduled ahead with player_schedule(), a power of two
+#define PLAYER_LIVE_EVENTS 256
+
+// PlayerConfig::loop_count that never runs out
+#define PLAYER_LOOP_FOREVER -1
+
+extern const float NOTE_FREQS[];
+extern const int NOTE_COUNT;
+
+// Matches the old one instrument per track layout for files with a tempo
+// track first, plus the General MIDI drum channel.
+extern const VoiceRoute DEFAULT_ROUTES[VOICE_CHANNELS];
+
+struct PlayerConfig
+{
+    uint32_t sample_rate = PLAYER_SAMPLE_RATE;
+    double speed = 1.0;             // Tempo multiplier
+    WavetableCache *pWavetables = nullptr;  // Band-limited pulse and triangle when set, see wt_init()
+    int isa = -1;                   // OSC_ISA_* of the kernels, -1 for the best one
+    bool apu = false;               // 2A03 timers and band-limited steps instead of the kernels
+    int voice_count = VOICE_MAX;
+    bool preload = false;           // Decode the whole file up front into an EventStore
+    const char *cache_dir = nullptr;    // With preload, keeps stores there across runs
+    VoiceRoute routes[VOICE_CHANNELS];
+
+    // Times the loop plays again after the first pass, or PLAYER_LOOP_FOREVER.
+    // The loop goes from loop_start to loop_end, in ticks, or when they're
+    // both 0 from the loopStart and loopEnd markers, by default the start
+    // and the end of the song.
+    int loop_count = 0;
+    uint32_t loop_start = 0;
+    uint32_t loop_end = 0;
+};
+
+struct Snapshot
+{
+    uint32_t sample;
+    float volume;
+    uint32_t voice_serial;
+    int voice_count;
+    size_t first_voice;     // Into snapshot_voices, in active order
+    size_t first_cursor;    // Into snapshot_cursors
+    size_t first_apu;       // Into snapshot_apu, VOICE_CHANNELS of them with config.apu
+    uint32_t loop_offset;
+    int loop_pass;
+    bool loop_saved;
+};
+
+// Everything needed to play one song. Players share no state, any number of
+// them can run on different threads. Only a wavetable cache can be given to
+// several, once built with wt_build_all().
+struct Player
+{
+    PlayerConfig config;            // isa is the one picked
+    OscKernels kernels;
+    MidiFile midi_file;
+    EventStream event_stream;
+    EventStore event_store;         // Only filled with config.preload
+    TempoMap tempo_map;
+    VoicePool voice_pool;
+    int32_t voice_sustain[VOICE_TYPE_COUNT];
+    int channel_stems[VOICE_CHANNELS];  // Stem of each channel, -1 until it plays
+    ApuChannel apu_channels[VOICE_CHANNELS];
+
+    float volume = 1.0f;
+    uint32_t playback_samples = 0;
+    bool song_ended = false;
+    uint64_t event_count = 0;       // Dispatched since opening, seeks included
+
+    bool live = false;              // See player_set_live()
+    Event live_events[PLAYER_LIVE_EVENTS];  // Scheduled, time in samples
+    uint32_t live_first = 0;
+    uint32_t live_count = 0;
+
+    // Looping keeps the sample timeline going, events of later passes are
+    // offset by the length of the passes before
+    uint32_t loop_start = 0;        // Ticks, loop_end is 0 without a loop
+    uint32_t loop_end = 0;
+    uint32_t loop_offset = 0;       // Samples
+    int loop_pass = 0;              // Times wrapped so far
+    bool loop_saved = false;        // loop_cursors hold the stream as it was at loop_start
+    std::vector<TrackCursor> loop_cursors;  // Sized on reset, wrapping doesn't allocate
+
+    std::vector<Snapshot> snapshots;   // By sample
+    size_t snapshot_index = 0;      // Last snapshot at or before playback_samples
+    std::vector<Voice> snapshot_voices;
+    std::vector<TrackCursor> snapshot_cursors;
+    std::vector<ApuChannel> snapshot_apu;
+};
+
+// A null path opens an empty song, to play live events only
+bool player_open(Player *pPlayer, const char *path, const PlayerConfig& config);
+void player_close(Player *pPlayer);
+
+// Back to the start of the song, with an empty seek index. Finds the loop
+// points when config.loop_count asks for a loop.
+void player_reset(Player *pPlayer);
+
+// Loops from startTick to endTick count more times, or PLAYER_LOOP_FOREVER,
+// both ticks 0 to use the markers. Starts over from the beginning of the song.
+void player_set_loop(Player *pPlayer, uint32_t startTick, uint32_t endTick, int count);
+
+// Changes the output rate and/or playback speed on the fly. The current
+// position is kept in ticks, only the tempo map is rebuilt and nothing is
+// replayed. Snapshots past the start were taken on the old timeline, they're
+// dropped and taken again as playback or seeks go through those positions.
+void player_change_rate(Player *pPlayer, uint32_t sample_rate, double speed);
+
+// Restores the closest snapshot before sample, then plays the rest silently.
+// Never replays more than SNAPSHOT_INTERVAL seconds within the indexed part,
+// past it the index gets extended on the way. Only the first pass through a
+// loop is indexed, later ones replay from there.
+bool player_seek(Player *pPlayer, uint32_t sample);
+
+// Returns how many frames were rendered, less than frameCount once the song
+// ended. The rest is silence.
+int player_render(Player *pPlayer, int frameCount, int channelCount, float *pOut);
+
+// Plays the next frameCount frames like player_render() does, but only
+// records what each voice does over each span into the batch instead of
+// synthesizing it. There's one stem per channel. Returns the frame count.
+int player_plan_stems(Player *pPlayer, StemBatch *pBatch, int frameCount);
+
+// While live, the song doesn't end after its last event since more may be
+// scheduled, and playback isn't indexed anymore as seeking back couldn't
+// replay them.
+void player_set_live(Player *pPlayer, bool live);
+
+// Plays e (its time is ignored) once playback reaches sample, or on the next
+// sample if it's already past. Events have to be scheduled in sample order,
+// between renders. Returns false when PLAYER_LIVE_EVENTS are already waiting.
+bool player_schedule(Player *pPlayer, uint32_t sample, const Event& e);
+
+size_t player_index_size(const Player *pPlayer);
+
+// The first track decoding gave up on, while building the event store or
+// playing. Nothing gets printed on the way, reason is nullptr without any.
+TrackError player_track_error(const Player *pPlayer);
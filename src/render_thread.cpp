@@ -0,0 +1,232 @@
+#include "render_thread.h"
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+// Player frames rendered at once before resampling
+#define SCRATCH_FRAMES 1024
+
+// clock_origin until the device read once
+#define CLOCK_UNKNOWN INT64_MIN
+
+static int64_t clock_ns(LiveClock::time_point time)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+// Hands the events that came in over to the player, at their sample
+static void schedule_live(RenderThread *pThread)
+{
+    Player *pPlayer = pThread->pPlayer;
+    PerfCounters *pCounters = &pThread->counters;
+    const Resampler& resampler = pThread->resampler;
+    int64_t origin = pThread->clock_origin.load(std::memory_order_acquire);
+
+    LiveEvent live;
+    while (pPlayer->live_count < PLAYER_LIVE_EVENTS && live_pop(pThread->pLive, &live))
+    {
+        // Ring frame the device was at when the event arrived, before its
+        // first read the ring hasn't started playing yet
+        int64_t frame = 0;
+        if (origin != CLOCK_UNKNOWN)
+        {
+            double elapsed = (double)(clock_ns(live.arrival) - origin) / 1e9;
+            frame = std::max<int64_t>(0, (int64_t)(elapsed * pThread->sample_rate));
+        }
+        frame += pThread->live_delay;
+        uint64_t sample = pThread->start_sample + (uint64_t)frame * resampler.in_rate / resampler.out_rate;
+        if (sample <= pPlayer->playback_samples)
+        {
+            pCounters->live_late.store(pCounters->live_late.load(std::memory_order_relaxed) + 1,
+                                       std::memory_order_relaxed);
+        }
+        player_schedule(pPlayer, (uint32_t)std::min<uint64_t>(sample, UINT32_MAX), live.event);
+
+        // Where it actually landed, rounded up to a ring frame
+        uint32_t last = (pPlayer->live_first + pPlayer->live_count - 1) & (PLAYER_LIVE_EVENTS - 1);
+        uint64_t played = pPlayer->live_events[last].time - pThread->start_sample;
+        uint32_t write = pThread->mark_write.load(std::memory_order_relaxed);
+        if (write - pThread->mark_read.load(std::memory_order_acquire) < RENDER_LIVE_MARKS)
+        {
+            LiveMark& mark = pThread->marks[write & (RENDER_LIVE_MARKS - 1)];
+            mark.frame = (played * resampler.out_rate + resampler.in_rate - 1) / resampler.in_rate;
+            mark.arrival = live.arrival;
+            pThread->mark_write.store(write + 1, std::memory_order_release);
+        }
+    }
+
+    // The song can end once the input did
+    if (pPlayer->live && live_done(pThread->pLive)) player_set_live(pPlayer, false);
+}
+
+static void refill(RenderThread *pThread)
+{
+    Player *pPlayer = pThread->pPlayer;
+    RingBuffer *pRing = &pThread->ring;
+    PerfCounters *pCounters = &pThread->counters;
+    Resampler *pResampler = &pThread->resampler;
+
+    uint32_t fill = ring_readable(pRing);
+    if (pThread->finished || fill >= pThread->lookahead) return;
+
+    uint32_t remaining = pThread->lookahead - fill;
+    while (remaining > 0)
+    {
+        uint32_t frameCount = 0;
+        float *pOut = ring_write_begin(pRing, &frameCount);
+        frameCount = std::min(frameCount, remaining);
+        if (frameCount == 0) break;
+
+        auto start = std::chrono::steady_clock::now();
+        uint32_t needed = resampler_input_needed(pResampler, frameCount);
+        while (needed > 0 && !pPlayer->song_ended)
+        {
+            uint32_t chunk = std::min<uint32_t>(needed, SCRATCH_FRAMES);
+            if (pThread->pLive) schedule_live(pThread);
+            int rendered = player_render(pPlayer, (int)chunk, pRing->channel_count, pThread->scratch.data());
+            resampler_write(pResampler, pThread->scratch.data(), (uint32_t)rendered);
+            needed -= chunk;
+        }
+        if (pPlayer->song_ended) resampler_end(pResampler);
+        uint32_t written = resampler_read(pResampler, pOut, frameCount);
+        double renderTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        ring_write_end(pRing, written);
+        perf_record_render(pCounters, renderTime, (double)frameCount / pThread->sample_rate);
+        remaining -= frameCount;
+
+        if (resampler_done(pResampler))
+        {
+            pThread->finished = true;
+            break;
+        }
+    }
+    // Single writer, no need for read-modify-write atomics
+    int voices = pPlayer->voice_pool.active_count;
+    pCounters->refills.store(pCounters->refills.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    pCounters->progress.store(stream_progress(&pPlayer->event_stream), std::memory_order_relaxed);
+    pCounters->events.store(pPlayer->event_count, std::memory_order_relaxed);
+    pCounters->active_voices.store(voices, std::memory_order_relaxed);
+    if (voices > pCounters->peak_voices.load(std::memory_order_relaxed))
+    {
+        pCounters->peak_voices.store(voices, std::memory_order_relaxed);
+    }
+}
+
+static void render_loop(RenderThread *pThread)
+{
+    // Wake up a few times per lookahead, so the ring never drains by more than
+    // a quarter of it between two refills
+    auto period = std::chrono::microseconds(std::max<uint64_t>(
+        1000, (uint64_t)pThread->lookahead * 1000000 / pThread->sample_rate / 4));
+
+    while (!pThread->quit)
+    {
+        refill(pThread);
+        std::this_thread::sleep_for(period);
+    }
+}
+
+bool render_thread_start(RenderThread *pThread, Player *pPlayer, int channelCount, uint32_t sampleRate,
+                         int resampleQuality, uint32_t lookaheadFrames)
+{
+    if (lookaheadFrames == 0) return false;
+    if (!resampler_init(&pThread->resampler, pPlayer->config.sample_rate, sampleRate, channelCount, resampleQuality,
+                        pPlayer->config.isa))
+    {
+        return false;
+    }
+
+    pThread->pPlayer = pPlayer;
+    pThread->lookahead = lookaheadFrames;
+    pThread->sample_rate = sampleRate;
+    pThread->scratch.assign((size_t)SCRATCH_FRAMES * channelCount, 0.0f);
+    ring_init(&pThread->ring, lookaheadFrames, channelCount);
+    pThread->quit = false;
+    pThread->finished = pPlayer->song_ended;
+    perf_reset(&pThread->counters);
+    pThread->start_sample = pPlayer->playback_samples;
+    pThread->ring_read = 0;
+    pThread->clock_origin = CLOCK_UNKNOWN;
+    pThread->mark_read = 0;
+    pThread->mark_write = 0;
+    if (pThread->pLive) player_set_live(pPlayer, true);
+    pThread->counters.progress = stream_progress(&pPlayer->event_stream);
+    pThread->counters.events = pPlayer->event_count;
+
+    // Starts with a full ring so the device doesn't underrun right away
+    refill(pThread);
+    pThread->thread = std::thread(render_loop, pThread);
+    return true;
+}
+
+void render_thread_stop(RenderThread *pThread)
+{
+    pThread->quit = true;
+    if (pThread->thread.joinable()) pThread->thread.join();
+}
+
+// Device side, clocks the ring and measures the latency of the live events
+// that just went out
+static void measure_live(RenderThread *pThread, uint32_t copied)
+{
+    PerfCounters *pCounters = &pThread->counters;
+    LiveClock::time_point now = LiveClock::now();
+    uint64_t first = pThread->ring_read;
+    pThread->ring_read += copied;
+    pThread->clock_origin.store(clock_ns(now) - (int64_t)((double)first * 1e9 / pThread->sample_rate),
+                                std::memory_order_release);
+
+    uint32_t read = pThread->mark_read.load(std::memory_order_relaxed);
+    uint32_t write = pThread->mark_write.load(std::memory_order_acquire);
+    for (; read != write; ++read)
+    {
+        const LiveMark& mark = pThread->marks[read & (RENDER_LIVE_MARKS - 1)];
+        if (mark.frame >= pThread->ring_read) break;
+
+        double offset = (double)(int64_t)(mark.frame - first) / pThread->sample_rate;
+        double latency = std::chrono::duration<double>(now - mark.arrival).count() + offset;
+        pCounters->live_events.store(pCounters->live_events.load(std::memory_order_relaxed) + 1,
+                                     std::memory_order_relaxed);
+        pCounters->live_latency_total.store(pCounters->live_latency_total.load(std::memory_order_relaxed) + latency,
+                                            std::memory_order_relaxed);
+        if (latency > pCounters->live_latency_max.load(std::memory_order_relaxed))
+        {
+            pCounters->live_latency_max.store(latency, std::memory_order_relaxed);
+        }
+    }
+    pThread->mark_read.store(read, std::memory_order_release);
+}
+
+void render_thread_read(RenderThread *pThread, float *pOut, uint32_t frameCount)
+{
+    RingBuffer *pRing = &pThread->ring;
+    PerfCounters *pCounters = &pThread->counters;
+    uint32_t fill = ring_readable(pRing);
+    if (fill < pCounters->min_fill.load(std::memory_order_relaxed) && !pThread->finished)
+    {
+        pCounters->min_fill.store(fill, std::memory_order_relaxed);
+    }
+
+    uint32_t copied = ring_read(pRing, pOut, frameCount);
+    if (pThread->pLive) measure_live(pThread, copied);
+    if (copied < frameCount)
+    {
+        memset(pOut + (size_t)copied * pRing->channel_count, 0, sizeof(float) * (frameCount - copied) * pRing->channel_count);
+
+        // Running out at the end of the song is expected. Only the device
+        // thread writes those counters.
+        if (!pThread->finished)
+        {
+            pCounters->underruns.store(pCounters->underruns.load(std::memory_order_relaxed) + 1,
+                                       std::memory_order_relaxed);
+            pCounters->underrun_frames.store(pCounters->underrun_frames.load(std::memory_order_relaxed) +
+                                             (frameCount - copied), std::memory_order_relaxed);
+        }
+    }
+}
+
+bool render_thread_done(const RenderThread *pThread)
+{
+    return pThread->finished && ring_readable(&pThread->ring) == 0;
+}
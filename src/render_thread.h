@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "live_input.h"
+#include "perf_counters.h"
+#include "player.h"
+#include "resampler.h"
+#include "ring_buffer.h"
+
+// Default time rendered ahead of the audio device
+#define RENDER_LOOKAHEAD_MS 50
+
+// Live events scheduled but not played yet whose latency gets measured
+#define RENDER_LIVE_MARKS 1024
+
+// Ring frame a live event landed on, for the device side to measure when it
+// actually went out
+struct LiveMark
+{
+    uint64_t frame;
+    LiveClock::time_point arrival;
+};
+
+// Synthesizes a player on its own thread, keeping lookahead frames rendered
+// ahead in a ring buffer so the device side only has to copy them. The player
+// belongs to the thread between render_thread_start() and render_thread_stop().
+// The ring holds frames at the device rate, resampled from the player's.
+//
+// Live events are scheduled live_delay frames after the one the device was
+// playing when they arrived, which it tells with each read. The delay is the
+// same for every event, so they play with their original timing down to the
+// sample as long as it covers the lookahead. Those arriving too late for it
+// play as soon as possible.
+struct RenderThread
+{
+    Player *pPlayer = nullptr;
+    RingBuffer ring;
+    uint32_t lookahead = 0;     // Frames
+    uint32_t sample_rate = 0;   // Of the ring
+    Resampler resampler;
+    std::vector<float> scratch; // Player output waiting to be resampled
+    std::thread thread;
+    std::atomic<bool> quit;
+    std::atomic<bool> finished; // The song end is in the ring
+    PerfCounters counters;      // Reset on start
+
+    LiveInput *pLive = nullptr; // Set before starting to play live events
+    uint32_t live_delay = 0;    // Frames from an event's arrival to its sample
+    uint64_t start_sample = 0;  // Player position of the first ring frame
+    uint64_t ring_read = 0;     // Frames read by the device
+    std::atomic<int64_t> clock_origin; // When ring frame 0 would have been read, in LiveClock ns
+    LiveMark marks[RENDER_LIVE_MARKS];
+    alignas(64) std::atomic<uint32_t> mark_read;
+    alignas(64) std::atomic<uint32_t> mark_write;
+};
+
+bool render_thread_start(RenderThread *pThread, Player *pPlayer, int channelCount, uint32_t sampleRate,
+                         int resampleQuality, uint32_t lookaheadFrames);
+void render_thread_stop(RenderThread *pThread);
+
+// Device side, never blocks nor allocates. Copies frameCount frames to pOut,
+// padded with silence and counted as an underrun if the ring ran dry.
+void render_thread_read(RenderThread *pThread, float *pOut, uint32_t frameCount);
+
+// Once the whole song went through render_thread_read()
+bool render_thread_done(const RenderThread *pThread);
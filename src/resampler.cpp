@@ -0,0 +1,433 @@
+#include "resampler.h"
+
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+
+#include "oscillators.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RESAMPLE_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define RESAMPLE_TARGET_SSE2 __attribute__((target("sse2")))
+#define RESAMPLE_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define RESAMPLE_TARGET_SSE2
+#define RESAMPLE_TARGET_AVX2
+#endif
+
+#define MAX_TAPS 256
+
+struct QualityTier
+{
+    const char *name;
+    int taps;
+    double cutoff;      // Fraction of the lower Nyquist frequency
+    double beta;        // Kaiser window
+};
+
+static const QualityTier QUALITY_TIERS[RESAMPLE_QUALITY_COUNT] = {
+    { "fast", 8, 0.80, 4.0 },
+    { "medium", 16, 0.88, 6.0 },
+    { "high", 32, 0.93, 8.5 },
+};
+
+static const double PI = 3.14159265358979323846;
+
+//------------------------------------------------------------------------------
+// Filter design
+//------------------------------------------------------------------------------
+
+// Only basic arithmetic, which rounds the same everywhere unlike libm's
+// sin(), so every machine builds the same table
+static double series_sin(double x)
+{
+    x -= std::floor(x / (2.0 * PI) + 0.5) * (2.0 * PI);
+    double term = x;
+    double sum = x;
+    for (int n = 1; n < 20; ++n)
+    {
+        term *= -x * x / (double)((2 * n) * (2 * n + 1));
+        sum += term;
+    }
+    return sum;
+}
+
+static double bessel_i0(double x)
+{
+    double term = 1.0;
+    double sum = 1.0;
+    for (int k = 1; k < 40; ++k)
+    {
+        double factor = x / (2.0 * k);
+        term *= factor * factor;
+        sum += term;
+    }
+    return sum;
+}
+
+// Kaiser windowed sinc at distance d from the output, in input frames
+static double filter_tap(double d, double cutoff, int taps, double beta)
+{
+    double x = d / (taps / 2);
+    if (x <= -1.0 || x >= 1.0) return 0.0;
+    double y = cutoff * d;
+    double sinc = y == 0.0 ? 1.0 : series_sin(PI * y) / (PI * y);
+    return cutoff * sinc * bessel_i0(beta * std::sqrt(1.0 - x * x)) / bessel_i0(beta);
+}
+
+// Phase p is an output p / table_phases frames past tap lead. Each phase is
+// normalized so a constant input comes out unchanged.
+static void build_table(Resampler *pResampler, const QualityTier& tier)
+{
+    double ratio = std::min(1.0, (double)pResampler->up / (double)pResampler->down);
+    double cutoff = tier.cutoff * ratio;
+    int taps = (int)std::ceil(tier.taps / ratio);
+    taps = std::min(MAX_TAPS, (taps + 3) & ~3);
+
+    pResampler->taps = taps;
+    pResampler->lead = taps / 2 - 1;
+    pResampler->table_phases = std::min<uint32_t>(pResampler->up, RESAMPLE_MAX_PHASES);
+    pResampler->table.assign((size_t)pResampler->table_phases * taps, 0.0f);
+
+    double weights[MAX_TAPS];
+    for (uint32_t phase = 0; phase < pResampler->table_phases; ++phase)
+    {
+        double frac = (double)phase / (double)pResampler->table_phases;
+        double sum = 0.0;
+        for (int k = 0; k < taps; ++k)
+        {
+            weights[k] = filter_tap(k - pResampler->lead - frac, cutoff, taps, tier.beta);
+            sum += weights[k];
+        }
+        float *pTaps = pResampler->table.data() + (size_t)phase * taps;
+        for (int k = 0; k < taps; ++k)
+        {
+            pTaps[k] = (float)(weights[k] / sum);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Kernels
+//------------------------------------------------------------------------------
+
+// Dot products are summed in 4 lanes, tap k going to lane k % 4, then the
+// lanes as (0 + 2) + (1 + 3). Every kernel keeps that order.
+
+typedef void (*ResampleKernel)(Resampler *pResampler, float *pOut, uint32_t frameCount);
+
+static float dot_scalar(const float *pTaps, const float *pIn, int count)
+{
+    float lanes[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for (int k = 0; k < count; k += 4)
+    {
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            lanes[lane] += pTaps[k + lane] * pIn[k + lane];
+        }
+    }
+    return (lanes[0] + lanes[2]) + (lanes[1] + lanes[3]);
+}
+
+static const float *phase_taps(const Resampler *pResampler)
+{
+    uint32_t phase = pResampler->phase;
+    if (pResampler->table_phases != pResampler->up)
+    {
+        phase = (uint32_t)((uint64_t)phase * pResampler->table_phases / pResampler->up);
+    }
+    return pResampler->table.data() + (size_t)phase * pResampler->taps;
+}
+
+static void advance(Resampler *pResampler)
+{
+    pResampler->pos += pResampler->step;
+    pResampler->phase += pResampler->step_phase;
+    if (pResampler->phase >= pResampler->up)
+    {
+        pResampler->phase -= pResampler->up;
+        ++pResampler->pos;
+    }
+}
+
+static void resample_scalar(Resampler *pResampler, float *pOut, uint32_t frameCount)
+{
+    const int channelCount = pResampler->channel_count;
+    for (uint32_t i = 0; i < frameCount; ++i)
+    {
+        const float *pTaps = phase_taps(pResampler);
+        const float *pIn = pResampler->history.data() + pResampler->pos;
+        for (int c = 0; c < channelCount; ++c)
+        {
+            *pOut++ = dot_scalar(pTaps, pIn + (size_t)c * pResampler->stride, pResampler->taps);
+        }
+        advance(pResampler);
+    }
+}
+
+#if defined(RESAMPLE_X86)
+
+RESAMPLE_TARGET_SSE2 static float reduce_sse2(__m128 lanes)
+{
+    __m128 half = _mm_add_ps(lanes, _mm_movehl_ps(lanes, lanes));
+    return _mm_cvtss_f32(_mm_add_ss(half, _mm_shuffle_ps(half, half, 1)));
+}
+
+RESAMPLE_TARGET_SSE2 static float dot_sse2(const float *pTaps, const float *pIn, int count)
+{
+    __m128 lanes = _mm_setzero_ps();
+    for (int k = 0; k < count; k += 4)
+    {
+        lanes = _mm_add_ps(lanes, _mm_mul_ps(_mm_loadu_ps(pTaps + k), _mm_loadu_ps(pIn + k)));
+    }
+    return reduce_sse2(lanes);
+}
+
+// Channels go by pairs so the taps are loaded once for both
+RESAMPLE_TARGET_SSE2 static void resample_sse2(Resampler *pResampler, float *pOut, uint32_t frameCount)
+{
+    const int channelCount = pResampler->channel_count;
+    const int taps = pResampler->taps;
+    const size_t stride = pResampler->stride;
+    for (uint32_t i = 0; i < frameCount; ++i)
+    {
+        const float *pTaps = phase_taps(pResampler);
+        const float *pIn = pResampler->history.data() + pResampler->pos;
+        int c = 0;
+        for (; c + 2 <= channelCount; c += 2)
+        {
+            const float *pLeft = pIn + c * stride;
+            const float *pRight = pLeft + stride;
+            __m128 left = _mm_setzero_ps();
+            __m128 right = _mm_setzero_ps();
+            for (int k = 0; k < taps; k += 4)
+            {
+                __m128 tap = _mm_loadu_ps(pTaps + k);
+                left = _mm_add_ps(left, _mm_mul_ps(tap, _mm_loadu_ps(pLeft + k)));
+                right = _mm_add_ps(right, _mm_mul_ps(tap, _mm_loadu_ps(pRight + k)));
+            }
+            *pOut++ = reduce_sse2(left);
+            *pOut++ = reduce_sse2(right);
+        }
+        if (c < channelCount)
+        {
+            *pOut++ = dot_sse2(pTaps, pIn + c * stride, taps);
+        }
+        advance(pResampler);
+    }
+}
+
+// Two channels at once, one per 128-bit half
+RESAMPLE_TARGET_AVX2 static void resample_avx2(Resampler *pResampler, float *pOut, uint32_t frameCount)
+{
+    const int channelCount = pResampler->channel_count;
+    const int taps = pResampler->taps;
+    const size_t stride = pResampler->stride;
+    for (uint32_t i = 0; i < frameCount; ++i)
+    {
+        const float *pTaps = phase_taps(pResampler);
+        const float *pIn = pResampler->history.data() + pResampler->pos;
+        int c = 0;
+        for (; c + 2 <= channelCount; c += 2)
+        {
+            const float *pLeft = pIn + c * stride;
+            const float *pRight = pLeft + stride;
+            __m256 lanes = _mm256_setzero_ps();
+            for (int k = 0; k < taps; k += 4)
+            {
+                __m256 tap = _mm256_broadcast_ps((const __m128 *)(pTaps + k));
+                __m256 in = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(pLeft + k)),
+                                                 _mm_loadu_ps(pRight + k), 1);
+                lanes = _mm256_add_ps(lanes, _mm256_mul_ps(tap, in));
+            }
+            *pOut++ = reduce_sse2(_mm256_castps256_ps128(lanes));
+            *pOut++ = reduce_sse2(_mm256_extractf128_ps(lanes, 1));
+        }
+        if (c < channelCount)
+        {
+            *pOut++ = dot_sse2(pTaps, pIn + c * stride, taps);
+        }
+        advance(pResampler);
+    }
+}
+
+#endif // RESAMPLE_X86
+
+static ResampleKernel pick_kernel(int isa)
+{
+    switch (isa)
+    {
+#if defined(RESAMPLE_X86)
+        case OSC_ISA_AVX2: return resample_avx2;
+        case OSC_ISA_SSE2: return resample_sse2;
+#endif
+        default: return resample_scalar;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Stream
+//------------------------------------------------------------------------------
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+    while (b)
+    {
+        uint32_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+// Frames an output reads, the copy reads one
+static uint32_t width(const Resampler *pResampler)
+{
+    return pResampler->taps > 0 ? (uint32_t)pResampler->taps : 1;
+}
+
+// Drops the history no output reads anymore, then makes room for frameCount
+static void reserve(Resampler *pResampler, uint32_t frameCount)
+{
+    uint32_t first = std::min(pResampler->pos, pResampler->fill);
+    uint32_t kept = pResampler->fill - first;
+    uint32_t needed = kept + frameCount;
+    if (needed > pResampler->stride)
+    {
+        uint32_t stride = std::max(needed, pResampler->stride * 2);
+        std::vector<float> history((size_t)stride * pResampler->channel_count, 0.0f);
+        for (int c = 0; c < pResampler->channel_count; ++c)
+        {
+            memcpy(history.data() + (size_t)c * stride,
+                   pResampler->history.data() + (size_t)c * pResampler->stride + first,
+                   sizeof(float) * kept);
+        }
+        pResampler->history.swap(history);
+        pResampler->stride = stride;
+    }
+    else if (first > 0)
+    {
+        for (int c = 0; c < pResampler->channel_count; ++c)
+        {
+            float *pRow = pResampler->history.data() + (size_t)c * pResampler->stride;
+            memmove(pRow, pRow + first, sizeof(float) * kept);
+        }
+    }
+    pResampler->pos -= first;
+    pResampler->fill = kept;
+}
+
+static void append(Resampler *pResampler, const float *pIn, uint32_t frameCount)
+{
+    reserve(pResampler, frameCount);
+    const int channelCount = pResampler->channel_count;
+    for (int c = 0; c < channelCount; ++c)
+    {
+        float *pRow = pResampler->history.data() + (size_t)c * pResampler->stride + pResampler->fill;
+        if (pIn)
+        {
+            for (uint32_t i = 0; i < frameCount; ++i) pRow[i] = pIn[(size_t)i * channelCount + c];
+        }
+        else
+        {
+            memset(pRow, 0, sizeof(float) * frameCount);
+        }
+    }
+    pResampler->fill += frameCount;
+}
+
+bool resampler_init(Resampler *pResampler, uint32_t inRate, uint32_t outRate, int channelCount, int quality,
+                    int isa)
+{
+    if (inRate == 0 || outRate == 0 || channelCount <= 0) return false;
+    quality = std::min(std::max(quality, 0), RESAMPLE_QUALITY_COUNT - 1);
+
+    *pResampler = Resampler();
+    uint32_t divisor = gcd(inRate, outRate);
+    pResampler->in_rate = inRate;
+    pResampler->out_rate = outRate;
+    pResampler->up = outRate / divisor;
+    pResampler->down = inRate / divisor;
+    pResampler->step = pResampler->down / pResampler->up;
+    pResampler->step_phase = pResampler->down % pResampler->up;
+    pResampler->channel_count = channelCount;
+    pResampler->isa = isa;
+    if (inRate != outRate) build_table(pResampler, QUALITY_TIERS[quality]);
+
+    // Silence before the first frame, for the taps reaching back past it
+    append(pResampler, nullptr, (uint32_t)pResampler->lead);
+    return true;
+}
+
+uint32_t resampler_input_needed(const Resampler *pResampler, uint32_t outFrames)
+{
+    if (outFrames == 0 || pResampler->out_end != UINT64_MAX) return 0;
+    uint64_t last = pResampler->pos + width(pResampler) +
+                    ((uint64_t)pResampler->phase + (uint64_t)(outFrames - 1) * pResampler->down) / pResampler->up;
+    return last > pResampler->fill ? (uint32_t)(last - pResampler->fill) : 0;
+}
+
+void resampler_write(Resampler *pResampler, const float *pIn, uint32_t frameCount)
+{
+    if (frameCount == 0 || pResampler->out_end != UINT64_MAX) return;
+    append(pResampler, pIn, frameCount);
+    pResampler->in_frames += frameCount;
+}
+
+void resampler_end(Resampler *pResampler)
+{
+    if (pResampler->out_end != UINT64_MAX) return;
+    pResampler->out_end = (pResampler->in_frames * pResampler->up + pResampler->down - 1) / pResampler->down;
+    append(pResampler, nullptr, width(pResampler) - 1 - (uint32_t)pResampler->lead);
+}
+
+uint32_t resampler_read(Resampler *pResampler, float *pOut, uint32_t maxFrames)
+{
+    // Output n - 1 reads up to pos + (phase + (n - 1) * down) / up + width
+    uint32_t used = pResampler->pos + width(pResampler);
+    if (pResampler->fill < used) return 0;
+    uint64_t room = pResampler->fill - used;
+    uint64_t available = ((room + 1) * pResampler->up - pResampler->phase + pResampler->down - 1) / pResampler->down;
+    available = std::min<uint64_t>(available, pResampler->out_end - pResampler->out_frames);
+    uint32_t frameCount = (uint32_t)std::min<uint64_t>(available, maxFrames);
+
+    if (pResampler->taps == 0)
+    {
+        const int channelCount = pResampler->channel_count;
+        for (int c = 0; c < channelCount; ++c)
+        {
+            const float *pRow = pResampler->history.data() + (size_t)c * pResampler->stride + pResampler->pos;
+            for (uint32_t i = 0; i < frameCount; ++i) pOut[(size_t)i * channelCount + c] = pRow[i];
+        }
+        pResampler->pos += frameCount;
+    }
+    else
+    {
+        pick_kernel(pResampler->isa)(pResampler, pOut, frameCount);
+    }
+    pResampler->out_frames += frameCount;
+    return frameCount;
+}
+
+bool resampler_done(const Resampler *pResampler)
+{
+    return pResampler->out_frames == pResampler->out_end;
+}
+
+int resample_parse_quality(const char *name)
+{
+    for (int i = 0; i < RESAMPLE_QUALITY_COUNT; ++i)
+    {
+        if (strcmp(name, QUALITY_TIERS[i].name) == 0) return i;
+    }
+    return -1;
+}
+
+const char *resample_quality_name(int quality)
+{
+    return QUALITY_TIERS[std::min(std::max(quality, 0), RESAMPLE_QUALITY_COUNT - 1)].name;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+// Filter lengths, longer ones cost more but keep more of the top octave and
+// leave less aliasing
+#define RESAMPLE_FAST 0     // 8 taps
+#define RESAMPLE_MEDIUM 1   // 16 taps
+#define RESAMPLE_HIGH 2     // 32 taps
+#define RESAMPLE_QUALITY_COUNT 3
+
+// Above this many phases the filter table is shared between neighbouring
+// phases, timing stays exact
+#define RESAMPLE_MAX_PHASES 1024
+
+// Streaming polyphase converter from in_rate to out_rate, both integers so
+// the ratio is exact and output frame j always sits at input frame
+// j * in_rate / out_rate. The filter is centered on it, the delay is
+// compensated so outputs line up with inputs from the first frame.
+//
+// Everything is plain float math in a fixed order, and the kernels sum the
+// same lanes whatever the instruction set, so results only depend on the
+// input and the rates.
+struct Resampler
+{
+    uint32_t in_rate = 0;
+    uint32_t out_rate = 0;
+    uint32_t up = 1;                // out_rate / in_rate, reduced
+    uint32_t down = 1;
+    uint32_t step = 0;              // down / up, frames between outputs
+    uint32_t step_phase = 0;        // down % up
+    int channel_count = 0;
+    int isa = 0;                    // OSC_ISA_* of the kernels
+    int taps = 0;                   // Multiple of 4, 0 when the rates match and frames are copied
+    int lead = 0;                   // Taps before the one nearest the output
+    uint32_t table_phases = 0;
+    std::vector<float> table;       // taps per phase
+
+    std::vector<float> history;     // One row of stride frames per channel
+    uint32_t stride = 0;
+    uint32_t pos = 0;               // First frame of history the next output reads
+    uint32_t fill = 0;              // Frames in history
+    uint32_t phase = 0;             // Of the next output past history[pos + lead], in 1/up frames
+
+    uint64_t in_frames = 0;         // Written so far
+    uint64_t out_frames = 0;        // Read so far
+    uint64_t out_end = UINT64_MAX;  // Output length, once the input ended
+};
+
+// Fails on zero rates or channels. isa is an OSC_ISA_* returned by
+// osc_pick_isa(), the output is the same with each of them.
+bool resampler_init(Resampler *pResampler, uint32_t inRate, uint32_t outRate, int channelCount, int quality,
+                    int isa);
+
+// Input frames still missing to read outFrames more
+uint32_t resampler_input_needed(const Resampler *pResampler, uint32_t outFrames);
+
+// Adds interleaved input frames. History only grows to what's written at once
+// plus the filter length, so after the first few writes nothing allocates.
+void resampler_write(Resampler *pResampler, const float *pIn, uint32_t frameCount);
+
+// No more input, the last outputs are read against silence. The output ends
+// up ceil(in_frames * out_rate / in_rate) frames long.
+void resampler_end(Resampler *pResampler);
+
+// Reads up to maxFrames interleaved output frames, as many as the input
+// written so far allows. Returns how many.
+uint32_t resampler_read(Resampler *pResampler, float *pOut, uint32_t maxFrames);
+
+// Ended and read to the end
+bool resampler_done(const Resampler *pResampler);
+
+// "fast", "medium" or "high", returns -1 for anything else
+int resample_parse_quality(const char *name);
+const char *resample_quality_name(int quality);
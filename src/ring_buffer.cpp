@@ -0,0 +1,59 @@
+#include "ring_buffer.h"
+
+#include <string.h>
+#include <algorithm>
+
+void ring_init(RingBuffer *pRing, uint32_t minFrames, int channelCount)
+{
+    uint32_t capacity = 1;
+    while (capacity < minFrames) capacity <<= 1;
+
+    pRing->capacity = capacity;
+    pRing->channel_count = channelCount;
+    pRing->samples.assign((size_t)capacity * channelCount, 0.0f);
+    pRing->read_pos = 0;
+    pRing->write_pos = 0;
+}
+
+uint32_t ring_readable(const RingBuffer *pRing)
+{
+    return pRing->write_pos.load(std::memory_order_acquire) - pRing->read_pos.load(std::memory_order_relaxed);
+}
+
+uint32_t ring_writable(const RingBuffer *pRing)
+{
+    return pRing->capacity - (pRing->write_pos.load(std::memory_order_relaxed) -
+                              pRing->read_pos.load(std::memory_order_acquire));
+}
+
+float *ring_write_begin(RingBuffer *pRing, uint32_t *pFrameCount)
+{
+    uint32_t pos = pRing->write_pos.load(std::memory_order_relaxed) & (pRing->capacity - 1);
+    *pFrameCount = std::min(ring_writable(pRing), pRing->capacity - pos);
+    return pRing->samples.data() + (size_t)pos * pRing->channel_count;
+}
+
+void ring_write_end(RingBuffer *pRing, uint32_t frameCount)
+{
+    pRing->write_pos.store(pRing->write_pos.load(std::memory_order_relaxed) + frameCount, std::memory_order_release);
+}
+
+uint32_t ring_read(RingBuffer *pRing, float *pOut, uint32_t frameCount)
+{
+    uint32_t read = pRing->read_pos.load(std::memory_order_relaxed);
+    frameCount = std::min(frameCount, ring_readable(pRing));
+
+    // At most two copies, before and after the wrap
+    uint32_t copied = 0;
+    while (copied < frameCount)
+    {
+        uint32_t pos = (read + copied) & (pRing->capacity - 1);
+        uint32_t count = std::min(frameCount - copied, pRing->capacity - pos);
+        memcpy(pOut + (size_t)copied * pRing->channel_count, pRing->samples.data() + (size_t)pos * pRing->channel_count,
+               sizeof(float) * count * pRing->channel_count);
+        copied += count;
+    }
+
+    pRing->read_pos.store(read + frameCount, std::memory_order_release);
+    return frameCount;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+// Lock-free single producer, single consumer ring of interleaved frames. The
+// positions only ever grow (wrapping around 2^32) and each one is written by
+// a single side, so no locks or compare-and-swap are needed.
+struct RingBuffer
+{
+    std::vector<float> samples;
+    uint32_t capacity = 0;      // Frames, a power of two
+    int channel_count = 0;
+    alignas(64) std::atomic<uint32_t> read_pos;
+    alignas(64) std::atomic<uint32_t> write_pos;
+};
+
+// Capacity is rounded up to a power of two
+void ring_init(RingBuffer *pRing, uint32_t minFrames, int channelCount);
+
+uint32_t ring_readable(const RingBuffer *pRing);
+uint32_t ring_writable(const RingBuffer *pRing);
+
+// Producer side. Returns where the next frames go, with how many of them are
+// contiguous, then ring_write_end() publishes what was actually written.
+float *ring_write_begin(RingBuffer *pRing, uint32_t *pFrameCount);
+void ring_write_end(RingBuffer *pRing, uint32_t frameCount);
+
+// Consumer side, copies up to frameCount frames and returns how many
+uint32_t ring_read(RingBuffer *pRing, float *pOut, uint32_t frameCount);
@@ -0,0 +1,205 @@
+#include "stems.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "output_stage.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define STEMS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+struct RenderContext
+{
+    StemBatch *pBatch;
+    int channel_count;
+    OscKernels kernels;
+};
+
+void stems_clear(StemBatch *pBatch)
+{
+    pBatch->frame_count = 0;
+    pBatch->apu = false;
+    pBatch->spans.clear();
+    pBatch->gains.clear();
+}
+
+void stems_reset(StemBatch *pBatch)
+{
+    stems_clear(pBatch);
+    pBatch->stem_count = 0;
+    pBatch->stem_keys.clear();
+    pBatch->mix_order.clear();
+}
+
+int stems_add_stem(StemBatch *pBatch, int key)
+{
+    pBatch->stem_keys.push_back(key);
+    pBatch->mix_order.push_back(pBatch->stem_count);
+    std::stable_sort(pBatch->mix_order.begin(), pBatch->mix_order.end(),
+                     [pBatch](int a, int b) { return pBatch->stem_keys[a] < pBatch->stem_keys[b]; });
+    return pBatch->stem_count++;
+}
+
+void stems_add_span(StemBatch *pBatch, const StemSpan& span)
+{
+    pBatch->spans.push_back(span);
+}
+
+void stems_add_gain(StemBatch *pBatch, uint32_t offset, int count, float gain)
+{
+    auto& gains = pBatch->gains;
+    if (!gains.empty() && gains.back().gain == gain && gains.back().offset + gains.back().count == offset)
+    {
+        gains.back().count += count;
+    }
+    else
+    {
+        GainSpan span = { offset, count, gain };
+        gains.push_back(span);
+    }
+    pBatch->frame_count = (int)(offset + count);
+}
+
+static void add_samples(float *pDst, const float *pSrc, int count)
+{
+    int i = 0;
+#if defined(STEMS_SSE2)
+    for (; i + 4 <= count; i += 4)
+    {
+        _mm_storeu_ps(pDst + i, _mm_add_ps(_mm_loadu_ps(pDst + i), _mm_loadu_ps(pSrc + i)));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        pDst[i] += pSrc[i];
+    }
+}
+
+static void clamp_and_scale(float *pSamples, int count, float gain)
+{
+    int i = 0;
+#if defined(STEMS_SSE2)
+    const __m128 lo = _mm_set1_ps(-1.0f);
+    const __m128 hi = _mm_set1_ps(1.0f);
+    const __m128 g = _mm_set1_ps(gain);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 x = _mm_max_ps(lo, _mm_min_ps(hi, _mm_loadu_ps(pSamples + i)));
+        _mm_storeu_ps(pSamples + i, _mm_mul_ps(x, g));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        pSamples[i] = std::max<float>(-1.0f, std::min<float>(1.0f, pSamples[i])) * gain;
+    }
+}
+
+// Applies the gain spans covering [start, start + count) of the batch
+static void apply_gains(const StemBatch *pBatch, float *pSamples, uint32_t start, int count)
+{
+    auto it = std::upper_bound(pBatch->gains.begin(), pBatch->gains.end(), start,
+                               [](uint32_t s, const GainSpan& span) { return s < span.offset + span.count; });
+    uint32_t end = start + (uint32_t)count;
+    for (; it != pBatch->gains.end() && it->offset < end; ++it)
+    {
+        uint32_t from = std::max(start, it->offset);
+        uint32_t to = std::min(end, it->offset + (uint32_t)it->count);
+        clamp_and_scale(pSamples + (from - start), (int)(to - from), it->gain);
+    }
+}
+
+static void render_stem_block(void *pContext, int index)
+{
+    auto pRender = (RenderContext*)pContext;
+    StemBatch *pBatch = pRender->pBatch;
+    int block = index / pBatch->stem_count;
+    int stem = index % pBatch->stem_count;
+    uint32_t start = (uint32_t)block * STEM_BLOCK_FRAMES;
+    int count = std::min<int>(STEM_BLOCK_FRAMES, pBatch->frame_count - (int)start);
+
+    float *pStem = pBatch->stems.data() + (size_t)stem * pBatch->frame_count;
+    memset(pStem + start, 0, sizeof(float) * count);
+
+    if (pBatch->apu)
+    {
+        int32_t acc = pBatch->apu_block_acc[(size_t)block * pBatch->stem_count + stem];
+        const int32_t *pRow = pBatch->apu_deltas.data() + (size_t)stem * pBatch->apu_stride;
+        apu_integrate(pRow + start, count, &acc, pStem + start);
+        return;
+    }
+
+    for (uint32_t i = pBatch->block_spans[block]; i < pBatch->block_spans[block + 1]; ++i)
+    {
+        const StemSpan& span = pBatch->spans[i];
+        if (span.stem != stem) continue;
+
+        OscVoice osc = span.osc;
+        float *pMix = pStem + span.offset;
+        if (span.pTable)
+        {
+            wt_render(span.pTable, &osc, pMix, span.count);
+            continue;
+        }
+        switch (span.type)
+        {
+            case VOICE_PULSE: pRender->kernels.pulse(&osc, pMix, span.count); break;
+            case VOICE_TRIANGLE: pRender->kernels.triangle(&osc, pMix, span.count); break;
+            case VOICE_NOISE: osc_noise(&osc, pMix, span.count); break;
+        }
+    }
+}
+
+static void mix_block(void *pContext, int block)
+{
+    auto pRender = (RenderContext*)pContext;
+    StemBatch *pBatch = pRender->pBatch;
+    uint32_t start = (uint32_t)block * STEM_BLOCK_FRAMES;
+    int count = std::min<int>(STEM_BLOCK_FRAMES, pBatch->frame_count - (int)start);
+
+    float mix[STEM_BLOCK_FRAMES];
+    memset(mix, 0, sizeof(float) * count);
+    for (int stem : pBatch->mix_order)
+    {
+        add_samples(mix, stems_get(pBatch, stem) + start, count);
+    }
+    apply_gains(pBatch, mix, start, count);
+
+    if (pBatch->keep_stems)
+    {
+        for (int stem = 0; stem < pBatch->stem_count; ++stem)
+        {
+            apply_gains(pBatch, pBatch->stems.data() + (size_t)stem * pBatch->frame_count + start, start, count);
+        }
+    }
+
+    int channelCount = pRender->channel_count;
+    output_convert(mix, 1, count, channelCount, SAMPLE_F32, nullptr, pBatch->isa,
+                   pBatch->output.data() + (size_t)start * channelCount);
+}
+
+void stems_render(StemBatch *pBatch, WorkerPool *pWorkers, int channelCount)
+{
+    int blockCount = (pBatch->frame_count + STEM_BLOCK_FRAMES - 1) / STEM_BLOCK_FRAMES;
+    pBatch->stems.resize((size_t)pBatch->stem_count * pBatch->frame_count);
+    pBatch->output.resize((size_t)pBatch->frame_count * channelCount);
+
+    // Spans are in time order and don't cross blocks
+    pBatch->block_spans.resize(blockCount + 1);
+    uint32_t span = 0;
+    for (int block = 0; block <= blockCount; ++block)
+    {
+        uint32_t start = (uint32_t)block * STEM_BLOCK_FRAMES;
+        while (span < pBatch->spans.size() && pBatch->spans[span].offset < start) ++span;
+        pBatch->block_spans[block] = span;
+    }
+    pBatch->block_spans[blockCount] = (uint32_t)pBatch->spans.size();
+
+    RenderContext context = { pBatch, channelCount, osc_kernels(pBatch->isa) };
+    if (pBatch->stem_count > 0)
+    {
+        workers_for(pWorkers, blockCount * pBatch->stem_count, render_stem_block, &context);
+    }
+    workers_for(pWorkers, blockCount, mix_block, &context);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "voice_pool.h"
+#include "worker_pool.h"
+
+// Stems are rendered and mixed in blocks this big, 4KB of floats per stem so
+// a block stays in L1 while its spans are added in.
+#define STEM_BLOCK_FRAMES 1024
+
+// One voice playing over a span. The oscillator state is copied as it was at
+// the start of the span, so spans can be synthesized in any order and on any
+// thread. Spans never cross a block boundary.
+struct StemSpan
+{
+    OscVoice osc;
+    const Wavetable *pTable;
+    int type;           // VOICE_*
+    int stem;
+    uint32_t offset;    // Frame in the batch
+    int count;
+};
+
+// Master gain (volume * MAX_VOLUME) applied after the clamp
+struct GainSpan
+{
+    uint32_t offset;
+    int count;
+    float gain;
+};
+
+// A few blocks of the song, planned by the control thread then rendered by
+// the workers.
+struct StemBatch
+{
+    int frame_count = 0;
+    int stem_count = 0;
+    std::vector<int> stem_keys;         // Stems are summed by increasing key
+    std::vector<int> mix_order;
+    bool keep_stems = false;            // Leave the clamped and scaled stems in stems
+    std::vector<StemSpan> spans;        // Ordered by offset
+    std::vector<GainSpan> gains;
+    std::vector<uint32_t> block_spans;  // First span of each block, plus the end
+    std::vector<float> stems;           // stem_count runs of frame_count samples
+    bool apu = false;                   // Stems integrate APU steps instead of playing spans
+    int apu_stride = 0;
+    std::vector<int32_t> apu_deltas;    // Steps of each stem, apu_stride apart
+    std::vector<int32_t> apu_block_acc; // Integrated value at each block start, per block then stem
+    std::vector<float> output;          // Interleaved mix
+    int isa = OSC_ISA_SCALAR;           // Kernels of the player that planned it
+};
+
+// Clears the spans of the previous batch, stems are kept
+void stems_clear(StemBatch *pBatch);
+
+// Forgets the stems too, before reusing the batch for another song
+void stems_reset(StemBatch *pBatch);
+
+// Returns the index of the new stem. Keys decide the summing order, so the
+// mix doesn't depend on which stem happened to play first.
+int stems_add_stem(StemBatch *pBatch, int key);
+void stems_add_span(StemBatch *pBatch, const StemSpan& span);
+void stems_add_gain(StemBatch *pBatch, uint32_t offset, int count, float gain);
+
+// Synthesizes every stem, then sums them into output with channelCount
+// interleaved channels. Stems are always summed in order, so the result is
+// the same whatever the number of threads.
+void stems_render(StemBatch *pBatch, WorkerPool *pWorkers, int channelCount);
+
+inline const float *stems_get(const StemBatch *pBatch, int stem)
+{
+    return pBatch->stems.data() + (size_t)stem * pBatch->frame_count;
+}
@@ -0,0 +1,75 @@
+#include "tempo_map.h"
+
+#include <algorithm>
+
+static double samples_per_tick(const TempoMap *pMap, uint32_t tempo)
+{
+    return (double)tempo * (double)pMap->sample_rate / ((double)pMap->division * 1000000.0 * pMap->speed);
+}
+
+void tempo_map_clear(TempoMap *pMap, uint32_t division)
+{
+    pMap->division = division ? division : 96;
+    pMap->changes.clear();
+
+    TempoChange initial = { 0, TEMPO_DEFAULT, 0.0, samples_per_tick(pMap, TEMPO_DEFAULT) };
+    pMap->changes.push_back(initial);
+}
+
+void tempo_map_add(TempoMap *pMap, uint32_t tick, uint32_t tempo)
+{
+    auto& changes = pMap->changes;
+    auto& last = changes.back();
+    tempo = tempo ? tempo : TEMPO_DEFAULT;
+
+    // Already known, we're playing that part again after a seek
+    if (tick < last.tick) return;
+
+    // Several changes on the same tick, the last one wins
+    if (tick == last.tick)
+    {
+        last.tempo = tempo;
+        last.samples_per_tick = samples_per_tick(pMap, tempo);
+        return;
+    }
+
+    TempoChange change;
+    change.tick = tick;
+    change.tempo = tempo;
+    change.sample = last.sample + (double)(tick - last.tick) * last.samples_per_tick;
+    change.samples_per_tick = samples_per_tick(pMap, tempo);
+    changes.push_back(change);
+}
+
+void tempo_map_build(TempoMap *pMap, uint32_t sample_rate, double speed)
+{
+    auto& changes = pMap->changes;
+    pMap->sample_rate = sample_rate;
+    pMap->speed = speed > 0.0 ? speed : 1.0;
+
+    double sample = 0.0;
+    for (size_t i = 0; i < changes.size(); ++i)
+    {
+        auto& change = changes[i];
+        if (i) sample += (double)(change.tick - changes[i - 1].tick) * changes[i - 1].samples_per_tick;
+        change.sample = sample;
+        change.samples_per_tick = samples_per_tick(pMap, change.tempo);
+    }
+}
+
+uint32_t tempo_map_tick_to_sample(const TempoMap *pMap, double tick)
+{
+    auto it = std::upper_bound(pMap->changes.begin(), pMap->changes.end(), tick,
+                               [](double t, const TempoChange& change) { return t < (double)change.tick; });
+    const TempoChange& change = *(it - 1);
+    double sample = change.sample + (tick - (double)change.tick) * change.samples_per_tick;
+    return (uint32_t)std::min<double>(sample, 4294967295.0);
+}
+
+double tempo_map_sample_to_tick(const TempoMap *pMap, uint32_t sample)
+{
+    auto it = std::upper_bound(pMap->changes.begin(), pMap->changes.end(), (double)sample,
+                               [](double s, const TempoChange& change) { return s < change.sample; });
+    const TempoChange& change = *(it - 1);
+    return (double)change.tick + ((double)sample - change.sample) / change.samples_per_tick;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#define TEMPO_DEFAULT 500000 // Microseconds per quarter note, 120 BPM
+
+struct TempoChange
+{
+    uint32_t tick;
+    uint32_t tempo;             // Microseconds per quarter note
+    double sample;              // Output sample at which it starts
+    double samples_per_tick;
+};
+
+// Tempo changes of every track merged on a single timeline. Events stay in
+// ticks and get converted when they're about to play, so changing the output
+// rate or the playback speed is a rebuild of this table instead of a reparse.
+// Tracks are decoded while they play, so the map grows as tempo changes are
+// reached.
+struct TempoMap
+{
+    uint32_t division = 96;     // Ticks per quarter note
+    uint32_t sample_rate = 0;
+    double speed = 1.0;
+    std::vector<TempoChange> changes;
+};
+
+// Leaves only the default tempo at tick 0. Set sample_rate and speed first, or
+// call tempo_map_build() after.
+void tempo_map_clear(TempoMap *pMap, uint32_t division);
+
+// Changes have to come in tick order. The ones before the last known change
+// are ignored, so playing a part again after seeking back is harmless.
+void tempo_map_add(TempoMap *pMap, uint32_t tick, uint32_t tempo);
+
+// Recomputes where each known tempo change lands in samples
+void tempo_map_build(TempoMap *pMap, uint32_t sample_rate, double speed);
+
+uint32_t tempo_map_tick_to_sample(const TempoMap *pMap, double tick);
+double tempo_map_sample_to_tick(const TempoMap *pMap, uint32_t sample);
@@ -0,0 +1,116 @@
+#include "voice_pool.h"
+
+#include <algorithm>
+
+void pool_init(VoicePool *pPool, int capacity)
+{
+    pPool->capacity = std::max(1, std::min(capacity, VOICE_MAX));
+    pPool->active_count = 0;
+    pPool->peak_count = 0;
+    pPool->serial = 0;
+    pPool->steal_count = 0;
+
+    // Lowest indices first out of the free list
+    pPool->free_count = pPool->capacity;
+    for (int i = 0; i < pPool->capacity; ++i)
+    {
+        pPool->free_voices[i] = (uint8_t)(pPool->capacity - 1 - i);
+        pPool->voices[i].slot = -1;
+    }
+}
+
+static void activate(VoicePool *pPool, int index)
+{
+    Voice *pVoice = pPool->voices + index;
+    pVoice->slot = pPool->active_count;
+    pPool->active[pPool->active_count++] = (uint8_t)index;
+    pPool->peak_count = std::max(pPool->peak_count, pPool->active_count);
+}
+
+// Lowest priority, then quietest, then oldest
+static bool steal_before(const Voice *pA, const Voice *pB)
+{
+    if (pA->priority != pB->priority) return pA->priority < pB->priority;
+    if (pA->osc.vol != pB->osc.vol) return pA->osc.vol < pB->osc.vol;
+    return (int32_t)(pA->serial - pB->serial) < 0;
+}
+
+Voice *pool_note_on(VoicePool *pPool, int channel, int note_id, int priority, Voice *pStolen)
+{
+    Voice *pVoice = pool_find(pPool, channel, note_id);
+    if (pVoice)
+    {
+        pVoice->priority = priority;
+        pVoice->serial = pPool->serial++;
+        return pVoice;
+    }
+
+    if (pPool->free_count > 0)
+    {
+        int index = pPool->free_voices[--pPool->free_count];
+        activate(pPool, index);
+        pVoice = pPool->voices + index;
+    }
+    else
+    {
+        for (int i = 0; i < pPool->active_count; ++i)
+        {
+            Voice *pCandidate = pPool->voices + pPool->active[i];
+            if (!pVoice || steal_before(pCandidate, pVoice)) pVoice = pCandidate;
+        }
+        if (!pVoice || pVoice->priority > priority) return nullptr;
+        ++pPool->steal_count;
+        if (pStolen) *pStolen = *pVoice;
+    }
+
+    int slot = pVoice->slot;
+    *pVoice = Voice();
+    pVoice->slot = slot;
+    pVoice->channel = channel;
+    pVoice->note_id = note_id;
+    pVoice->priority = priority;
+    pVoice->serial = pPool->serial++;
+    return pVoice;
+}
+
+Voice *pool_find(VoicePool *pPool, int channel, int note_id)
+{
+    for (int i = 0; i < pPool->active_count; ++i)
+    {
+        Voice *pVoice = pPool->voices + pPool->active[i];
+        if (pVoice->channel == channel && pVoice->note_id == note_id) return pVoice;
+    }
+    return nullptr;
+}
+
+void pool_release(VoicePool *pPool, Voice *pVoice)
+{
+    int slot = pVoice->slot;
+    if (slot < 0) return;
+
+    // The last active voice takes its slot
+    int last = pPool->active[--pPool->active_count];
+    pPool->active[slot] = (uint8_t)last;
+    pPool->voices[last].slot = slot;
+
+    pVoice->slot = -1;
+    pPool->free_voices[pPool->free_count++] = (uint8_t)(pVoice - pPool->voices);
+}
+
+void pool_restore(VoicePool *pPool, const Voice *pVoices, int count, uint32_t serial)
+{
+    int capacity = pPool->capacity;
+    uint32_t steal_count = pPool->steal_count;
+    int peak_count = pPool->peak_count;
+    pool_init(pPool, capacity);
+    pPool->steal_count = steal_count;
+
+    for (int i = 0; i < count && pPool->free_count > 0; ++i)
+    {
+        int index = pPool->free_voices[--pPool->free_count];
+        pPool->voices[index] = pVoices[i];
+        activate(pPool, index);
+    }
+    pPool->serial = serial;
+    pPool->peak_count = std::max(peak_count, pPool->peak_count);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "apu.h"
+#include "oscillators.h"
+#include "wavetables.h"
+
+#define VOICE_PULSE 0
+#define VOICE_TRIANGLE 1
+#define VOICE_NOISE 2
+#define VOICE_TYPE_COUNT 3
+
+#define VOICE_MAX 128
+#define VOICE_CHANNELS 16
+
+// Which voice type plays the notes of a MIDI channel
+struct VoiceRoute
+{
+    int type;
+    uint32_t duty;      // Pulse only
+    int priority;       // Higher priority voices are stolen last
+};
+
+struct Voice
+{
+    OscVoice osc;
+    ApuVoice apu;                   // Timers of the APU core, with PlayerConfig::apu
+    const Wavetable *pTable = nullptr; // Band-limited version of the voice
+    int type = VOICE_PULSE;
+    int channel = -1;
+    int note_id = -1;
+    int priority = 0;
+    uint32_t serial = 0;    // Allocation order, the oldest is stolen first on ties
+    int slot = -1;          // Index in VoicePool::active while playing
+};
+
+// Fixed capacity pool. Playing voices are kept packed in active, so the cost
+// of going over them depends on how many play rather than on the capacity.
+// Nothing here allocates.
+struct VoicePool
+{
+    Voice voices[VOICE_MAX];
+    uint8_t active[VOICE_MAX];
+    uint8_t free_voices[VOICE_MAX];
+    int capacity = VOICE_MAX;
+    int active_count = 0;
+    int free_count = 0;
+    int peak_count = 0;
+    uint32_t serial = 0;
+    uint32_t steal_count = 0;
+};
+
+// Releases every voice
+void pool_init(VoicePool *pPool, int capacity);
+
+// Voice for a new note on channel. The voice already playing that note is
+// retriggered, otherwise a free one is reset, otherwise the active voice with
+// the lowest priority (then the quietest, then the oldest) is stolen if its
+// priority isn't above the new note's. Returns nullptr if the note is dropped.
+// When a voice gets stolen and pStolen is set, it receives the voice as it
+// was, otherwise pStolen is left alone.
+Voice *pool_note_on(VoicePool *pPool, int channel, int note_id, int priority, Voice *pStolen = nullptr);
+
+// Voice playing note on channel, if any
+Voice *pool_find(VoicePool *pPool, int channel, int note_id);
+
+void pool_release(VoicePool *pPool, Voice *pVoice);
+
+// Puts back voices saved in active order, the same order they'll be mixed in
+void pool_restore(VoicePool *pPool, const Voice *pVoices, int count, uint32_t serial);
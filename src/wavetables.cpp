@@ -0,0 +1,206 @@
+#include "wavetables.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <complex>
+
+#define WT_MIN_BITS 6
+#define WT_MAX_BITS 11
+
+static const double PI = 3.14159265358979323846;
+static const double PULSE_DUTIES[] = { 0.125, 0.25, 0.5, 0.75 };
+
+// In place radix-2 FFT, with a positive exponent so setting the harmonics and
+// transforming gives the waveform directly.
+static void inverse_fft(std::vector<std::complex<double>>& data)
+{
+    size_t n = data.size();
+    for (size_t i = 1, j = 0; i < n; ++i)
+    {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) std::swap(data[i], data[j]);
+    }
+
+    for (size_t len = 2; len <= n; len <<= 1)
+    {
+        double angle = 2.0 * PI / (double)len;
+        std::complex<double> wlen(std::cos(angle), std::sin(angle));
+        for (size_t i = 0; i < n; i += len)
+        {
+            std::complex<double> w(1.0);
+            for (size_t j = 0; j < len / 2; ++j)
+            {
+                auto u = data[i + j];
+                auto v = data[i + j + len / 2] * w;
+                data[i + j] = u + v;
+                data[i + j + len / 2] = u - v;
+                w *= wlen;
+            }
+        }
+    }
+}
+
+// Enough samples to hold every audible harmonic, with some room for the
+// linear interpolation.
+static int table_bits(int harmonics)
+{
+    int bits = WT_MIN_BITS;
+    while (bits < WT_MAX_BITS && (1 << bits) < harmonics * 4) ++bits;
+    return bits;
+}
+
+static int harmonic_count(uint32_t sample_rate, float freq, int bits)
+{
+    int harmonics = (int)((double)sample_rate * 0.5 / (double)freq);
+    return std::max(1, std::min(harmonics, (1 << bits) / 2 - 1));
+}
+
+// Same waveforms as the naive voices: the pulse is +1 for phase < duty and -1
+// after, the triangle goes from -1 at phase 0 up to 1 at phase 0.5.
+static void build_table(Wavetable *pTable, uint32_t sample_rate, int shape, float freq)
+{
+    int bits = table_bits(harmonic_count(sample_rate, freq, WT_MAX_BITS));
+    int harmonics = harmonic_count(sample_rate, freq, bits);
+    size_t n = (size_t)1 << bits;
+
+    std::vector<std::complex<double>> spectrum(n);
+    if (shape == WT_TRIANGLE)
+    {
+        for (int k = 1; k <= harmonics; k += 2)
+        {
+            double amp = -4.0 / (PI * PI * (double)k * (double)k);
+            spectrum[k] = amp;
+            spectrum[n - k] = amp;
+        }
+    }
+    else
+    {
+        double duty = PULSE_DUTIES[shape];
+        spectrum[0] = 2.0 * duty - 1.0;
+        for (int k = 1; k <= harmonics; ++k)
+        {
+            double theta = 2.0 * PI * (double)k * duty;
+            auto c = (1.0 - std::polar(1.0, -theta)) / std::complex<double>(0.0, PI * (double)k);
+            spectrum[k] = c;
+            spectrum[n - k] = std::conj(c);
+        }
+    }
+    inverse_fft(spectrum);
+
+    pTable->length_bits = bits;
+    pTable->samples.resize(n + 1);
+    for (size_t i = 0; i < n; ++i)
+    {
+        pTable->samples[i] = (float)spectrum[i].real();
+    }
+    pTable->samples[n] = pTable->samples[0];
+}
+
+static size_t octave_size(const WavetableCache *pCache, int octave)
+{
+    size_t size = 0;
+    for (int i = 0; i < WT_OCTAVE_NOTES; ++i)
+    {
+        int note_id = octave * WT_OCTAVE_NOTES + i;
+        if (note_id >= pCache->note_count) break;
+        int bits = table_bits(harmonic_count(pCache->sample_rate, pCache->pNoteFreqs[note_id], WT_MAX_BITS));
+        size += (((size_t)1 << bits) + 1) * sizeof(float);
+    }
+    return size;
+}
+
+void wt_init(WavetableCache *pCache, uint32_t sample_rate, size_t budget, const float *pNoteFreqs, int noteCount)
+{
+    pCache->sample_rate = sample_rate;
+    pCache->budget = budget;
+    pCache->used = 0;
+    pCache->pNoteFreqs = pNoteFreqs;
+    pCache->note_count = std::max(noteCount, 0);
+    pCache->octave_count = (pCache->note_count + WT_OCTAVE_NOTES - 1) / WT_OCTAVE_NOTES;
+    pCache->octaves.clear();
+    pCache->octaves.resize((size_t)WT_SHAPE_COUNT * pCache->octave_count);
+}
+
+const Wavetable *wt_get(WavetableCache *pCache, int shape, int note_id)
+{
+    if (note_id < 0 || note_id >= pCache->note_count) return nullptr;
+
+    auto& octave = pCache->octaves[(size_t)shape * pCache->octave_count + note_id / WT_OCTAVE_NOTES];
+    if (!octave.built && !octave.failed)
+    {
+        size_t size = octave_size(pCache, note_id / WT_OCTAVE_NOTES);
+        if (pCache->used + size > pCache->budget)
+        {
+            fprintf(stderr, "Wavetable budget exceeded, octave %i uses naive voices\n", note_id / WT_OCTAVE_NOTES);
+            octave.failed = true;
+            return nullptr;
+        }
+
+        int first = note_id - note_id % WT_OCTAVE_NOTES;
+        for (int i = 0; i < WT_OCTAVE_NOTES && first + i < pCache->note_count; ++i)
+        {
+            build_table(octave.tables + i, pCache->sample_rate, shape, pCache->pNoteFreqs[first + i]);
+        }
+        pCache->used += size;
+        octave.built = true;
+    }
+
+    return octave.failed ? nullptr : octave.tables + note_id % WT_OCTAVE_NOTES;
+}
+
+void wt_build_all(WavetableCache *pCache)
+{
+    // The default voices first, in case the budget runs out
+    static const int SHAPES[] = { WT_PULSE_50, WT_TRIANGLE, WT_PULSE_25, WT_PULSE_12, WT_PULSE_75 };
+    for (int shape : SHAPES)
+    {
+        for (int note_id = 0; note_id < pCache->note_count; note_id += WT_OCTAVE_NOTES)
+        {
+            wt_get(pCache, shape, note_id);
+        }
+    }
+}
+
+int wt_pulse_shape(uint32_t duty)
+{
+    double d = (double)duty / 4294967296.0;
+    int best = WT_PULSE_12;
+    for (int i = 1; i < 4; ++i)
+    {
+        if (std::fabs(PULSE_DUTIES[i] - d) < std::fabs(PULSE_DUTIES[best] - d)) best = i;
+    }
+    return best;
+}
+
+void wt_render(const Wavetable *pTable, OscVoice *pVoice, float *pMix, int count)
+{
+    const int shift = 32 - pTable->length_bits;
+    const float *pSamples = pTable->samples.data();
+    const float fracScale = 1.0f / (float)(1u << shift);
+    const float volScale = 1.0f / (float)OSC_VOL_ONE;
+
+    int active = osc_active_count(pVoice, count);
+    uint32_t phase = pVoice->phase;
+    int32_t vol = pVoice->vol;
+
+    for (int i = 0; i < active; ++i)
+    {
+        phase += pVoice->step;
+        uint32_t index = phase >> shift;
+        float frac = (float)(phase & ((1u << shift) - 1)) * fracScale;
+        float a = pSamples[index];
+        float sample = a + (pSamples[index + 1] - a) * frac;
+        pMix[i] += sample * ((float)vol * volScale);
+        vol -= pVoice->sustain;
+    }
+
+    osc_skip(pVoice, count);
+}
+
+size_t wt_memory_used(const WavetableCache *pCache)
+{
+    return pCache->used;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "oscillators.h"
+
+#define WT_PULSE_12 0
+#define WT_PULSE_25 1
+#define WT_PULSE_50 2
+#define WT_PULSE_75 3
+#define WT_TRIANGLE 4
+#define WT_SHAPE_COUNT 5
+
+#define WT_DEFAULT_BUDGET (8 * 1024 * 1024)
+#define WT_OCTAVE_NOTES 12
+
+// One cycle of a waveform with only the harmonics below Nyquist. Has one
+// extra sample wrapping to the start so interpolation never needs a modulo.
+struct Wavetable
+{
+    int length_bits = 0;
+    std::vector<float> samples;
+};
+
+struct WavetableOctave
+{
+    bool built = false;
+    bool failed = false;            // Didn't fit in the budget
+    Wavetable tables[WT_OCTAVE_NOTES];
+};
+
+// Tables of every shape and note for one sample rate. Each player can have
+// its own, or several can share one built up front.
+struct WavetableCache
+{
+    uint32_t sample_rate = 0;
+    size_t budget = 0;
+    size_t used = 0;
+    const float *pNoteFreqs = nullptr;
+    int note_count = 0;
+    int octave_count = 0;
+    std::vector<WavetableOctave> octaves;   // WT_SHAPE_COUNT runs of octave_count
+};
+
+// Clears the cache. Tables are then built for a whole octave the first time
+// one of its notes is requested, as long as they fit in budget bytes.
+void wt_init(WavetableCache *pCache, uint32_t sample_rate, size_t budget, const float *pNoteFreqs, int noteCount);
+
+// Returns nullptr if the octave doesn't fit in the budget, the naive voices
+// should be used then.
+const Wavetable *wt_get(WavetableCache *pCache, int shape, int note_id);
+
+// Builds every table that fits in the budget. wt_get() is then read only and
+// the cache can be shared by players on several threads.
+void wt_build_all(WavetableCache *pCache);
+
+// Closest table shape for a pulse duty cycle
+int wt_pulse_shape(uint32_t duty);
+
+// Same contract as the OscKernel functions, but plays the table with linear
+// interpolation and no 4-bit quantization (which would bring the aliasing
+// right back).
+void wt_render(const Wavetable *pTable, OscVoice *pVoice, float *pMix, int count);
+
+size_t wt_memory_used(const WavetableCache *pCache);
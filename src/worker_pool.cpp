@@ -0,0 +1,99 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+
+static void run_items(WorkerPool *pWorkers, WorkerFunc func, void *pContext, int count)
+{
+    for (int i = pWorkers->next++; i < count; i = pWorkers->next++)
+    {
+        func(pContext, i);
+    }
+}
+
+static void worker_thread(WorkerPool *pWorkers)
+{
+    uint32_t generation = 0;
+    std::unique_lock<std::mutex> lock(pWorkers->mutex);
+    while (true)
+    {
+        pWorkers->wake.wait(lock, [&] { return pWorkers->quit || pWorkers->generation != generation; });
+        if (pWorkers->quit) break;
+        generation = pWorkers->generation;
+
+        WorkerFunc func = pWorkers->func;
+        void *pContext = pWorkers->pContext;
+        int count = pWorkers->count;
+        lock.unlock();
+        run_items(pWorkers, func, pContext, count);
+        lock.lock();
+
+        if (--pWorkers->busy == 0)
+        {
+            pWorkers->done.notify_one();
+        }
+    }
+}
+
+void workers_start(WorkerPool *pWorkers, int threadCount)
+{
+    if (threadCount <= 0)
+    {
+        threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+
+    pWorkers->quit = false;
+    pWorkers->generation = 0;
+    pWorkers->next = 0;
+    for (int i = 1; i < threadCount; ++i)
+    {
+        pWorkers->threads.emplace_back(worker_thread, pWorkers);
+    }
+}
+
+void workers_for(WorkerPool *pWorkers, int count, WorkerFunc func, void *pContext)
+{
+    if (pWorkers->threads.empty() || count <= 1)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            func(pContext, i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pWorkers->mutex);
+        pWorkers->func = func;
+        pWorkers->pContext = pContext;
+        pWorkers->count = count;
+        pWorkers->next = 0;
+        pWorkers->busy = (int)pWorkers->threads.size();
+        ++pWorkers->generation;
+    }
+    pWorkers->wake.notify_all();
+
+    run_items(pWorkers, func, pContext, count);
+
+    std::unique_lock<std::mutex> lock(pWorkers->mutex);
+    pWorkers->done.wait(lock, [&] { return pWorkers->busy == 0; });
+}
+
+void workers_stop(WorkerPool *pWorkers)
+{
+    {
+        std::lock_guard<std::mutex> lock(pWorkers->mutex);
+        pWorkers->quit = true;
+    }
+    pWorkers->wake.notify_all();
+
+    for (auto& thread : pWorkers->threads)
+    {
+        thread.join();
+    }
+    pWorkers->threads.clear();
+}
+
+int workers_thread_count(const WorkerPool *pWorkers)
+{
+    return (int)pWorkers->threads.size() + 1;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef void (*WorkerFunc)(void *pContext, int index);
+
+// Fixed set of threads running parallel loops. The calling thread takes part
+// in the loop too, so a pool of one thread runs everything inline.
+struct WorkerPool
+{
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    WorkerFunc func = nullptr;
+    void *pContext = nullptr;
+    int count = 0;
+    std::atomic<int> next;
+    int busy = 0;               // Threads still working on the current loop
+    uint32_t generation = 0;    // Bumped for each loop
+    bool quit = false;
+};
+
+// threadCount includes the calling thread, 0 uses every core
+void workers_start(WorkerPool *pWorkers, int threadCount);
+
+// Runs func(pContext, i) for every i in [0, count) and waits for all of them
+void workers_for(WorkerPool *pWorkers, int count, WorkerFunc func, void *pContext);
+
+void workers_stop(WorkerPool *pWorkers);
+
+int workers_thread_count(const WorkerPool *pWorkers);